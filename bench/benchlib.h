@@ -0,0 +1,225 @@
+/* Helpers shared by the benchmark harnesses in this directory: connecting to
+ * a running psserver, reading lines from a socket, timing and percentiles.
+ */
+#ifndef BENCHLIB_H
+#define BENCHLIB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define BENCH_READ_SIZE 65536
+
+/* Struct containing bytes read from a socket that are yet to be split into
+ * lines */
+typedef struct BenchReader {
+    int fd;
+    char* data;
+    int length;
+    int position;
+    int size;
+} BenchReader;
+
+/* bench_connect()
+ * ---------------
+ * Connects to the psserver listening on the given port of this host, with
+ * Nagle's algorithm disabled so that small requests are not held back.
+ *
+ * port: the port the server is listening on
+ *
+ * Returns: the connected socket (exits with status 1 on failure)
+ */
+static inline int bench_connect(const char* port) {
+    struct addrinfo hints;
+    struct addrinfo* ai;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo("localhost", port, &hints, &ai)) {
+	fprintf(stderr, "bench: unable to resolve port %s\n", port);
+	exit(1);
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+	fprintf(stderr, "bench: unable to connect to port %s\n", port);
+	exit(1);
+    }
+    freeaddrinfo(ai);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int));
+    return fd;
+}
+
+/* bench_send()
+ * ------------
+ * Writes the whole of the given text to the given socket.
+ *
+ * fd: the socket to write to
+ * text: the text to write
+ * length: the number of bytes to write
+ */
+static inline void bench_send(int fd, const char* text, int length) {
+    while (length > 0) {
+	int written = write(fd, text, length);
+	if (written < 0 && errno == EINTR) {
+	    continue;
+	} else if (written <= 0) {
+	    fprintf(stderr, "bench: lost connection to server\n");
+	    exit(1);
+	}
+	text += written;
+	length -= written;
+    }
+}
+
+/* bench_init_reader()
+ * -------------------
+ * Prepares to read lines from the given socket.
+ *
+ * reader: the reader to initialise
+ * fd: the socket to read from
+ */
+static inline void bench_init_reader(BenchReader* reader, int fd) {
+    reader->fd = fd;
+    reader->size = BENCH_READ_SIZE;
+    reader->data = malloc(reader->size);
+    reader->length = 0;
+    reader->position = 0;
+}
+
+/* bench_read_line()
+ * -----------------
+ * Reads the next line from the given reader's socket, replacing its newline
+ * with a null terminator. The line is only valid until the next call.
+ *
+ * reader: the reader to read from
+ *
+ * Returns: the line, or NULL if the connection closed
+ */
+static inline char* bench_read_line(BenchReader* reader) {
+    while (1) {
+	char* newline = memchr(reader->data + reader->position, '\n',
+		reader->length - reader->position);
+	if (newline != NULL) {
+	    char* line = reader->data + reader->position;
+	    *newline = '\0';
+	    reader->position = newline - reader->data + 1;
+	    return line;
+	}
+
+	// Keep the partial line and make room after it
+	memmove(reader->data, reader->data + reader->position,
+		reader->length - reader->position);
+	reader->length -= reader->position;
+	reader->position = 0;
+	if (reader->length == reader->size) {
+	    reader->size *= 2;
+	    reader->data = realloc(reader->data, reader->size);
+	}
+	int bytes = read(reader->fd, reader->data + reader->length,
+		reader->size - reader->length);
+	if (bytes < 0 && errno == EINTR) {
+	    continue;
+	} else if (bytes <= 0) {
+	    return NULL;
+	}
+	reader->length += bytes;
+    }
+}
+
+/* bench_read_bytes()
+ * ------------------
+ * Reads the given number of bytes from the given reader's socket, such as a
+ * compressed block following its header line. The bytes are only valid 
+ * until the next call.
+ *
+ * reader: the reader to read from
+ * count: the number of bytes to read
+ *
+ * Returns: the bytes, or NULL if the connection closed first
+ */
+static inline char* bench_read_bytes(BenchReader* reader, int count) {
+    while (reader->length - reader->position < count) {
+	memmove(reader->data, reader->data + reader->position,
+		reader->length - reader->position);
+	reader->length -= reader->position;
+	reader->position = 0;
+	while (reader->size < count) {
+	    reader->size *= 2;
+	    reader->data = realloc(reader->data, reader->size);
+	}
+	int bytes = read(reader->fd, reader->data + reader->length,
+		reader->size - reader->length);
+	if (bytes < 0 && errno == EINTR) {
+	    continue;
+	} else if (bytes <= 0) {
+	    return NULL;
+	}
+	reader->length += bytes;
+    }
+    char* bytes = reader->data + reader->position;
+    reader->position += count;
+    return bytes;
+}
+
+/* bench_buffered()
+ * ----------------
+ * Checks whether the given reader already holds a complete line.
+ *
+ * reader: the reader to check
+ *
+ * Returns: 1 if a line can be read without blocking, else 0
+ */
+static inline int bench_buffered(BenchReader* reader) {
+    return memchr(reader->data + reader->position, '\n',
+	    reader->length - reader->position) != NULL;
+}
+
+/* bench_now()
+ * -----------
+ * Returns: the CLOCK_MONOTONIC time in nanoseconds
+ */
+static inline long long bench_now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+/* compare_long_long()
+ * -------------------
+ * qsort() comparison function for long long values.
+ */
+static inline int compare_long_long(const void* a, const void* b) {
+    long long x = *(const long long*) a;
+    long long y = *(const long long*) b;
+    return x < y ? -1 : x > y;
+}
+
+/* bench_percentile()
+ * ------------------
+ * Finds a percentile of the given samples, sorting them in place.
+ *
+ * samples: the samples
+ * count: the number of samples
+ * fraction: the percentile as a fraction, e.g. 0.99
+ *
+ * Returns: the sample at that percentile, or 0 if there are none
+ */
+static inline long long bench_percentile(long long* samples, int count,
+	double fraction) {
+    if (count == 0) {
+	return 0;
+    }
+    qsort(samples, count, sizeof(long long), compare_long_long);
+    int index = fraction * count;
+    return samples[index < count ? index : count - 1];
+}
+
+#endif
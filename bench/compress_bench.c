@@ -0,0 +1,248 @@
+/* Message compression ratio and CPU benchmark.
+ *
+ * Usage: compress_bench port messages subscribers [serverPid]
+ *
+ * Publishes the given number of structured, market data like messages
+ * (300 to 400 bytes each) to a running psserver, first to subscribers that
+ * negotiated "compress none" and then to subscribers that negotiated
+ * "compress deflate". For each codec it reports the bytes each subscriber
+ * received on the wire, the ratio to the uncompressed size, the elapsed time,
+ * the CPU time spent inflating per subscriber and, if the server's process
+ * ID is given, the CPU time the server used. Every compressed frame is
+ * inflated and checked against the message that was published.
+ */
+#include <pthread.h>
+#include <zlib.h>
+#include "benchlib.h"
+
+#define PUBLISH_BATCH 64
+#define MESSAGE_SIZE 1024
+#define FIELD_COUNT 8
+
+/* Struct containing one subscriber's connection and its tallies */
+typedef struct Subscriber {
+    int fd;
+    int messages;
+    long wireBytes;
+    long rawBytes;
+    long long inflateNs;
+    int corrupt;
+    pthread_t thread;
+} Subscriber;
+
+static char** corpus;
+
+/* make_message()
+ * --------------
+ * Formats the value of the given message of the corpus: a run of fields
+ * that repeat between messages with values that mostly do not.
+ *
+ * value: the buffer to format into
+ * index: the message's index
+ *
+ * Returns: the length of the value
+ */
+static int make_message(char* value, int index) {
+    static const char* symbols[] = {"ACME", "BHP", "CBA", "CSL", "NAB",
+	    "RIO", "TLS", "WBC", "WES", "WOW"};
+    int length = sprintf(value, "seq=%d sym=%s side=%c", index,
+	    symbols[rand() % 10], rand() % 2 ? 'B' : 'S');
+    for (int i = 0; i < FIELD_COUNT; i++) {
+	length += sprintf(value + length, " level%d={px=%d.%02d,qty=%d,"
+		"orders=%d}", i, 10 + rand() % 90, rand() % 100,
+		100 * (1 + rand() % 50), 1 + rand() % 9);
+    }
+    return length;
+}
+
+/* cpu_ns()
+ * --------
+ * Reads the CPU time used by the given process, or by the calling thread if
+ * the process ID is 0.
+ *
+ * pid: the process ID
+ *
+ * Returns: the user and system CPU time in nanoseconds (0 if unavailable)
+ */
+static long long cpu_ns(int pid) {
+    if (pid == 0) {
+	struct timespec time;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+	return time.tv_sec * 1000000000LL + time.tv_nsec;
+    }
+    char path[64];
+    sprintf(path, "/proc/%d/stat", pid);
+    FILE* stat = fopen(path, "r");
+    unsigned long user = 0;
+    unsigned long system = 0;
+    if (stat != NULL) {
+	// utime and stime are the 14th and 15th fields, after ") "
+	char buffer[1024];
+	size_t length = fread(buffer, 1, sizeof(buffer) - 1, stat);
+	buffer[length] = '\0';
+	char* fields = strrchr(buffer, ')');
+	if (fields != NULL) {
+	    sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u "
+		    "%*u %lu %lu", &user, &system);
+	}
+	fclose(stat);
+    }
+    return (user + system) * (1000000000LL / sysconf(_SC_CLK_TCK));
+}
+
+/* subscriber_thread()
+ * -------------------
+ * Reads every message of the corpus from one subscriber's connection,
+ * inflating compressed frames against the previous line received and
+ * checking them against the corpus.
+ *
+ * arg: the subscriber
+ */
+static void* subscriber_thread(void* arg) {
+    Subscriber* subscriber = (Subscriber*) arg;
+    BenchReader reader;
+    bench_init_reader(&reader, subscriber->fd);
+    z_stream inflater;
+    memset(&inflater, 0, sizeof(z_stream));
+    inflateInit2(&inflater, -MAX_WBITS);
+    char* previous = malloc(MESSAGE_SIZE);
+    previous[0] = '\0';
+    char* text = malloc(MESSAGE_SIZE);
+    int received = 0;
+    while (received < subscriber->messages) {
+	char* line = bench_read_line(&reader);
+	if (line == NULL) {
+	    break;
+	}
+	subscriber->wireBytes += strlen(line) + 1;
+	int compressedLength;
+	int rawLength;
+	if (sscanf(line, ":z %d %d", &compressedLength, &rawLength) == 2) {
+	    char* block = bench_read_bytes(&reader, compressedLength);
+	    if (block == NULL || rawLength >= MESSAGE_SIZE) {
+		break;
+	    }
+	    subscriber->wireBytes += compressedLength;
+	    long long start = cpu_ns(0);
+	    inflateReset(&inflater);
+	    if (previous[0] != '\0') {
+		inflateSetDictionary(&inflater, (Bytef*) previous,
+			strlen(previous));
+	    }
+	    inflater.next_in = (Bytef*) block;
+	    inflater.avail_in = compressedLength;
+	    inflater.next_out = (Bytef*) text;
+	    inflater.avail_out = rawLength;
+	    if (inflate(&inflater, Z_FINISH) != Z_STREAM_END) {
+		subscriber->corrupt++;
+	    }
+	    text[rawLength] = '\0';
+	    subscriber->inflateNs += cpu_ns(0) - start;
+	} else {
+	    snprintf(text, MESSAGE_SIZE, "%s\n", line);
+	}
+
+	// Every line received is the next dictionary
+	strcpy(previous, text);
+	if (!strncmp(text, "p:data:", strlen("p:data:"))) {
+	    text[strlen(text) - 1] = '\0';
+	    if (strcmp(text + strlen("p:data:"), corpus[received])) {
+		subscriber->corrupt++;
+	    }
+	    subscriber->rawBytes += strlen(text) + 1;
+	    received++;
+	}
+    }
+    inflateEnd(&inflater);
+    free(previous);
+    free(text);
+    free(reader.data);
+    return NULL;
+}
+
+/* run_codec()
+ * -----------
+ * Publishes the corpus to the given number of new subscribers that have
+ * negotiated the given codec and reports the results.
+ *
+ * port: the port the server is listening on
+ * codec: "none" or "deflate"
+ * messages: the number of messages in the corpus
+ * count: the number of subscribers
+ * serverPid: the server's process ID, or 0 if unknown
+ */
+static void run_codec(char* port, char* codec, int messages, int count,
+	int serverPid) {
+    Subscriber* subscribers = calloc(count, sizeof(Subscriber));
+    for (int i = 0; i < count; i++) {
+	char command[64];
+	int length = sprintf(command, "name s%d\nsub data\ncompress %s\n",
+		i, codec);
+	subscribers[i].fd = bench_connect(port);
+	subscribers[i].messages = messages;
+	bench_send(subscribers[i].fd, command, length);
+	pthread_create(&subscribers[i].thread, NULL, subscriber_thread,
+		&subscribers[i]);
+    }
+    int publisher = bench_connect(port);
+    bench_send(publisher, "name p\n", strlen("name p\n"));
+    usleep(200000); // Let every subscription land
+
+    long long start = bench_now();
+    long long serverStart = serverPid ? cpu_ns(serverPid) : 0;
+    char* batch = malloc(PUBLISH_BATCH * (MESSAGE_SIZE + 16));
+    for (int sent = 0; sent < messages; ) {
+	int length = 0;
+	for (int i = 0; i < PUBLISH_BATCH && sent < messages; i++, sent++) {
+	    length += sprintf(batch + length, "pub data %s\n", corpus[sent]);
+	}
+	bench_send(publisher, batch, length);
+    }
+    long wire = 0;
+    long raw = 0;
+    long long inflateNs = 0;
+    int corrupt = 0;
+    for (int i = 0; i < count; i++) {
+	pthread_join(subscribers[i].thread, NULL);
+	wire += subscribers[i].wireBytes;
+	raw += subscribers[i].rawBytes;
+	inflateNs += subscribers[i].inflateNs;
+	corrupt += subscribers[i].corrupt;
+	close(subscribers[i].fd);
+    }
+    double seconds = (bench_now() - start) / 1e9;
+    long long serverNs = serverPid ? cpu_ns(serverPid) - serverStart : 0;
+    close(publisher);
+
+    printf("%-7s: %.2f MB per subscriber on the wire, ratio %.3f, %.2f s, "
+	    "inflate %.1f ms per subscriber", codec, wire / 1e6 / count,
+	    (double) wire / raw, seconds, inflateNs / 1e6 / count);
+    if (serverPid) {
+	printf(", server CPU %.0f ms", serverNs / 1e6);
+    }
+    printf("%s\n", corrupt ? ", CORRUPT MESSAGES" : "");
+    free(batch);
+    free(subscribers);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+	fprintf(stderr, "Usage: compress_bench port messages subscribers "
+		"[serverPid]\n");
+	return 1;
+    }
+    char* port = argv[1];
+    int messages = atoi(argv[2]);
+    int count = atoi(argv[3]);
+    int serverPid = argc > 4 ? atoi(argv[4]) : 0;
+
+    srand(1);
+    corpus = malloc(sizeof(char*) * messages);
+    for (int i = 0; i < messages; i++) {
+	corpus[i] = malloc(MESSAGE_SIZE);
+	make_message(corpus[i], i);
+    }
+    run_codec(port, "none", messages, count, serverPid);
+    run_codec(port, "deflate", messages, count, serverPid);
+    return 0;
+}
@@ -0,0 +1,112 @@
+/* Consumer group benchmark.
+ *
+ * Usage: group_bench port members messages [slowMembers]
+ *
+ * Joins the given number of members to the consumer group "bench" on the
+ * topic "work" of a running psserver, publishes the given number of messages
+ * to the topic as fast as possible and reports the delivery rate and how the
+ * messages were spread over the members. The first slowMembers members
+ * sleep for a millisecond per message, to show that members with a deep
+ * queue are passed over.
+ */
+#include <pthread.h>
+#include "benchlib.h"
+
+#define SLOW_MICROSECONDS 1000
+#define PUBLISH_BATCH 64
+
+/* Struct containing one group member's connection and its tally */
+typedef struct Member {
+    int fd;
+    int slow;
+    int received;
+    pthread_t thread;
+} Member;
+
+static int delivered;
+
+/* member_thread()
+ * ---------------
+ * Counts the messages delivered to one member until its connection is shut
+ * down.
+ */
+static void* member_thread(void* arg) {
+    Member* member = (Member*) arg;
+    BenchReader reader;
+    bench_init_reader(&reader, member->fd);
+    char* line;
+    while ((line = bench_read_line(&reader)) != NULL) {
+	if (line[0] == ':') {
+	    continue;
+	}
+	member->received++;
+	__sync_add_and_fetch(&delivered, 1);
+	if (member->slow) {
+	    usleep(SLOW_MICROSECONDS);
+	}
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+	fprintf(stderr, "Usage: group_bench port members messages "
+		"[slowMembers]\n");
+	return 1;
+    }
+    char* port = argv[1];
+    int count = atoi(argv[2]);
+    int messages = atoi(argv[3]);
+    int slow = argc > 4 ? atoi(argv[4]) : 0;
+
+    Member* members = calloc(count, sizeof(Member));
+    for (int i = 0; i < count; i++) {
+	char join[64];
+	members[i].fd = bench_connect(port);
+	members[i].slow = i < slow;
+	int length = sprintf(join, "name member%d\nsub $group/bench work\n",
+		i);
+	bench_send(members[i].fd, join, length);
+    }
+    int publisher = bench_connect(port);
+    bench_send(publisher, "name publisher\n", strlen("name publisher\n"));
+    usleep(200000); // Let every subscription land
+
+    for (int i = 0; i < count; i++) {
+	pthread_create(&members[i].thread, NULL, member_thread, &members[i]);
+    }
+    long long start = bench_now();
+    char batch[PUBLISH_BATCH * 32];
+    for (int sent = 0; sent < messages; ) {
+	int length = 0;
+	for (int i = 0; i < PUBLISH_BATCH && sent < messages; i++, sent++) {
+	    length += sprintf(batch + length, "pub work %d\n", sent);
+	}
+	bench_send(publisher, batch, length);
+    }
+    while (__atomic_load_n(&delivered, __ATOMIC_RELAXED) < messages) {
+	usleep(1000);
+    }
+    double seconds = (bench_now() - start) / 1e9;
+    for (int i = 0; i < count; i++) {
+	shutdown(members[i].fd, SHUT_RDWR);
+	pthread_join(members[i].thread, NULL);
+    }
+
+    int fewest = messages;
+    int most = 0;
+    int slowTotal = 0;
+    for (int i = 0; i < count; i++) {
+	fewest = members[i].received < fewest ? members[i].received : fewest;
+	most = members[i].received > most ? members[i].received : most;
+	slowTotal += members[i].slow ? members[i].received : 0;
+    }
+    printf("%d members (%d slow), %d messages: %.0f msg/s, "
+	    "per member min %d max %d", count, slow, messages,
+	    messages / seconds, fewest, most);
+    if (slow > 0) {
+	printf(", slow members took %.1f%%", 100.0 * slowTotal / messages);
+    }
+    printf("\n");
+    return 0;
+}
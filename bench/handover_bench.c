@@ -0,0 +1,109 @@
+/* Hot restart pause benchmark.
+ *
+ * Usage: handover_bench port clients [seconds]
+ *
+ * Connects the given number of idle clients to a running psserver, each
+ * subscribed to a topic of its own, then publishes a timestamped probe
+ * every millisecond from one more client to another for the given number
+ * of seconds (default 10), printing "ready" once probing has begun. Start
+ * the new server with PSSERVER_TAKEOVER then (bench/handover_bench.sh does
+ * this). Every probe published during the handover waits for it, so the
+ * largest probe latency is the pause clients see. Reports how many probes
+ * arrived and their latency as p50, p99 and max.
+ */
+#include <pthread.h>
+#include <sys/resource.h>
+#include "benchlib.h"
+
+#define PROBE_MICROSECONDS 1000
+#define MAX_PROBES 1000000
+
+static volatile int running = 1;
+static int published = 0;
+
+/* probe_thread()
+ * --------------
+ * Publishes a timestamped probe every PROBE_MICROSECONDS until the
+ * benchmark ends.
+ *
+ * arg: the publisher's socket
+ */
+static void* probe_thread(void* arg) {
+    int fd = *(int*) arg;
+    char probe[64];
+    while (running) {
+	bench_send(fd, probe, sprintf(probe, "pub probe %lld\n",
+		bench_now()));
+	published++;
+	usleep(PROBE_MICROSECONDS);
+    }
+    bench_send(fd, probe, sprintf(probe, "pub probe 0\n"));
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3 || atoi(argv[2]) < 0) {
+	fprintf(stderr, "Usage: handover_bench port clients [seconds]\n");
+	return 1;
+    }
+    char* port = argv[1];
+    int count = atoi(argv[2]);
+    int seconds = argc > 3 ? atoi(argv[3]) : 10;
+
+    // One socket per client - raise the soft limit as far as allowed
+    struct rlimit files;
+    getrlimit(RLIMIT_NOFILE, &files);
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+
+    long long start = bench_now();
+    int* clients = malloc(sizeof(int) * count);
+    for (int i = 0; i < count; i++) {
+	char join[64];
+	clients[i] = bench_connect(port);
+	bench_send(clients[i], join, sprintf(join, "name c%d\nsub t%d\n", i,
+		i));
+    }
+    double connectSeconds = (bench_now() - start) / 1e9;
+
+    int subscriber = bench_connect(port);
+    char* setup = "name probes\nsub probe\n";
+    bench_send(subscriber, setup, strlen(setup));
+    int publisher = bench_connect(port);
+    bench_send(publisher, "name prober\n", strlen("name prober\n"));
+    usleep(200000); // Let the subscription land
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, probe_thread, &publisher);
+    printf("ready\n");
+    fflush(stdout);
+
+    long long* latencies = malloc(sizeof(long long) * MAX_PROBES);
+    int probes = 0;
+    BenchReader reader;
+    bench_init_reader(&reader, subscriber);
+    long long end = bench_now() + seconds * 1000000000LL;
+    char* line;
+    while ((line = bench_read_line(&reader)) != NULL) {
+	// "prober:probe:<sent>", the last one sent as 0
+	long long sent = atoll(strrchr(line, ':') + 1);
+	if (sent == 0) {
+	    break;
+	}
+	if (probes < MAX_PROBES) {
+	    latencies[probes++] = bench_now() - sent;
+	}
+	if (running && bench_now() >= end) {
+	    running = 0;
+	}
+    }
+    pthread_join(thread, NULL);
+
+    printf("%d idle clients (connected in %.1f s): %d of %d probes "
+	    "received, latency p50 %.2f ms p99 %.2f ms max %.2f ms\n", count,
+	    connectSeconds, probes, published,
+	    bench_percentile(latencies, probes, 0.5) / 1e6,
+	    bench_percentile(latencies, probes, 0.99) / 1e6,
+	    bench_percentile(latencies, probes, 1.0) / 1e6);
+    return 0;
+}
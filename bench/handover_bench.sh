@@ -0,0 +1,62 @@
+#!/bin/sh
+# Hot restart pause benchmark.
+#
+# Usage: bench/handover_bench.sh clients [seconds]
+#
+# Starts a psserver that can hand over, connects the given number of idle
+# clients and a probe to it with handover_bench, then starts a new server
+# that takes over from it part way through the given number of seconds
+# (default 10). Prints the probe latency, whose maximum is the pause clients
+# see, and the new server's own timing of the takeover. Run `make` and
+# `make bench` first.
+#
+# Each client has a reader and a writer thread in the server, and the new
+# server starts its writers before the old one exits, so the system must
+# allow about three threads per client: check kernel.threads-max,
+# kernel.pid_max, vm.max_map_count (two mappings per thread) and
+# `ulimit -u`, and `ulimit -n` for the sockets.
+
+if [ $# -lt 1 ]; then
+    echo "Usage: bench/handover_bench.sh clients [seconds]" >&2
+    exit 1
+fi
+cd "$(dirname "$0")/.." || exit 1
+clients=$1
+duration=${2:-10}
+ulimit -n "$(ulimit -Hn)"
+socket=$(mktemp -u)
+log=$(mktemp)
+newlog=$(mktemp)
+output=$(mktemp)
+
+PSSERVER_HANDOVER_PATH=$socket ./psserver 0 2>"$log" &
+server=$!
+
+# The port is the first line of standard error that is a number
+port=
+while [ -z "$port" ] && kill -0 "$server" 2>/dev/null; do
+    sleep 0.1
+    port=$(grep -m 1 -x '[0-9][0-9]*' "$log")
+done
+if [ -z "$port" ]; then
+    cat "$log" >&2
+    exit 1
+fi
+
+bench/handover_bench "$port" "$clients" "$duration" >"$output" &
+bench=$!
+while ! grep -q ready "$output" && kill -0 "$bench" 2>/dev/null; do
+    sleep 0.1
+done
+sleep 1
+
+PSSERVER_HANDOVER_PATH=$socket PSSERVER_TAKEOVER=$socket ./psserver 0 \
+    2>"$newlog" &
+new=$!
+wait "$bench"
+grep -v ready "$output"
+grep "took over" "$newlog"
+grep "handover" "$log" "$newlog" | grep -v "took over"
+kill "$new" "$server" 2>/dev/null
+wait 2>/dev/null
+rm -f "$log" "$newlog" "$output" "$socket"
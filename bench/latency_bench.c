@@ -0,0 +1,129 @@
+/* Priority lane tail latency benchmark.
+ *
+ * Usage: latency_bench port seconds [plain]
+ *
+ * Subscribes one client to a bulk topic on the low priority lane and a probe
+ * topic on the high priority lane of a running psserver, floods the bulk
+ * topic with 1 kB messages from one publisher and publishes a timestamped
+ * probe every millisecond from another. The subscriber reads a limited
+ * number of lines per millisecond so that its queue stays saturated, and the
+ * latency of every probe is reported as p50, p99 and max. With "plain" both
+ * subscriptions use the normal lane, to compare against a single FIFO.
+ */
+#include <pthread.h>
+#include "benchlib.h"
+
+#define BULK_SIZE 1000
+#define BULK_BATCH 16
+#define PROBE_MICROSECONDS 1000
+#define LINES_PER_MILLISECOND 20
+#define MAX_PROBES 1000000
+
+static volatile int running = 1;
+
+/* bulk_thread()
+ * -------------
+ * Publishes batches of bulk messages until the benchmark ends.
+ *
+ * arg: the publisher's socket
+ */
+static void* bulk_thread(void* arg) {
+    int fd = *(int*) arg;
+    char value[BULK_SIZE + 1];
+    memset(value, 'b', BULK_SIZE);
+    value[BULK_SIZE] = '\0';
+    char* batch = malloc(BULK_BATCH * (BULK_SIZE + 16));
+    int length = 0;
+    for (int i = 0; i < BULK_BATCH; i++) {
+	length += sprintf(batch + length, "pub bulk %s\n", value);
+    }
+    while (running) {
+	bench_send(fd, batch, length);
+    }
+    free(batch);
+    return NULL;
+}
+
+/* probe_thread()
+ * --------------
+ * Publishes a probe carrying the time it was sent every millisecond until
+ * the benchmark ends.
+ *
+ * arg: the publisher's socket
+ */
+static void* probe_thread(void* arg) {
+    int fd = *(int*) arg;
+    char probe[64];
+    while (running) {
+	int length = sprintf(probe, "pub probe %lld\n", bench_now());
+	bench_send(fd, probe, length);
+	usleep(PROBE_MICROSECONDS);
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+	fprintf(stderr, "Usage: latency_bench port seconds [plain]\n");
+	return 1;
+    }
+    char* port = argv[1];
+    long long duration = atoll(argv[2]) * 1000000000LL;
+    int plain = argc > 3 && !strcmp(argv[3], "plain");
+
+    int subscriber = bench_connect(port);
+    char* subs = plain ? "name sub\nsub bulk normal\nsub probe normal\n" :
+	    "name sub\nsub bulk low\nsub probe high\n";
+    bench_send(subscriber, subs, strlen(subs));
+    int bulk = bench_connect(port);
+    bench_send(bulk, "name bulk\n", strlen("name bulk\n"));
+    int prober = bench_connect(port);
+    bench_send(prober, "name prober\n", strlen("name prober\n"));
+    usleep(200000); // Let every subscription land
+
+    pthread_t bulkThread;
+    pthread_t probeThread;
+    pthread_create(&bulkThread, NULL, bulk_thread, &bulk);
+    pthread_create(&probeThread, NULL, probe_thread, &prober);
+
+    long long* latencies = malloc(sizeof(long long) * MAX_PROBES);
+    int probes = 0;
+    long bulkLines = 0;
+    BenchReader reader;
+    bench_init_reader(&reader, subscriber);
+    long long start = bench_now();
+    long long tick = start;
+    int budget = LINES_PER_MILLISECOND;
+    char* line;
+    while (bench_now() - start < duration &&
+	    (line = bench_read_line(&reader)) != NULL) {
+	if (!strncmp(line, "prober:probe:", strlen("prober:probe:"))) {
+	    if (probes < MAX_PROBES) {
+		latencies[probes++] = bench_now() -
+			atoll(line + strlen("prober:probe:"));
+	    }
+	} else if (!strncmp(line, "bulk:bulk:", strlen("bulk:bulk:"))) {
+	    bulkLines++;
+	}
+
+	// Consume slower than the bulk publisher to keep the queue full
+	if (--budget == 0) {
+	    tick += 1000000;
+	    long long wait = tick - bench_now();
+	    if (wait > 0) {
+		usleep(wait / 1000);
+	    }
+	    budget = LINES_PER_MILLISECOND;
+	}
+    }
+    running = 0;
+
+    // Publishers may be blocked on a full socket - exiting stops them
+    printf("%s lanes: %d probes, %ld bulk messages, latency p50 %.2f ms "
+	    "p99 %.2f ms max %.2f ms\n", plain ? "plain" : "priority",
+	    probes, bulkLines,
+	    bench_percentile(latencies, probes, 0.5) / 1e6,
+	    bench_percentile(latencies, probes, 0.99) / 1e6,
+	    bench_percentile(latencies, probes, 1.0) / 1e6);
+    return 0;
+}
@@ -0,0 +1,278 @@
+/* Publisher overload benchmark.
+ *
+ * Usage: overload_bench port pid credit|plain [messages] [fanout]
+ *
+ * Subscribes one slow client, which reads at most SLOW_BYTES_PER_SECOND,
+ * and the given number of fast clients (default 0), which read as fast as
+ * they can, to one topic of a running psserver, then publishes the given
+ * number of timestamped 200 byte messages (default 60000) to it from one
+ * publisher as fast as it is allowed. With "credit" the publisher turns on
+ * flow control and waits for credit before each publish; with "plain" it
+ * publishes regardless, so the slow client's queue grows instead. A probe
+ * on a topic of its own is published every millisecond meanwhile, to show
+ * what a publisher waiting for credit costs everyone else. Reports the
+ * latency of the slow client's messages and of the probes as p50, p99 and
+ * max, and the server's peak RSS (sampled, given its process ID).
+ */
+#include <pthread.h>
+#include <poll.h>
+#include "benchlib.h"
+
+#define DEFAULT_MESSAGES 60000
+#define MESSAGE_PAD 180
+#define SLOW_BYTES_PER_SECOND 3000000
+#define PROBE_MICROSECONDS 1000
+#define MAX_PROBES 1000000
+#define RSS_SAMPLE_MICROSECONDS 20000
+
+static int messages;
+static volatile int running = 1;
+static int credits = 0;
+static pthread_mutex_t creditLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t creditGranted = PTHREAD_COND_INITIALIZER;
+
+/* Struct containing a subscriber's socket and the latencies it saw */
+typedef struct Latencies {
+    int fd;
+    long long* samples;
+    int count;
+} Latencies;
+
+/* sample_latency()
+ * ----------------
+ * Records the latency of a received "<name>:<topic>:<sent>,..." message.
+ *
+ * latencies: where to record it
+ * line: the message
+ * limit: the most samples to keep
+ */
+static void sample_latency(Latencies* latencies, char* line, int limit) {
+    char* sent = strrchr(line, ':');
+    if (sent != NULL && latencies->count < limit) {
+	latencies->samples[latencies->count++] = bench_now() -
+		atoll(sent + 1);
+    }
+}
+
+/* slow_thread()
+ * -------------
+ * Reads the slow subscriber's messages no faster than
+ * SLOW_BYTES_PER_SECOND until every message has arrived.
+ *
+ * arg: the slow subscriber's latencies
+ */
+static void* slow_thread(void* arg) {
+    Latencies* latencies = (Latencies*) arg;
+    BenchReader reader;
+    bench_init_reader(&reader, latencies->fd);
+    long long start = bench_now();
+    long long bytes = 0;
+    char* line;
+    while (latencies->count < messages &&
+	    (line = bench_read_line(&reader)) != NULL) {
+	bytes += strlen(line) + 1;
+	sample_latency(latencies, line, messages);
+	long long ahead = bytes * 1000000000LL / SLOW_BYTES_PER_SECOND -
+		(bench_now() - start);
+	if (ahead > 0 && !bench_buffered(&reader)) {
+	    usleep(ahead / 1000);
+	}
+    }
+    running = 0;
+    free(reader.data);
+    return NULL;
+}
+
+/* fast_thread()
+ * -------------
+ * Reads and discards everything sent to the fast subscribers until the
+ * benchmark ends.
+ *
+ * arg: the fast subscribers' sockets, ended by -1
+ */
+static void* fast_thread(void* arg) {
+    int* fds = (int*) arg;
+    int count = 0;
+    while (fds[count] >= 0) {
+	count++;
+    }
+    struct pollfd* polled = calloc(count, sizeof(struct pollfd));
+    for (int i = 0; i < count; i++) {
+	polled[i].fd = fds[i];
+	polled[i].events = POLLIN;
+    }
+    char* discard = malloc(BENCH_READ_SIZE);
+    while (running) {
+	if (poll(polled, count, 100) <= 0) {
+	    continue;
+	}
+	for (int i = 0; i < count; i++) {
+	    if (polled[i].revents & POLLIN) {
+		read(polled[i].fd, discard, BENCH_READ_SIZE);
+	    }
+	}
+    }
+    free(discard);
+    free(polled);
+    return NULL;
+}
+
+/* credit_thread()
+ * ---------------
+ * Counts the credit granted to the publisher as ":credit <n>".
+ *
+ * arg: the publisher's socket
+ */
+static void* credit_thread(void* arg) {
+    BenchReader reader;
+    bench_init_reader(&reader, *(int*) arg);
+    char* line;
+    while ((line = bench_read_line(&reader)) != NULL) {
+	if (!strncmp(line, ":credit ", strlen(":credit "))) {
+	    pthread_mutex_lock(&creditLock);
+	    credits += atoi(line + strlen(":credit "));
+	    pthread_cond_signal(&creditGranted);
+	    pthread_mutex_unlock(&creditLock);
+	}
+    }
+    free(reader.data);
+    return NULL;
+}
+
+/* probe_thread()
+ * --------------
+ * Publishes a timestamped probe every PROBE_MICROSECONDS and records the
+ * latency of each until the benchmark ends.
+ *
+ * arg: the probe subscriber's latencies, whose socket also publishes
+ */
+static void* probe_thread(void* arg) {
+    Latencies* latencies = (Latencies*) arg;
+    BenchReader reader;
+    bench_init_reader(&reader, latencies->fd);
+    char probe[64];
+    while (running) {
+	bench_send(latencies->fd, probe, sprintf(probe, "pub probe %lld\n",
+		bench_now()));
+	char* line = bench_read_line(&reader);
+	if (line == NULL) {
+	    break;
+	}
+	sample_latency(latencies, line, MAX_PROBES);
+	usleep(PROBE_MICROSECONDS);
+    }
+    free(reader.data);
+    return NULL;
+}
+
+/* peak_rss()
+ * ----------
+ * Returns: the resident set size of the given process in kB, or 0 if it
+ * could not be read
+ */
+static long peak_rss(int pid) {
+    char path[64];
+    char line[256];
+    sprintf(path, "/proc/%d/status", pid);
+    FILE* status = fopen(path, "r");
+    long rss = 0;
+    while (status != NULL && fgets(line, sizeof(line), status) != NULL) {
+	if (!strncmp(line, "VmRSS:", strlen("VmRSS:"))) {
+	    rss = atol(line + strlen("VmRSS:"));
+	}
+    }
+    if (status != NULL) {
+	fclose(status);
+    }
+    return rss;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4 || (strcmp(argv[3], "credit") && strcmp(argv[3], "plain"))) {
+	fprintf(stderr, "Usage: overload_bench port pid credit|plain "
+		"[messages] [fanout]\n");
+	return 1;
+    }
+    char* port = argv[1];
+    int pid = atoi(argv[2]);
+    int credit = !strcmp(argv[3], "credit");
+    messages = argc > 4 ? atoi(argv[4]) : DEFAULT_MESSAGES;
+    int fanout = argc > 5 ? atoi(argv[5]) : 0;
+
+    Latencies slow = {.fd = bench_connect(port),
+	    .samples = malloc(sizeof(long long) * messages), .count = 0};
+    bench_send(slow.fd, "name slow\nsub load\n",
+	    strlen("name slow\nsub load\n"));
+    int* fast = malloc(sizeof(int) * (fanout + 1));
+    for (int i = 0; i < fanout; i++) {
+	fast[i] = bench_connect(port);
+	bench_send(fast[i], "name fast\nsub load\n",
+		strlen("name fast\nsub load\n"));
+    }
+    fast[fanout] = -1;
+    Latencies probes = {.fd = bench_connect(port),
+	    .samples = malloc(sizeof(long long) * MAX_PROBES), .count = 0};
+    bench_send(probes.fd, "name probe\nsub probe\n",
+	    strlen("name probe\nsub probe\n"));
+    int publisher = bench_connect(port);
+    bench_send(publisher, "name load\n", strlen("name load\n"));
+    if (credit) {
+	bench_send(publisher, "credit on\n", strlen("credit on\n"));
+    }
+    usleep(200000); // Let every subscription land
+
+    pthread_t threads[4];
+    pthread_create(&threads[0], NULL, slow_thread, &slow);
+    pthread_create(&threads[1], NULL, fast_thread, fast);
+    pthread_create(&threads[2], NULL, credit_thread, &publisher);
+    pthread_create(&threads[3], NULL, probe_thread, &probes);
+
+    char pad[MESSAGE_PAD + 1];
+    memset(pad, 'x', MESSAGE_PAD);
+    pad[MESSAGE_PAD] = '\0';
+    char message[MESSAGE_PAD + 64];
+    long peak = 0;
+    long long sampled = 0;
+    for (int i = 0; i < messages; i++) {
+	if (credit) {
+	    pthread_mutex_lock(&creditLock);
+	    while (credits == 0) {
+		pthread_cond_wait(&creditGranted, &creditLock);
+	    }
+	    credits--;
+	    pthread_mutex_unlock(&creditLock);
+	}
+	bench_send(publisher, message, sprintf(message, "pub load %lld,%s\n",
+		bench_now(), pad));
+	if (pid > 0 && bench_now() - sampled > RSS_SAMPLE_MICROSECONDS * 1000) {
+	    long rss = peak_rss(pid);
+	    peak = rss > peak ? rss : peak;
+	    sampled = bench_now();
+	}
+    }
+    while (running) {
+	if (pid > 0) {
+	    long rss = peak_rss(pid);
+	    peak = rss > peak ? rss : peak;
+	}
+	usleep(RSS_SAMPLE_MICROSECONDS);
+    }
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    pthread_join(threads[3], NULL);
+
+    printf("%s, %d fast subscribers: slow subscriber p50 %.0f ms p99 %.0f ms "
+	    "max %.0f ms", argv[3], fanout,
+	    bench_percentile(slow.samples, slow.count, 0.5) / 1e6,
+	    bench_percentile(slow.samples, slow.count, 0.99) / 1e6,
+	    bench_percentile(slow.samples, slow.count, 1.0) / 1e6);
+    printf("; probe p50 %.2f ms p99 %.2f ms max %.2f ms",
+	    bench_percentile(probes.samples, probes.count, 0.5) / 1e6,
+	    bench_percentile(probes.samples, probes.count, 0.99) / 1e6,
+	    bench_percentile(probes.samples, probes.count, 1.0) / 1e6);
+    if (pid > 0) {
+	printf("; server peak RSS %ld kB", peak);
+    }
+    printf("\n");
+    return 0;
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+# CPU pinning benchmark.
+#
+# Usage: bench/pin_bench.sh cpus [seconds]
+#
+# Starts a psserver without PSSERVER_CPUS and runs group_bench (throughput)
+# and latency_bench (p99 of high priority messages) against it for the
+# given number of seconds (default 10), then does the same against a
+# psserver started with PSSERVER_CPUS set to the given cores, e.g. "0-7".
+# Run `make` and `make bench` first. Pinning only has an effect to measure
+# on a machine with several cores, and NUMA placement on one with several
+# sockets.
+
+if [ $# -lt 1 ]; then
+    echo "Usage: bench/pin_bench.sh cpus [seconds]" >&2
+    exit 1
+fi
+cd "$(dirname "$0")/.." || exit 1
+cpus=$1
+duration=${2:-10}
+log=$(mktemp)
+
+for setting in "" "$cpus"; do
+    if [ -z "$setting" ]; then
+	./psserver 0 2>"$log" &
+    else
+	PSSERVER_CPUS=$setting ./psserver 0 2>"$log" &
+    fi
+    server=$!
+
+    # The port is the first line of standard error that is a number
+    port=
+    while [ -z "$port" ] && kill -0 "$server" 2>/dev/null; do
+	sleep 0.1
+	port=$(grep -m 1 -x '[0-9][0-9]*' "$log")
+    done
+    if [ -z "$port" ]; then
+	cat "$log" >&2
+	exit 1
+    fi
+
+    echo "== PSSERVER_CPUS=${setting:-unset}"
+    bench/group_bench "$port" 8 200000
+    bench/latency_bench "$port" "$duration"
+    kill "$server"
+    wait "$server" 2>/dev/null
+done
+rm -f "$log"
@@ -0,0 +1,176 @@
+/* Request/reply benchmark.
+ *
+ * Usage: req_bench port native|topic requesters requests [window]
+ *
+ * Starts one responder subscribed to the topic "svc" of a running psserver
+ * and the given number of requesters, each of which sends the given number
+ * of requests with up to window of them outstanding (default 32). With
+ * "native" requests are sent with "req" and answered with "rep"; with
+ * "topic" each requester subscribes to its own reply topic and requests are
+ * publishes naming it, which the responder answers by publishing to it.
+ * Reports the request rate and the round trip latency as p50, p99 and max.
+ */
+#include <pthread.h>
+#include "benchlib.h"
+
+#define DEFAULT_WINDOW 32
+#define REPLY_BATCH 65536
+
+/* Struct containing one requester's connection and round trip times */
+typedef struct Requester {
+    int id;
+    int fd;
+    long long* sent;
+    long long* latencies;
+    int replies;
+    pthread_t thread;
+} Requester;
+
+static int native;
+static int requests;
+static int window;
+
+/* responder_thread()
+ * ------------------
+ * Answers every request received on the given socket until it is shut
+ * down, writing the replies to everything read in one batch at once.
+ *
+ * arg: the responder's socket
+ */
+static void* responder_thread(void* arg) {
+    int fd = *(int*) arg;
+    BenchReader reader;
+    bench_init_reader(&reader, fd);
+    char* replies = malloc(REPLY_BATCH);
+    int length = 0;
+    char* line;
+    while ((line = bench_read_line(&reader)) != NULL) {
+	if (native && !strncmp(line, ":req ", strlen(":req "))) {
+	    // ":req <address> <name>:svc:<value>"
+	    char* address = line + strlen(":req ");
+	    *strchr(address, ' ') = '\0';
+	    length += sprintf(replies + length, "rep %s ok\n", address);
+	} else if (!native && line[0] != ':') {
+	    // "<name>:svc:<reply topic> <correlation>"
+	    char* topic = strchr(strchr(line, ':') + 1, ':') + 1;
+	    char* correlation = strchr(topic, ' ');
+	    *correlation++ = '\0';
+	    length += sprintf(replies + length, "pub %s %s\n", topic,
+		    correlation);
+	}
+	if (!bench_buffered(&reader) || length > REPLY_BATCH - 256) {
+	    bench_send(fd, replies, length);
+	    length = 0;
+	}
+    }
+    free(replies);
+    free(reader.data);
+    return NULL;
+}
+
+/* requester_thread()
+ * ------------------
+ * Sends one requester's requests, keeping up to the window outstanding,
+ * and records the round trip time of each reply.
+ *
+ * arg: the requester
+ */
+static void* requester_thread(void* arg) {
+    Requester* requester = (Requester*) arg;
+    BenchReader reader;
+    bench_init_reader(&reader, requester->fd);
+    char* batch = malloc(window * 64);
+    int sent = 0;
+    while (requester->replies < requests) {
+	int length = 0;
+	for (; sent < requests && sent - requester->replies < window;
+		sent++) {
+	    length += native ?
+		    sprintf(batch + length, "req svc %d x\n", sent) :
+		    sprintf(batch + length, "pub svc reply.r%d %d\n",
+		    requester->id, sent);
+	    requester->sent[sent] = bench_now();
+	}
+	if (length > 0) {
+	    bench_send(requester->fd, batch, length);
+	}
+
+	// ":rep <correlation> svc:ok" or "svc:reply.r<id>:<correlation>"
+	char* line = bench_read_line(&reader);
+	if (line == NULL) {
+	    break;
+	}
+	int correlation;
+	if (native && sscanf(line, ":rep %d", &correlation) != 1) {
+	    continue;
+	} else if (!native && (line[0] == ':' ||
+		sscanf(strrchr(line, ':') + 1, "%d", &correlation) != 1)) {
+	    continue;
+	}
+	requester->latencies[requester->replies++] = bench_now() -
+		requester->sent[correlation];
+    }
+    free(batch);
+    free(reader.data);
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 5 || (strcmp(argv[2], "native") && strcmp(argv[2], "topic"))) {
+	fprintf(stderr, "Usage: req_bench port native|topic requesters "
+		"requests [window]\n");
+	return 1;
+    }
+    char* port = argv[1];
+    native = !strcmp(argv[2], "native");
+    int count = atoi(argv[3]);
+    requests = atoi(argv[4]);
+    window = argc > 5 ? atoi(argv[5]) : DEFAULT_WINDOW;
+
+    int responder = bench_connect(port);
+    char* setup = "name svc\nsub svc\n";
+    bench_send(responder, setup, strlen(setup));
+    pthread_t responderThread;
+    pthread_create(&responderThread, NULL, responder_thread, &responder);
+    Requester* requesters = calloc(count, sizeof(Requester));
+    for (int i = 0; i < count; i++) {
+	char join[64];
+	int length = native ? sprintf(join, "name r%d\n", i) :
+		sprintf(join, "name r%d\nsub reply.r%d\n", i, i);
+	requesters[i].id = i;
+	requesters[i].fd = bench_connect(port);
+	requesters[i].sent = malloc(sizeof(long long) * requests);
+	requesters[i].latencies = malloc(sizeof(long long) * requests);
+	bench_send(requesters[i].fd, join, length);
+    }
+    usleep(200000); // Let every subscription land
+
+    long long start = bench_now();
+    for (int i = 0; i < count; i++) {
+	pthread_create(&requesters[i].thread, NULL, requester_thread,
+		&requesters[i]);
+    }
+    long long* latencies = malloc(sizeof(long long) * count * requests);
+    int replies = 0;
+    for (int i = 0; i < count; i++) {
+	pthread_join(requesters[i].thread, NULL);
+	memcpy(latencies + replies, requesters[i].latencies,
+		sizeof(long long) * requesters[i].replies);
+	replies += requesters[i].replies;
+    }
+    double seconds = (bench_now() - start) / 1e9;
+    for (int i = 0; i < count; i++) {
+	close(requesters[i].fd);
+    }
+    shutdown(responder, SHUT_RDWR);
+    pthread_join(responderThread, NULL);
+
+    printf("%s: %d requesters x %d requests (window %d): %.0f req/s, "
+	    "latency p50 %.2f ms p99 %.2f ms max %.2f ms", argv[2], count,
+	    requests, window, replies / seconds,
+	    bench_percentile(latencies, replies, 0.5) / 1e6,
+	    bench_percentile(latencies, replies, 0.99) / 1e6,
+	    bench_percentile(latencies, replies, 1.0) / 1e6);
+    printf("%s\n", replies < count * requests ? ", REPLIES MISSING" : "");
+    return 0;
+}
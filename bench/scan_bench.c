@@ -0,0 +1,83 @@
+/* Line scanner microbenchmark.
+ *
+ * Usage: scan_bench [iterations]
+ *
+ * Times scan_libc() (the server's default, a memchr() per character sought),
+ * scan_scalar(), and scan_sse2() and scan_avx2() where the processor
+ * supports them, over "pub <topic> <value>" lines of several lengths.
+ * Reports nanoseconds per line and bytes per nanosecond (GB/s).
+ */
+#define main psserver_main
+#include "../psserver.c"
+#undef main
+#include "benchlib.h"
+
+#define DEFAULT_ITERATIONS 2000000
+
+typedef int (*Scanner)(char*, int, int, LineScan*);
+
+/* time_scanner()
+ * --------------
+ * Scans the given line repeatedly with the given scanner.
+ *
+ * Returns: the mean time per scan in nanoseconds
+ */
+static double time_scanner(Scanner scanner, char* line, int length,
+	long iterations) {
+    long checksum = 0;
+    long long start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+	LineScan scan = {0, -1, -1, -1};
+	checksum += scanner(line, 0, length, &scan) + scan.argumentSpace;
+    }
+    long long elapsed = bench_now() - start;
+    if (checksum == 0) {
+	printf("scan_bench: unexpected checksum\n");
+    }
+    return (double) elapsed / iterations;
+}
+
+int main(int argc, char* argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+    Scanner scanners[4] = {scan_libc, scan_scalar};
+    const char* names[4] = {"libc", "scalar"};
+    int count = 2;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+	names[count] = "sse2";
+	scanners[count++] = scan_sse2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+	names[count] = "avx2";
+	scanners[count++] = scan_avx2;
+    }
+#endif
+
+    int lengths[] = {16, 64, 256, 1024, 4096};
+    printf("%-8s", "length");
+    for (int i = 0; i < count; i++) {
+	printf("%20s", names[i]);
+    }
+    printf("\n");
+    for (int l = 0; l < (int) (sizeof(lengths) / sizeof(int)); l++) {
+	int length = lengths[l];
+	char* line = malloc(length + 1);
+	for (int i = 0; i < length; i++) {
+	    line[i] = 'a' + i % 26;
+	}
+	memcpy(line, "pub topic ", strlen("pub topic "));
+	line[length - 1] = '\n';
+	line[length] = '\0';
+	long scaled = iterations * 64 / length + 1;
+
+	printf("%-8d", length);
+	for (int i = 0; i < count; i++) {
+	    double ns = time_scanner(scanners[i], line, length, scaled);
+	    printf("%9.1f ns %5.2f GB/s", ns, length / ns);
+	}
+	printf("\n");
+	free(line);
+    }
+    return 0;
+}
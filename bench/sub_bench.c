@@ -0,0 +1,117 @@
+/* Subscription benchmark.
+ *
+ * Usage: sub_bench [subscribers]
+ *
+ * Subscribes the given number of clients to one topic in-process (no
+ * server), then unsubscribes them in random order, and reports the memory
+ * the topic's subscriber array uses per subscriber and the mean time per
+ * sub and unsub. For comparison it also times finding each subscriber with
+ * find_subscriber() and with a linear scan of the array, as unsubscribing
+ * did before the array had a hash table.
+ */
+#define main psserver_main
+#include "../psserver.c"
+#undef main
+#include <malloc.h>
+#include "benchlib.h"
+
+#define DEFAULT_SUBSCRIBERS 100000
+#define SCAN_LOOKUPS 2000
+
+/* linear_find()
+ * -------------
+ * Returns: the index of the given connection's subscription, found by
+ * scanning the array, or -1 if not found
+ */
+static int linear_find(SubscriberArray* array, Connection* connection) {
+    for (int i = 0; i < array->count; i++) {
+	if (array->subscribers[i].connection == connection) {
+	    return i;
+	}
+    }
+    return -1;
+}
+
+/* heap_in_use()
+ * -------------
+ * Returns: the number of bytes currently allocated from the heap
+ */
+static size_t heap_in_use(void) {
+    struct mallinfo2 usage = mallinfo2();
+    return usage.uordblks + usage.hblkhd;
+}
+
+int main(int argc, char* argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : DEFAULT_SUBSCRIBERS;
+    if (count <= 0) {
+	fprintf(stderr, "Usage: sub_bench [subscribers]\n");
+	return 1;
+    }
+    static char topic[] = "bench";
+    sem_t lock;
+    init_mutex_lock(&lock);
+    SharedClientInfo info;
+    memset(&info, 0, sizeof(SharedClientInfo));
+    info.sm = stringmap_init();
+    info.groups = stringmap_init();
+    info.priorities = stringmap_init();
+    info.mutexLock = &lock;
+
+    Client* clients = calloc(count, sizeof(Client));
+    int* order = malloc(sizeof(int) * count);
+    for (int i = 0; i < count; i++) {
+	clients[i].name = "s";
+	clients[i].connection = calloc(1, sizeof(Connection));
+	clients[i].subbedTopics = malloc(sizeof(char*));
+	order[i] = i;
+    }
+    srand(1);
+    for (int i = count - 1; i > 0; i--) {
+	int j = rand() % (i + 1);
+	int swap = order[i];
+	order[i] = order[j];
+	order[j] = swap;
+    }
+
+    size_t before = heap_in_use();
+    long long start = bench_now();
+    for (int i = 0; i < count; i++) {
+	int bufferSize = 1;
+	handle_sub(&clients[i], topic, &info, &bufferSize, COUNT);
+    }
+    double subNs = (double) (bench_now() - start) / count;
+    size_t used = heap_in_use() - before;
+    SubscriberArray* array = stringmap_search(info.sm, topic);
+
+    // Look up a sample of subscribers both ways
+    int lookups = count < SCAN_LOOKUPS ? count : SCAN_LOOKUPS;
+    long checksum = 0;
+    start = bench_now();
+    for (int i = 0; i < lookups; i++) {
+	checksum += find_subscriber(array, clients[order[i]].connection);
+    }
+    double findNs = (double) (bench_now() - start) / lookups;
+    start = bench_now();
+    for (int i = 0; i < lookups; i++) {
+	checksum -= linear_find(array, clients[order[i]].connection);
+    }
+    double scanNs = (double) (bench_now() - start) / lookups;
+    if (checksum != 0) {
+	printf("sub_bench: lookups disagree\n");
+    }
+
+    start = bench_now();
+    for (int i = 0; i < count; i++) {
+	handle_unsub(clients[order[i]], topic, &info, COUNT);
+    }
+    double unsubNs = (double) (bench_now() - start) / count;
+
+    printf("%d subscribers: %.1f bytes per subscriber, sub %.0f ns, "
+	    "unsub %.0f ns\nfind_subscriber %.0f ns, linear scan %.0f ns\n",
+	    count, (double) used / count, subNs, unsubNs, findNs, scanNs);
+    if (info.totalSub != count || info.totalUnsub != count) {
+	printf("sub_bench: %d subs and %d unsubs counted\n", info.totalSub,
+		info.totalUnsub);
+    }
+    return 0;
+}
@@ -3,14 +3,203 @@
 #include <string.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <csse2310a3.h>
 #include <pthread.h>
+#include <zlib.h>
 
 #define MIN_ARGS 3
 #define TOPIC_PRESENT 4
 #define FIRST_TOPIC 3
 #define PORT 1
 #define NAME 2
+#define FRAME_FIELDS 2
+#define MULTI_FLAG "--multi"
+#define MAX_MULTI_ARGS 4
+#define SCRIPT 3
+#define INITIAL_INPUT_SIZE 256
+#define INITIAL_SESSIONS 16
+#define MAX_SESSION_OUTPUT (1 << 20)
+#define REPLAY_FLAG "--replay"
+#define MIN_REPLAY_ARGS 4
+#define MAX_REPLAY_ARGS 6
+#define CAPTURE_FILE 3
+#define USAGE "Usage: psclient portnum name [topic] ...\n" \
+	"       psclient portnum " MULTI_FLAG " [script]\n" \
+	"       psclient portnum " REPLAY_FLAG \
+	" capture [speed|max] [connections]\n"
+#define SPEED 4
+#define CONNECTIONS 5
+#define BASE_10 10
+#define NS_PER_SECOND 1000000000LL
+#define NS_PER_US 1000.0
+#define NS_PER_MS 1000000LL
+#define CAPTURE_MAGIC "PSCAP001"
+#define CAPTURE_HEADER_SIZE 8
+#define RECORD_HEADER_SIZE 13
+#define CAPTURE_RESERVE ((size_t) 1 << 36)
+#define CAPTURE_CHUNK ((size_t) 1 << 24)
+#define CAPTURE_SENT 0
+#define CAPTURE_RECEIVED 1
+#define REPLAY_NAME "replay"
+#define PROBE_NAME "replay-probe"
+#define SYNC_TOPIC "replay-sync"
+#define REPLAY_POLL_NS 10000000LL
+#define REPLAY_DRAIN_NS 2000000000LL
+#define PROBE_CHECK_INTERVAL 64
+#define INITIAL_PENDING 64
+#define PERCENTILE_50 0.5
+#define PERCENTILE_99 0.99
+
+/* Struct containing the file pointers used to read from and write to the 
+ * server */
+typedef struct ServerStreams {
+    FILE* from;
+    FILE* to;
+} ServerStreams;
+
+/* Struct containing bytes read from a file descriptor that are yet to be
+ * processed, or bytes yet to be written to one */
+typedef struct InputBuffer {
+    char* data;
+    int length;
+    int size;
+} InputBuffer;
+
+/* Struct representing one logical client session in multi-session mode, 
+ * with its own non-blocking connection to the server. Requests the socket 
+ * cannot take yet wait in the output buffer. */
+typedef struct Session {
+    char* id;
+    int fd;
+    InputBuffer input;
+    InputBuffer output;
+    char* previous;
+    z_stream inflater;
+    int inflaterReady;
+} Session;
+
+/* Struct containing the state of the multi-session event loop. The first 
+ * entry of polls is the control input, entry i + 1 is sessions[i]. Control
+ * input is not read while more than MAX_SESSION_OUTPUT bytes wait to be 
+ * sent, in total. */
+typedef struct Multiplexer {
+    char* port;
+    Session** sessions;
+    struct pollfd* polls;
+    int count;
+    int capacity;
+    InputBuffer control;
+    int controlFd;
+    long pendingOutput;
+} Multiplexer;
+
+/* Struct containing a capture file being appended to. The file is mapped 
+ * once at its maximum size and extended beneath the mapping by a grower 
+ * thread, which keeps it about CAPTURE_CHUNK ahead of the records appended.
+ * Appenders count themselves in writers so that the capture is only closed
+ * once none is writing to the mapping. Each record is a 64-bit timestamp in
+ * nanoseconds since the capture began, a 32-bit line length, a direction 
+ * byte and the line without its newline, all in host byte order. */
+typedef struct Capture {
+    int fd;
+    char* map;
+    size_t size;
+    size_t wanted;
+    size_t length;
+    size_t end;
+    long long start;
+    int writers;
+    int closing;
+    int growing;
+    int failed;
+    pthread_mutex_t growLock;
+    pthread_cond_t growRequested;
+    pthread_cond_t grown;
+    pthread_t grower;
+} Capture;
+
+/* Struct representing one record read from a capture */
+typedef struct Record {
+    long long time;
+    int direction;
+    char* line;
+    uint32_t length;
+} Record;
+
+/* Struct representing a publication found in a capture. The strings point 
+ * into the capture and are not terminated. */
+typedef struct Publication {
+    long long time;
+    char* publisher;
+    int publisherLength;
+    char* topic;
+    int topicLength;
+    char* value;
+    int valueLength;
+} Publication;
+
+/* Struct representing a replayed publication the probe is yet to receive */
+typedef struct Pending {
+    char* topic;
+    int topicLength;
+    long long sent;
+} Pending;
+
+/* Struct representing one of the connections a capture is replayed 
+ * through, with its publications in the order they were sent */
+typedef struct ReplayConnection {
+    int fd;
+    InputBuffer input;
+    Pending* pending;
+    int head;
+    int count;
+    int capacity;
+} ReplayConnection;
+
+/* Struct containing the state of a replay */
+typedef struct Replay {
+    char* data;
+    size_t length;
+    char* ownName;
+    int ownNameLength;
+    char** publishers;
+    int publisherCount;
+    char** topics;
+    int topicCount;
+    int publications;
+    long long firstTime;
+    long long lastTime;
+    double speed;
+    ReplayConnection* connections;
+    int connectionCount;
+    int probe;
+    InputBuffer probeInput;
+    struct pollfd* polls;
+    int synced;
+    long long* latencies;
+    int published;
+    int delivered;
+    long long start;
+    long long finish;
+} Replay;
+
+/* The capture lines are recorded to, or NULL if capture is disabled */
+Capture* capture = NULL;
+
+/* Publish credits granted by the server, and whether flow control has been 
+ * turned on by sending "credit on" */
+sem_t credits;
+int creditEnabled = 0;
 
 /* check_spaces_colons_newlines_empty()
  * ------------------------------------
@@ -32,7 +221,10 @@ int check_spaces_colons_newlines_empty(char* str) {
 /* handle_arguments()
  * ------------------
  * Iterates through the command line arguments, ensuring all conform to the 
- * required standards. 
+ * required standards. A name of "--multi" selects multi-session mode, which
+ * takes an optional control script in place of the topics. A name of 
+ * "--replay" selects replay mode, which takes a capture file and optionally
+ * a speed and number of connections.
  *
  * argc: the number of command line arguments
  * argv: the array containing the command line arguments
@@ -42,12 +234,27 @@ int check_spaces_colons_newlines_empty(char* str) {
  * argument is invalid or any of the topic arguments are invalid.
  */
 void handle_arguments(int argc, char* argv[]) {
-    // Too few command line arguments
-    if (argc < MIN_ARGS) {
-	fprintf(stderr, "Usage: psclient portnum name [topic] ...\n");
+    // Too few command line arguments, or a script and more in multi mode
+    if (argc < MIN_ARGS || (!strcmp(argv[NAME], MULTI_FLAG) && 
+	    argc > MAX_MULTI_ARGS)) {
+	fprintf(stderr, USAGE);
 	exit(1);
     }
 
+    // Multi-session mode - names and topics are given per session
+    if (!strcmp(argv[NAME], MULTI_FLAG)) {
+	return;
+    }
+
+    // Replay mode - the capture file is required
+    if (!strcmp(argv[NAME], REPLAY_FLAG)) {
+	if (argc < MIN_REPLAY_ARGS || argc > MAX_REPLAY_ARGS) {
+	    fprintf(stderr, USAGE);
+	    exit(1);
+	}
+	return;
+    }
+
     // Invalid name
     if (!check_spaces_colons_newlines_empty(argv[NAME])) {
 	fprintf(stderr, "psclient: invalid name\n");
@@ -78,18 +285,17 @@ void port_error(char* port) {
     exit(3);
 }
 
-/* connect_to_port()
- * -----------------
+/* open_socket()
+ * -------------
  * Connects to a given port number.
  *
  * port: the port number to connect to
  *
- * Returns: the connected socket file descriptor
- * Errors: the program will exit with status 3 if the address could not be
- * determined, or there was an error connecting to the socket
+ * Returns: the connected socket file descriptor, or -1 if the address could 
+ * not be determined or there was an error connecting to the socket
  * Reference: this code is taken from the Week 10 "net2.c" lecture example
  */
-int connect_to_port(char* port) {
+int open_socket(char* port) {
     struct addrinfo* ai = 0;
     struct addrinfo hints;
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -99,36 +305,437 @@ int connect_to_port(char* port) {
     // Could not determine address
     int err;
     if ((err = getaddrinfo("localhost", port, &hints, &ai))) {
-	port_error(port);
+	return -1;
     }
 
     // Create socket
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (connect(fd, (struct sockaddr*) ai->ai_addr, sizeof(struct sockaddr))) {
-	port_error(port); // Error connecting to socket
+	close(fd); // Error connecting to socket
+	fd = -1;
     }
+    freeaddrinfo(ai);
 
     return fd;
 }
 
+/* connect_to_port()
+ * -----------------
+ * Connects to a given port number.
+ *
+ * port: the port number to connect to
+ *
+ * Returns: the connected socket file descriptor
+ * Errors: the program will exit with status 3 if the address could not be
+ * determined, or there was an error connecting to the socket
+ */
+int connect_to_port(char* port) {
+    int fd = open_socket(port);
+    if (fd < 0) {
+	port_error(port);
+    }
+    return fd;
+}
+
+/* parse_frame_header()
+ * --------------------
+ * Parses a ":z <compressed> <raw>" compressed frame header line.
+ *
+ * header: the header line
+ * compressedLength: set to the length of the compressed block that follows
+ * rawLength: set to the length of the message once inflated
+ *
+ * Returns: 1 if the header is valid, else 0
+ */
+int parse_frame_header(char* header, int* compressedLength, int* rawLength) {
+    return sscanf(header, ":z %d %d", compressedLength, rawLength) == 
+	    FRAME_FIELDS && *compressedLength > 0 && *rawLength > 0;
+}
+
+/* inflate_block()
+ * ---------------
+ * Inflates the compressed block of a frame, using the previous message 
+ * received as a preset dictionary.
+ *
+ * block: the compressed block
+ * compressedLength: the length of the compressed block
+ * rawLength: the length of the message once inflated
+ * inflater: the raw inflate stream reused between frames
+ * previous: the previous message received, including its newline (or NULL
+ * if this is the first message)
+ *
+ * Returns: the decompressed message, including its newline, or NULL if the
+ * block could not be inflated
+ */
+char* inflate_block(char* block, int compressedLength, int rawLength, 
+	z_stream* inflater, char* previous) {
+    char* text = malloc(rawLength + 1);
+    inflateReset(inflater);
+    if (previous != NULL) {
+	inflateSetDictionary(inflater, (Bytef*) previous, strlen(previous));
+    }
+    inflater->next_in = (Bytef*) block;
+    inflater->avail_in = compressedLength;
+    inflater->next_out = (Bytef*) text;
+    inflater->avail_out = rawLength;
+    int status = inflate(inflater, Z_FINISH);
+
+    if (status != Z_STREAM_END || (int) inflater->total_out != rawLength) {
+	free(text);
+	return NULL;
+    }
+    text[rawLength] = '\0';
+    return text;
+}
+
+/* decompress_frame()
+ * ------------------
+ * Reads the compressed block following a ":z <compressed> <raw>" header line
+ * from the server and inflates it, using the previous message received as a
+ * preset dictionary.
+ *
+ * from: the file pointer used to read from the server
+ * header: the header line
+ * inflater: the raw inflate stream reused between frames
+ * previous: the previous message received, including its newline (or NULL
+ * if this is the first message)
+ *
+ * Returns: the decompressed message, including its newline, or NULL if the
+ * header is not a compressed frame header or the frame could not be inflated
+ */
+char* decompress_frame(FILE* from, char* header, z_stream* inflater, 
+	char* previous) {
+    int compressedLength;
+    int rawLength;
+    if (!parse_frame_header(header, &compressedLength, &rawLength)) {
+	return NULL;
+    }
+
+    char* block = malloc(compressedLength);
+    if (fread(block, 1, compressedLength, from) != 
+	    (size_t) compressedLength) {
+	free(block);
+	return NULL;
+    }
+
+    char* text = inflate_block(block, compressedLength, rawLength, inflater,
+	    previous);
+    free(block);
+    return text;
+}
+
+/* now_ns()
+ * --------
+ * Reads the monotonic clock.
+ *
+ * Returns: the current monotonic time in nanoseconds
+ */
+long long now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * NS_PER_SECOND + time.tv_nsec;
+}
+
+/* grow_thread()
+ * -------------
+ * Thread handling function responsible for extending a capture file 
+ * beneath its mapping whenever an appender asks for more room, so that 
+ * appenders do not wait for the file system unless they catch up with it.
+ * Returns once the capture is closing.
+ *
+ * arg: the argument passed when creating the thread, in this case the 
+ * capture to grow
+ *
+ * Returns: will always return NULL
+ */
+void* grow_thread(void* arg) {
+    Capture* capture = (Capture*) arg;
+    pthread_mutex_lock(&capture->growLock);
+    while (!capture->closing) {
+	if (capture->failed || capture->wanted <= capture->size) {
+	    pthread_cond_wait(&capture->growRequested, &capture->growLock);
+	    continue;
+	}
+	size_t grown = capture->size;
+	while (grown < capture->wanted) {
+	    grown += CAPTURE_CHUNK;
+	}
+	capture->growing = 1;
+	pthread_mutex_unlock(&capture->growLock);
+
+	int error = ftruncate(capture->fd, grown);
+
+	pthread_mutex_lock(&capture->growLock);
+	capture->growing = 0;
+	if (error) {
+	    capture->failed = 1;
+	} else {
+	    __atomic_store_n(&capture->size, grown, __ATOMIC_RELEASE);
+	}
+	pthread_cond_broadcast(&capture->grown);
+    }
+    pthread_mutex_unlock(&capture->growLock);
+    return NULL;
+}
+
+/* open_capture()
+ * --------------
+ * Opens the capture file named by the PSCLIENT_CAPTURE environment variable,
+ * if it is set. The whole of CAPTURE_RESERVE is mapped up front and the file
+ * is extended beneath the mapping as it fills, so appending never remaps. 
+ * Starts the thread that extends the file.
+ *
+ * Returns: the capture, or NULL if capture is disabled or the file could not
+ * be created
+ */
+Capture* open_capture(void) {
+    char* path = getenv("PSCLIENT_CAPTURE");
+    if (path == NULL || path[0] == '\0') {
+	return NULL;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char* map;
+    if (fd < 0 || ftruncate(fd, CAPTURE_CHUNK) || (map = mmap(NULL, 
+	    CAPTURE_RESERVE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == 
+	    MAP_FAILED) {
+	fprintf(stderr, "psclient: unable to capture to %s\n", path);
+	if (fd >= 0) {
+	    close(fd);
+	}
+	return NULL;
+    }
+
+    Capture* capture = malloc(sizeof(struct Capture));
+    capture->fd = fd;
+    capture->map = map;
+    capture->size = CAPTURE_CHUNK;
+    capture->wanted = CAPTURE_CHUNK;
+    capture->length = CAPTURE_HEADER_SIZE;
+    capture->end = CAPTURE_RESERVE;
+    capture->start = now_ns();
+    capture->writers = 0;
+    capture->closing = 0;
+    capture->growing = 0;
+    capture->failed = 0;
+    pthread_mutex_init(&capture->growLock, NULL);
+    pthread_cond_init(&capture->growRequested, NULL);
+    pthread_cond_init(&capture->grown, NULL);
+    memcpy(map, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC));
+    pthread_create(&capture->grower, NULL, grow_thread, capture);
+    return capture;
+}
+
+/* end_capture()
+ * -------------
+ * Marks the capture as ending at the given offset, unless it already ends
+ * earlier.
+ *
+ * capture: the capture to end
+ * offset: the offset of the first record that could not be stored
+ */
+void end_capture(Capture* capture, size_t offset) {
+    size_t end = capture->end;
+    while (offset < end && 
+	    !__sync_bool_compare_and_swap(&capture->end, end, offset)) {
+	end = capture->end;
+    }
+}
+
+/* make_room()
+ * -----------
+ * Asks the grower thread to keep the capture file CAPTURE_CHUNK beyond the
+ * given offset, and waits until the file reaches the offset if it does not
+ * already.
+ *
+ * capture: the capture to grow
+ * needed: the offset the file must reach
+ *
+ * Returns: 1 if the file reaches the offset, or 0 if it could not be 
+ * extended or the capture is closing
+ */
+int make_room(Capture* capture, size_t needed) {
+    size_t ahead = needed + CAPTURE_CHUNK < CAPTURE_RESERVE ? 
+	    needed + CAPTURE_CHUNK : CAPTURE_RESERVE;
+    pthread_mutex_lock(&capture->growLock);
+    if (ahead > capture->wanted) {
+	capture->wanted = ahead;
+	pthread_cond_signal(&capture->growRequested);
+    }
+    while (needed > capture->size && !capture->failed && 
+	    !capture->closing) {
+	pthread_cond_wait(&capture->grown, &capture->growLock);
+    }
+    int reached = needed <= capture->size;
+    pthread_mutex_unlock(&capture->growLock);
+    return reached;
+}
+
+/* append_capture()
+ * ----------------
+ * Appends a timestamped line to the capture. Space for the record is 
+ * reserved atomically, so the reading and sending threads append without 
+ * taking a lock except when the file is to be extended, which the grower 
+ * thread does ahead of time. Once a line cannot be stored (the reserve is 
+ * exhausted or the file cannot be extended) the capture ends at that 
+ * record. Lines appended once the capture is closing are dropped.
+ *
+ * capture: the capture to append to
+ * direction: CAPTURE_SENT or CAPTURE_RECEIVED
+ * line: the line, without its newline
+ * length: the length of the line
+ */
+void append_capture(Capture* capture, uint8_t direction, char* line, 
+	uint32_t length) {
+    // Counted before checking, so that close_capture() either sees this 
+    // writer or this writer sees the capture closing
+    __sync_add_and_fetch(&capture->writers, 1);
+    if (__atomic_load_n(&capture->closing, __ATOMIC_SEQ_CST)) {
+	__sync_sub_and_fetch(&capture->writers, 1);
+	return;
+    }
+
+    size_t size = RECORD_HEADER_SIZE + length;
+    size_t offset = __sync_fetch_and_add(&capture->length, size);
+
+    // Timed after reserving so that records are in time order in the file
+    // unless threads race between the two
+    uint64_t time = now_ns() - capture->start;
+    size_t needed = offset + size;
+    if (needed > CAPTURE_RESERVE) {
+	end_capture(capture, offset);
+	__sync_sub_and_fetch(&capture->writers, 1);
+	return;
+    }
+
+    // Ask for more room within a chunk of the end of the file, and wait 
+    // for it only past the end
+    size_t mapped = __atomic_load_n(&capture->size, __ATOMIC_ACQUIRE);
+    if ((needed + CAPTURE_CHUNK > mapped && needed + CAPTURE_CHUNK > 
+	    __atomic_load_n(&capture->wanted, __ATOMIC_RELAXED)) || 
+	    needed > mapped) {
+	if (!make_room(capture, needed)) {
+	    end_capture(capture, offset);
+	    __sync_sub_and_fetch(&capture->writers, 1);
+	    return;
+	}
+    }
+
+    char* record = capture->map + offset;
+    memcpy(record, &time, sizeof(uint64_t));
+    memcpy(record + sizeof(uint64_t), &length, sizeof(uint32_t));
+    record[sizeof(uint64_t) + sizeof(uint32_t)] = direction;
+    memcpy(record + RECORD_HEADER_SIZE, line, length);
+    __sync_sub_and_fetch(&capture->writers, 1);
+}
+
+/* close_capture()
+ * ---------------
+ * Stops the grower thread, waits for appenders already writing to finish,
+ * then truncates the capture file to the records appended and unmaps it.
+ * Registered with atexit() so that every exit path finishes the file; the
+ * other thread may still be appending when it runs.
+ */
+void close_capture(void) {
+    if (capture != NULL) {
+	pthread_mutex_lock(&capture->growLock);
+	__atomic_store_n(&capture->closing, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&capture->growRequested);
+	pthread_cond_broadcast(&capture->grown);
+	while (capture->growing) {
+	    pthread_cond_wait(&capture->grown, &capture->growLock);
+	}
+	pthread_mutex_unlock(&capture->growLock);
+	while (__atomic_load_n(&capture->writers, __ATOMIC_SEQ_CST) > 0) {
+	    sched_yield();
+	}
+
+	size_t length = capture->length < capture->end ? capture->length : 
+		capture->end;
+	munmap(capture->map, CAPTURE_RESERVE);
+	if (ftruncate(capture->fd, length)) {
+	    fprintf(stderr, "psclient: unable to finish capture\n");
+	}
+	close(capture->fd);
+    }
+}
+
+/* send_line()
+ * -----------
+ * Sends a line to the server, recording it in the capture if enabled.
+ *
+ * to: the file pointer used to write to the server
+ * line: the line to send, without its newline
+ */
+void send_line(FILE* to, char* line) {
+    fprintf(to, "%s\n", line);
+    fflush(to);
+    if (capture != NULL) {
+	append_capture(capture, CAPTURE_SENT, line, strlen(line));
+    }
+}
+
 /* read_thread()
  * -------------
  * Thread handling function responsible for reading from the connected socket. 
- * Repeatedly reads single lines from the socket, prints them to standard out,
- * and flushes. Upon disconnection from the socket, prints a message to 
- * standard error and exits with status 4.
+ * Repeatedly reads single messages from the socket (inflating any compressed
+ * frames), prints them to standard out, and flushes, recording them in the 
+ * capture if enabled. Credit grants are not printed but released to the 
+ * sending loop, and keepalives are not printed but replied to. Upon 
+ * disconnection from the socket, prints a message to standard error and 
+ * exits with status 4.
  *
  * arg: the argument passed when creating the thread, in this case the file
- * pointer of the socket
+ * pointers used to read from and write to the server
  */
 void* read_thread(void* arg) {
-    FILE* from = (FILE*) arg;
+    ServerStreams* streams = (ServerStreams*) arg;
+    FILE* from = streams->from;
     char* line;
 
+    // Each message is the dictionary for the next compressed frame
+    char* previous = NULL;
+    z_stream inflater;
+    memset(&inflater, 0, sizeof(z_stream));
+    inflateInit2(&inflater, -MAX_WBITS);
+
     // Read from server
     while ((line = read_line(from)) != NULL) {
-	printf("%s\n", line);
-	fflush(stdout);
+	char* text;
+
+	// Compressed frame
+	if (!strncmp(line, ":z ", strlen(":z "))) {
+	    if ((text = decompress_frame(from, line, &inflater, 
+		    previous)) == NULL) {
+		break;
+	    }
+	} else {
+	    text = malloc(strlen(line) + 2);
+	    sprintf(text, "%s\n", line);
+	}
+	free(line);
+
+	// Credit grant
+	if (!strncmp(text, ":credit ", strlen(":credit "))) {
+	    for (int i = atoi(text + strlen(":credit ")); i > 0; i--) {
+		sem_post(&credits);
+	    }
+
+	// Keepalive
+	} else if (!strncmp(text, ":ping ", strlen(":ping "))) {
+	    fprintf(streams->to, "pong %s", text + strlen(":ping "));
+	    fflush(streams->to);
+
+	} else {
+	    printf("%s", text);
+	    fflush(stdout);
+	    if (capture != NULL) {
+		append_capture(capture, CAPTURE_RECEIVED, text, 
+			strlen(text) - 1);
+	    }
+	}
+	free(previous);
+	previous = text;
     }
 
     // Connection to server closed
@@ -136,10 +743,1094 @@ void* read_thread(void* arg) {
     exit(4);
 }
 
+/* fill_buffer()
+ * -------------
+ * Reads whatever is available from the given file descriptor onto the end 
+ * of the given buffer, growing the buffer if it is full.
+ *
+ * buffer: the buffer to read into
+ * fd: the file descriptor to read from
+ *
+ * Returns: the number of bytes read, 0 at end of file, or -1 on error
+ */
+int fill_buffer(InputBuffer* buffer, int fd) {
+    if (buffer->length == buffer->size) {
+	buffer->size = buffer->size == 0 ? INITIAL_INPUT_SIZE : 
+		buffer->size * 2;
+	buffer->data = realloc(buffer->data, buffer->size);
+    }
+
+    int bytes;
+    do {
+	bytes = read(fd, buffer->data + buffer->length, 
+		buffer->size - buffer->length);
+    } while (bytes < 0 && errno == EINTR);
+    if (bytes > 0) {
+	buffer->length += bytes;
+    }
+    return bytes;
+}
+
+/* consume_buffer()
+ * ----------------
+ * Discards the given number of processed bytes from the front of a buffer.
+ *
+ * buffer: the buffer to discard from
+ * processed: the number of bytes to discard
+ */
+void consume_buffer(InputBuffer* buffer, int processed) {
+    memmove(buffer->data, buffer->data + processed, 
+	    buffer->length - processed);
+    buffer->length -= processed;
+}
+
+/* write_all()
+ * -----------
+ * Writes the whole of the given data to a file descriptor.
+ *
+ * fd: the file descriptor to write to
+ * data: the data to write
+ * length: the number of bytes to write
+ *
+ * Returns: 1 if everything was written, else 0
+ */
+int write_all(int fd, char* data, int length) {
+    while (length > 0) {
+	int written = write(fd, data, length);
+	if (written < 0 && errno == EINTR) {
+	    continue;
+	} else if (written <= 0) {
+	    return 0;
+	}
+	data += written;
+	length -= written;
+    }
+    return 1;
+}
+
+/* pong_for()
+ * ----------
+ * Formats the reply to a ":ping <tick>" keepalive from the server.
+ *
+ * line: the received line, without its newline
+ *
+ * Returns: "pong <tick>\n" in newly allocated memory, or NULL if the line 
+ * is not a keepalive
+ */
+char* pong_for(char* line) {
+    if (strncmp(line, ":ping ", strlen(":ping "))) {
+	return NULL;
+    }
+    char* reply = malloc(strlen(line) + 1);
+    sprintf(reply, "pong %s\n", line + strlen(":ping "));
+    return reply;
+}
+
+/* reply_to_ping()
+ * ---------------
+ * Replies to a ":ping <tick>" keepalive from the server with "pong <tick>".
+ *
+ * fd: the socket the line was received on
+ * line: the received line, without its newline
+ *
+ * Returns: 1 if the line was a keepalive, else 0
+ */
+int reply_to_ping(int fd, char* line) {
+    char* reply = pong_for(line);
+    if (reply == NULL) {
+	return 0;
+    }
+    write_all(fd, reply, strlen(reply));
+    free(reply);
+    return 1;
+}
+
+/* send_to_session()
+ * -----------------
+ * Sends the given data on a session's connection without blocking: as much
+ * as the socket takes now is written, and the rest is added to the 
+ * session's output buffer, to be written by flush_session() once the socket
+ * is writable. Data is always appended behind anything already waiting.
+ *
+ * session: the session to send on
+ * data: the data to send
+ * length: the number of bytes to send
+ *
+ * Returns: 1 on success, or 0 if the connection has failed
+ */
+int send_to_session(Session* session, char* data, int length) {
+    InputBuffer* output = &session->output;
+    if (output->length == 0) {
+	int written;
+	do {
+	    written = write(session->fd, data, length);
+	} while (written < 0 && errno == EINTR);
+	if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+	    return 0;
+	}
+	if (written > 0) {
+	    data += written;
+	    length -= written;
+	}
+    }
+    if (length > 0) {
+	if (output->length + length > output->size) {
+	    while (output->length + length > output->size) {
+		output->size = output->size == 0 ? INITIAL_INPUT_SIZE : 
+			output->size * 2;
+	    }
+	    output->data = realloc(output->data, output->size);
+	}
+	memcpy(output->data + output->length, data, length);
+	output->length += length;
+    }
+    return 1;
+}
+
+/* flush_session()
+ * ---------------
+ * Writes as much of a session's output buffer as its socket takes without
+ * blocking.
+ *
+ * session: the session to flush
+ *
+ * Returns: 1 on success, or 0 if the connection has failed
+ */
+int flush_session(Session* session) {
+    InputBuffer* output = &session->output;
+    int written;
+    do {
+	written = write(session->fd, output->data, output->length);
+    } while (written < 0 && errno == EINTR);
+    if (written < 0) {
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    consume_buffer(output, written);
+    return 1;
+}
+
+/* find_session()
+ * --------------
+ * Searches the multiplexer's sessions for the given session id.
+ *
+ * mux: the multiplexer to search
+ * id: the session id to find
+ *
+ * Returns: the index of the session, or -1 if there is no such session
+ */
+int find_session(Multiplexer* mux, char* id) {
+    for (int i = 0; i < mux->count; i++) {
+	if (!strcmp(mux->sessions[i]->id, id)) {
+	    return i;
+	}
+    }
+    return -1;
+}
+
+/* open_session()
+ * --------------
+ * Opens a new session, connecting it to the server and sending its name and
+ * subscription requests, as a single-session psclient does on startup.
+ *
+ * mux: the multiplexer to add the session to
+ * args: the session id, followed by its name and any topics
+ */
+void open_session(Multiplexer* mux, char* args) {
+    char** tokens = split_by_char(args, ' ', 0);
+    char* id = tokens[0];
+
+    // Invalid session id, name or topics
+    int valid = tokens[1] != NULL;
+    for (int i = 0; valid && tokens[i] != NULL; i++) {
+	valid = check_spaces_colons_newlines_empty(tokens[i]);
+    }
+    int fd;
+    if (!valid) {
+	fprintf(stderr, "psclient: invalid session\n");
+    } else if (find_session(mux, id) >= 0) {
+	fprintf(stderr, "psclient: session %s already open\n", id);
+    } else if ((fd = open_socket(mux->port)) < 0) {
+	fprintf(stderr, "psclient: unable to connect to port %s\n", 
+		mux->port);
+
+    // Connected - queue name and subscriptions in a single write
+    } else {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	Session* session = calloc(1, sizeof(struct Session));
+	session->id = strdup(id);
+	session->fd = fd;
+
+	int length = snprintf(NULL, 0, "name %s\n", tokens[1]);
+	for (int i = 2; tokens[i] != NULL; i++) {
+	    length += snprintf(NULL, 0, "sub %s\n", tokens[i]);
+	}
+	char* requests = malloc(length + 1);
+	int offset = sprintf(requests, "name %s\n", tokens[1]);
+	for (int i = 2; tokens[i] != NULL; i++) {
+	    offset += sprintf(requests + offset, "sub %s\n", tokens[i]);
+	}
+	send_to_session(session, requests, length);
+	free(requests);
+
+	if (mux->count == mux->capacity) {
+	    mux->capacity *= 2;
+	    mux->sessions = realloc(mux->sessions, 
+		    sizeof(Session*) * mux->capacity);
+	    mux->polls = realloc(mux->polls, 
+		    sizeof(struct pollfd) * (mux->capacity + 1));
+	}
+	mux->sessions[mux->count] = session;
+	mux->polls[mux->count + 1].fd = fd;
+	mux->polls[mux->count + 1].events = POLLIN;
+	mux->polls[mux->count + 1].revents = 0;
+	mux->count++;
+    }
+    free(tokens);
+}
+
+/* close_session()
+ * ---------------
+ * Disconnects and frees a session, moving the last session into its place.
+ * Anything still in its output buffer is discarded.
+ *
+ * mux: the multiplexer to remove the session from
+ * index: the index of the session to close
+ */
+void close_session(Multiplexer* mux, int index) {
+    Session* session = mux->sessions[index];
+    close(session->fd);
+    if (session->inflaterReady) {
+	inflateEnd(&session->inflater);
+    }
+    free(session->input.data);
+    free(session->output.data);
+    free(session->previous);
+    free(session->id);
+    free(session);
+
+    mux->count--;
+    mux->sessions[index] = mux->sessions[mux->count];
+    mux->polls[index + 1] = mux->polls[mux->count + 1];
+}
+
+/* print_session_messages()
+ * ------------------------
+ * Prints each complete message received by a session to standard out, 
+ * prefixed by the session id, replying to keepalives instead of printing 
+ * them. Compressed frames are inflated once their whole block has arrived; 
+ * partial messages are left in the buffer.
+ *
+ * session: the session whose received messages are to be printed
+ *
+ * Returns: 1 on success, or 0 if an invalid frame was received or a 
+ * keepalive could not be answered
+ */
+int print_session_messages(Session* session) {
+    InputBuffer* input = &session->input;
+    int processed = 0;
+    char* end;
+
+    while ((end = memchr(input->data + processed, '\n', 
+	    input->length - processed)) != NULL) {
+	char* line = input->data + processed;
+	int next = end - input->data + 1;
+	char* text;
+	*end = '\0';
+
+	// Compressed frame - wait for the whole block
+	if (!strncmp(line, ":z ", strlen(":z "))) {
+	    int compressedLength;
+	    int rawLength;
+	    if (!parse_frame_header(line, &compressedLength, &rawLength)) {
+		return 0;
+	    }
+	    if (input->length - next < compressedLength) {
+		*end = '\n';
+		break;
+	    }
+	    if (!session->inflaterReady) {
+		inflateInit2(&session->inflater, -MAX_WBITS);
+		session->inflaterReady = 1;
+	    }
+	    if ((text = inflate_block(input->data + next, compressedLength, 
+		    rawLength, &session->inflater, 
+		    session->previous)) == NULL) {
+		return 0;
+	    }
+	    next += compressedLength;
+	} else {
+	    text = malloc(strlen(line) + 2);
+	    sprintf(text, "%s\n", line);
+	}
+
+	char* pong = pong_for(line);
+	if (pong == NULL) {
+	    printf("%s %s", session->id, text);
+	} else if (!send_to_session(session, pong, strlen(pong))) {
+	    free(pong);
+	    free(text);
+	    return 0;
+	}
+	free(pong);
+	free(session->previous);
+	session->previous = text;
+	processed = next;
+    }
+    consume_buffer(input, processed);
+    return 1;
+}
+
+/* read_session()
+ * --------------
+ * Reads what is available on a session's connection and prints each 
+ * complete message received.
+ *
+ * session: the session to read
+ *
+ * Returns: 1 on success, or 0 if the connection has been terminated or an 
+ * invalid frame was received
+ */
+int read_session(Session* session) {
+    int bytes = fill_buffer(&session->input, session->fd);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+	return 1;
+    }
+    return bytes > 0 && print_session_messages(session);
+}
+
+/* handle_control_line()
+ * ---------------------
+ * Carries out one line of multi-session control input. "+<id> <name> 
+ * [topic] ..." opens a session, "-<id>" closes one, and "<id> <line>" sends 
+ * the line to the server on the session's connection.
+ *
+ * mux: the multiplexer the line applies to
+ * line: the control line
+ */
+void handle_control_line(Multiplexer* mux, char* line) {
+    if (line[0] == '\0') {
+	return;
+    } else if (line[0] == '+') {
+	open_session(mux, line + 1);
+	return;
+    }
+
+    int index;
+    if (line[0] == '-') {
+	if ((index = find_session(mux, line + 1)) >= 0) {
+	    close_session(mux, index);
+	} else {
+	    fprintf(stderr, "psclient: unknown session %s\n", line + 1);
+	}
+	return;
+    }
+
+    char* request = strchr(line, ' ');
+    if (request == NULL) {
+	fprintf(stderr, "psclient: invalid session\n");
+	return;
+    }
+    *request++ = '\0';
+    if ((index = find_session(mux, line)) < 0) {
+	fprintf(stderr, "psclient: unknown session %s\n", line);
+    } else {
+	// The line's terminator is sent with it
+	int length = strlen(request);
+	request[length] = '\n';
+	if (!send_to_session(mux->sessions[index], request, length + 1)) {
+	    fprintf(stderr, "psclient: session %s connection terminated\n",
+		    line);
+	    close_session(mux, index);
+	}
+    }
+}
+
+/* report_terminated()
+ * -------------------
+ * Reports on standard error that a session's connection has terminated, 
+ * and closes the session.
+ *
+ * mux: the multiplexer the session belongs to
+ * index: the index of the session
+ */
+void report_terminated(Multiplexer* mux, int index) {
+    fprintf(stderr, "psclient: session %s connection terminated\n", 
+	    mux->sessions[index]->id);
+    close_session(mux, index);
+}
+
+/* drain_sessions()
+ * ----------------
+ * Waits until every session's output buffer has been written to its 
+ * socket, closing any session whose connection fails meanwhile.
+ *
+ * mux: the multiplexer whose sessions are to be drained
+ */
+void drain_sessions(Multiplexer* mux) {
+    while (1) {
+	int waiting = 0;
+	for (int i = 0; i < mux->count; i++) {
+	    mux->polls[i + 1].events = 
+		    mux->sessions[i]->output.length > 0 ? POLLOUT : 0;
+	    waiting += mux->sessions[i]->output.length > 0;
+	}
+	if (waiting == 0) {
+	    return;
+	}
+	if (poll(mux->polls + 1, mux->count, -1) < 0) {
+	    continue; // Interrupted
+	}
+	for (int i = mux->count - 1; i >= 0; i--) {
+	    if (mux->polls[i + 1].revents && 
+		    !flush_session(mux->sessions[i])) {
+		report_terminated(mux, i);
+	    }
+	}
+    }
+}
+
+/* handle_control_input()
+ * ----------------------
+ * Reads the available control input and carries out each complete line. 
+ * At end of input any final unterminated line is carried out, whatever 
+ * the sessions have yet to send is sent, and the program exits.
+ *
+ * mux: the multiplexer the control input applies to
+ */
+void handle_control_input(Multiplexer* mux) {
+    InputBuffer* control = &mux->control;
+    int bytes = fill_buffer(control, mux->controlFd);
+    if (bytes <= 0 && control->length > 0) {
+	// End of input - terminate the final line, making room if needed
+	if (control->length == control->size) {
+	    control->data = realloc(control->data, ++control->size);
+	}
+	control->data[control->length++] = '\n';
+    }
+
+    int processed = 0;
+    char* end;
+    while ((end = memchr(control->data + processed, '\n', 
+	    control->length - processed)) != NULL) {
+	*end = '\0';
+	handle_control_line(mux, control->data + processed);
+	processed = end - control->data + 1;
+    }
+    consume_buffer(control, processed);
+
+    if (bytes <= 0) {
+	drain_sessions(mux);
+	fflush(stdout);
+	exit(0);
+    }
+}
+
+/* run_sessions()
+ * --------------
+ * Runs multi-session mode: a single event loop that multiplexes many 
+ * logical client sessions, each with its own connection, name and 
+ * subscriptions. Sessions are driven by control lines read from the given 
+ * script (or standard in) and every message received is printed prefixed by
+ * its session's id. Requests are sent without blocking, so one session that
+ * the server is slow to read from does not hold up the others; control 
+ * input is paused instead while too much is waiting to be sent. A session 
+ * whose connection is terminated is reported on standard error and closed;
+ * the program exits at the end of control input.
+ *
+ * port: the port number each session connects to
+ * script: the control script to read, or NULL to read standard in
+ *
+ * Errors: the program will exit with status 1 if the script cannot be opened
+ */
+void run_sessions(char* port, char* script) {
+    int control = script == NULL ? STDIN_FILENO : open(script, O_RDONLY);
+    if (control < 0) {
+	fprintf(stderr, "psclient: unable to open script %s\n", script);
+	exit(1);
+    }
+
+    Multiplexer mux = {.port = port, .count = 0, 
+	    .capacity = INITIAL_SESSIONS, .controlFd = control, 
+	    .pendingOutput = 0};
+    memset(&mux.control, 0, sizeof(InputBuffer));
+    mux.sessions = malloc(sizeof(Session*) * mux.capacity);
+    mux.polls = malloc(sizeof(struct pollfd) * (mux.capacity + 1));
+    mux.polls[0].fd = control;
+    mux.polls[0].events = POLLIN;
+
+    // A session's connection closing must not end the other sessions
+    signal(SIGPIPE, SIG_IGN);
+
+    while (1) {
+	// Wait to write only where output is waiting, and pause control 
+	// input (a negative descriptor is ignored) while too much is
+	mux.pendingOutput = 0;
+	for (int i = 0; i < mux.count; i++) {
+	    int waiting = mux.sessions[i]->output.length;
+	    mux.polls[i + 1].events = waiting > 0 ? POLLIN | POLLOUT : POLLIN;
+	    mux.pendingOutput += waiting;
+	}
+	mux.polls[0].fd = mux.pendingOutput > MAX_SESSION_OUTPUT ? -1 : 
+		control;
+	if (poll(mux.polls, mux.count + 1, -1) < 0) {
+	    continue; // Interrupted
+	}
+	if (mux.polls[0].revents) {
+	    handle_control_input(&mux);
+	}
+
+	// Sessions are visited from the end so that closing one only moves a
+	// session that has already been visited
+	for (int i = mux.count - 1; i >= 0; i--) {
+	    Session* session = mux.sessions[i];
+	    short revents = mux.polls[i + 1].revents;
+	    if ((revents & POLLOUT && !flush_session(session)) || 
+		    (revents & (POLLIN | POLLHUP | POLLERR) && 
+		    !read_session(session))) {
+		report_terminated(&mux, i);
+	    }
+	}
+	fflush(stdout);
+    }
+}
+
+/* next_record()
+ * -------------
+ * Reads the record at the given offset of a mapped capture.
+ *
+ * replay: the replay whose capture is to be read
+ * offset: the offset of the record, advanced past it
+ * record: set to the record
+ *
+ * Returns: 1 if a whole record was read, or 0 at the end of the capture
+ */
+int next_record(Replay* replay, size_t* offset, Record* record) {
+    uint32_t length;
+    if (replay->length - *offset < RECORD_HEADER_SIZE) {
+	return 0;
+    }
+    char* header = replay->data + *offset;
+    memcpy(&length, header + sizeof(uint64_t), sizeof(uint32_t));
+    if (replay->length - *offset - RECORD_HEADER_SIZE < length) {
+	return 0;
+    }
+
+    uint64_t time;
+    memcpy(&time, header, sizeof(uint64_t));
+    record->time = time;
+    record->direction = header[sizeof(uint64_t) + sizeof(uint32_t)];
+    record->line = header + RECORD_HEADER_SIZE;
+    record->length = length;
+    *offset += RECORD_HEADER_SIZE + length;
+    return 1;
+}
+
+/* parse_publication()
+ * -------------------
+ * Determines whether a captured line is a publication: either a "pub" 
+ * request sent by the capturing client, or a message it received from 
+ * another client. Messages the capturing client received from itself are 
+ * skipped as they duplicate its requests.
+ *
+ * replay: the replay the capture belongs to
+ * record: the captured line
+ * publication: set to the publication's publisher, topic and value
+ *
+ * Returns: 1 if the line is a valid publication, else 0
+ */
+int parse_publication(Replay* replay, Record* record, 
+	Publication* publication) {
+    char* line = record->line;
+    char* end = line + record->length;
+    char* topicEnd;
+    publication->time = record->time;
+
+    // Sent "pub <topic> <value>"
+    if (record->direction == CAPTURE_SENT) {
+	if (record->length <= strlen("pub ") || 
+		strncmp(line, "pub ", strlen("pub "))) {
+	    return 0;
+	}
+	publication->publisher = replay->ownName;
+	publication->publisherLength = replay->ownNameLength;
+	publication->topic = line + strlen("pub ");
+	topicEnd = memchr(publication->topic, ' ', end - publication->topic);
+
+    // Received "<publisher>:<topic>:<value>"
+    } else {
+	char* publisherEnd = memchr(line, ':', record->length);
+	if (publisherEnd == NULL || publisherEnd == line || 
+		(publisherEnd - line == replay->ownNameLength && 
+		!strncmp(line, replay->ownName, replay->ownNameLength))) {
+	    return 0;
+	}
+	publication->publisher = line;
+	publication->publisherLength = publisherEnd - line;
+	publication->topic = publisherEnd + 1;
+	topicEnd = memchr(publication->topic, ':', end - publication->topic);
+    }
+
+    if (topicEnd == NULL || topicEnd == publication->topic || 
+	    topicEnd + 1 == end) {
+	return 0;
+    }
+    publication->topicLength = topicEnd - publication->topic;
+    publication->value = topicEnd + 1;
+    publication->valueLength = end - publication->value;
+    return 1;
+}
+
+/* find_string()
+ * -------------
+ * Searches an array of strings for a string given by its length.
+ *
+ * strings: the array to search
+ * count: the number of strings in the array
+ * string: the string to find, which need not be terminated
+ * length: the length of the string
+ *
+ * Returns: the index of the string, or -1 if not found
+ */
+int find_string(char** strings, int count, char* string, int length) {
+    for (int i = 0; i < count; i++) {
+	if (!strncmp(strings[i], string, length) && 
+		strings[i][length] == '\0') {
+	    return i;
+	}
+    }
+    return -1;
+}
+
+/* add_string()
+ * ------------
+ * Adds a copy of a string given by its length to an array of distinct 
+ * strings, unless it is already present.
+ *
+ * strings: the array to add to, reallocated as it grows
+ * count: the number of strings in the array, updated if added
+ * string: the string to add, which need not be terminated
+ * length: the length of the string
+ *
+ * Returns: the index of the string in the array
+ */
+int add_string(char*** strings, int* count, char* string, int length) {
+    int index = find_string(*strings, *count, string, length);
+    if (index < 0) {
+	*strings = realloc(*strings, sizeof(char*) * (*count + 1));
+	(*strings)[*count] = strndup(string, length);
+	index = (*count)++;
+    }
+    return index;
+}
+
+/* scan_capture()
+ * --------------
+ * Makes a first pass over a capture, finding the capturing client's name, 
+ * the distinct publishers and topics, and the number and time span of the 
+ * publications.
+ *
+ * replay: the replay whose capture is to be scanned
+ */
+void scan_capture(Replay* replay) {
+    size_t offset = CAPTURE_HEADER_SIZE;
+    Record record;
+    Publication publication;
+
+    while (next_record(replay, &offset, &record)) {
+	// Capturing client's name precedes its requests
+	if (record.direction == CAPTURE_SENT && 
+		record.length > strlen("name ") && 
+		!strncmp(record.line, "name ", strlen("name "))) {
+	    replay->ownName = record.line + strlen("name ");
+	    replay->ownNameLength = record.length - strlen("name ");
+	} else if (parse_publication(replay, &record, &publication)) {
+	    add_string(&replay->publishers, &replay->publisherCount, 
+		    publication.publisher, publication.publisherLength);
+	    add_string(&replay->topics, &replay->topicCount, 
+		    publication.topic, publication.topicLength);
+	    if (replay->publications == 0) {
+		replay->firstTime = publication.time;
+	    }
+	    replay->lastTime = publication.time;
+	    replay->publications++;
+	}
+    }
+}
+
+/* handle_probe_line()
+ * -------------------
+ * Matches a message received by the probe to the publication it was sent 
+ * as, recording its delivery latency. Messages from one replay connection 
+ * on one topic arrive in the order they were published, so the match is 
+ * the oldest outstanding publication on that connection and topic.
+ *
+ * replay: the replay the probe belongs to
+ * line: the received message
+ */
+void handle_probe_line(Replay* replay, char* line) {
+    char* topic = strchr(line, ':');
+    char* topicEnd;
+    if (reply_to_ping(replay->probe, line) || topic == NULL || 
+	    (topicEnd = strchr(++topic, ':')) == NULL) {
+	return;
+    }
+
+    // Probe's own message - its subscriptions are in place
+    if (!strncmp(line, PROBE_NAME ":", strlen(PROBE_NAME ":"))) {
+	replay->synced = 1;
+	return;
+    }
+
+    char* indexEnd;
+    long index = strtol(line + strlen(REPLAY_NAME), &indexEnd, BASE_10);
+    if (strncmp(line, REPLAY_NAME, strlen(REPLAY_NAME)) || 
+	    indexEnd != topic - 1 || index < 0 || 
+	    index >= replay->connectionCount) {
+	return;
+    }
+
+    ReplayConnection* connection = &replay->connections[index];
+    int topicLength = topicEnd - topic;
+    for (int i = connection->head; i < connection->count; i++) {
+	Pending* pending = &connection->pending[i];
+	if (pending->topic != NULL && pending->topicLength == topicLength &&
+		!strncmp(pending->topic, topic, topicLength)) {
+	    replay->latencies[replay->delivered++] = now_ns() - pending->sent;
+	    pending->topic = NULL;
+	    break;
+	}
+    }
+
+    // Skip past delivered publications
+    while (connection->head < connection->count && 
+	    connection->pending[connection->head].topic == NULL) {
+	connection->head++;
+    }
+}
+
+/* answer_keepalives()
+ * -------------------
+ * Reads what a publishing connection has received, replying to keepalives
+ * and ignoring anything else.
+ *
+ * connection: the publishing connection
+ *
+ * Errors: the program will exit with status 4 if the connection to the 
+ * server is terminated
+ */
+void answer_keepalives(ReplayConnection* connection) {
+    InputBuffer* input = &connection->input;
+    if (fill_buffer(input, connection->fd) <= 0) {
+	fprintf(stderr, "psclient: server connection terminated\n");
+	exit(4);
+    }
+    int processed = 0;
+    char* end;
+    while ((end = memchr(input->data + processed, '\n', 
+	    input->length - processed)) != NULL) {
+	*end = '\0';
+	reply_to_ping(connection->fd, input->data + processed);
+	processed = end - input->data + 1;
+    }
+    consume_buffer(input, processed);
+}
+
+/* wait_for_probe()
+ * ----------------
+ * Handles messages received by the probe until the given time, answering 
+ * keepalives sent to the publishing connections meanwhile. Checks for 
+ * messages once without waiting if the time has already passed. The final 
+ * part of a millisecond is spun through, so that replayed publications are
+ * sent at the time they are due.
+ *
+ * replay: the replay the probe belongs to
+ * until: the monotonic time in nanoseconds to wait until
+ *
+ * Errors: the program will exit with status 4 if the probe's connection to
+ * the server is terminated
+ */
+void wait_for_probe(Replay* replay, long long until) {
+    long long remaining;
+
+    do {
+	remaining = until - now_ns();
+	if (remaining < 0) {
+	    remaining = 0;
+	}
+	if (poll(replay->polls, replay->connectionCount + 1, 
+		remaining / NS_PER_MS) <= 0) {
+	    continue;
+	}
+	for (int i = 0; i < replay->connectionCount; i++) {
+	    if (replay->polls[i + 1].revents) {
+		answer_keepalives(&replay->connections[i]);
+	    }
+	}
+	if (!replay->polls[0].revents) {
+	    continue;
+	}
+
+	InputBuffer* input = &replay->probeInput;
+	if (fill_buffer(input, replay->probe) <= 0) {
+	    fprintf(stderr, "psclient: server connection terminated\n");
+	    exit(4);
+	}
+	int processed = 0;
+	char* end;
+	while ((end = memchr(input->data + processed, '\n', 
+		input->length - processed)) != NULL) {
+	    *end = '\0';
+	    handle_probe_line(replay, input->data + processed);
+	    processed = end - input->data + 1;
+	}
+	consume_buffer(input, processed);
+    } while (remaining > 0);
+}
+
+/* connect_replay()
+ * ----------------
+ * Connects the replay's publishing connections and its probe, which 
+ * subscribes to every topic in the capture. Returns once the probe has 
+ * received a message it published after subscribing, so that no replayed
+ * publication can reach the server before the probe's subscriptions.
+ *
+ * replay: the replay to connect
+ * port: the port number to connect to
+ *
+ * Errors: the program will exit with status 3 if a connection cannot be 
+ * made, or with status 4 if the probe's subscriptions are not confirmed
+ */
+void connect_replay(Replay* replay, char* port) {
+    char request[BUFSIZ];
+    replay->connections = calloc(replay->connectionCount, 
+	    sizeof(struct ReplayConnection));
+    replay->polls = calloc(replay->connectionCount + 1, 
+	    sizeof(struct pollfd));
+    for (int i = 0; i < replay->connectionCount; i++) {
+	replay->connections[i].fd = connect_to_port(port);
+	replay->polls[i + 1].fd = replay->connections[i].fd;
+	replay->polls[i + 1].events = POLLIN;
+	int length = sprintf(request, "name %s%d\n", REPLAY_NAME, i);
+	write_all(replay->connections[i].fd, request, length);
+    }
+
+    replay->probe = connect_to_port(port);
+    replay->polls[0].fd = replay->probe;
+    replay->polls[0].events = POLLIN;
+    write_all(replay->probe, "name " PROBE_NAME "\n", 
+	    strlen("name " PROBE_NAME "\n"));
+    for (int i = 0; i < replay->topicCount; i++) {
+	char* sub = malloc(strlen(replay->topics[i]) + strlen("sub \n") + 1);
+	int length = sprintf(sub, "sub %s\n", replay->topics[i]);
+	write_all(replay->probe, sub, length);
+	free(sub);
+    }
+    char* sync = "sub " SYNC_TOPIC "\npub " SYNC_TOPIC " sync\n";
+    write_all(replay->probe, sync, strlen(sync));
+
+    long long deadline = now_ns() + REPLAY_DRAIN_NS;
+    while (!replay->synced && now_ns() < deadline) {
+	wait_for_probe(replay, now_ns() + REPLAY_POLL_NS);
+    }
+    if (!replay->synced) {
+	fprintf(stderr, "psclient: server connection terminated\n");
+	exit(4);
+    }
+}
+
+/* publish_replay()
+ * ----------------
+ * Makes the second pass over a capture, publishing each publication through
+ * the connection assigned to its original publisher at its captured time 
+ * divided by the replay speed (or as fast as possible if the speed is 0).
+ *
+ * replay: the replay to publish
+ */
+void publish_replay(Replay* replay) {
+    size_t offset = CAPTURE_HEADER_SIZE;
+    Record record;
+    Publication publication;
+    InputBuffer request = {.data = NULL, .length = 0, .size = 0};
+    replay->start = now_ns();
+
+    while (next_record(replay, &offset, &record)) {
+	if (!parse_publication(replay, &record, &publication)) {
+	    continue;
+	}
+
+	// Wait until due, handling deliveries meanwhile
+	if (replay->speed > 0) {
+	    wait_for_probe(replay, replay->start + (long long) 
+		    ((publication.time - replay->firstTime) / replay->speed));
+	} else if (replay->published % PROBE_CHECK_INTERVAL == 0) {
+	    wait_for_probe(replay, 0);
+	}
+
+	int length = publication.topicLength + publication.valueLength + 
+		strlen("pub  \n");
+	if (length > request.size) {
+	    request.size = length;
+	    request.data = realloc(request.data, request.size + 1);
+	}
+	sprintf(request.data, "pub %.*s %.*s\n", publication.topicLength, 
+		publication.topic, publication.valueLength, publication.value);
+
+	// Publish through the publisher's connection
+	int index = find_string(replay->publishers, replay->publisherCount, 
+		publication.publisher, publication.publisherLength) % 
+		replay->connectionCount;
+	ReplayConnection* connection = &replay->connections[index];
+	if (connection->count == connection->capacity) {
+	    connection->capacity = connection->capacity == 0 ? 
+		    INITIAL_PENDING : connection->capacity * 2;
+	    connection->pending = realloc(connection->pending, 
+		    sizeof(struct Pending) * connection->capacity);
+	}
+	Pending* pending = &connection->pending[connection->count++];
+	pending->topic = publication.topic;
+	pending->topicLength = publication.topicLength;
+	pending->sent = now_ns();
+	write_all(connection->fd, request.data, length);
+	replay->published++;
+    }
+    replay->finish = now_ns();
+    free(request.data);
+}
+
+/* compare_latencies()
+ * -------------------
+ * Comparison function for sorting latencies in ascending order.
+ *
+ * first: pointer to the first latency
+ * second: pointer to the second latency
+ *
+ * Returns: negative, zero or positive as first is less than, equal to or 
+ * greater than second
+ */
+int compare_latencies(const void* first, const void* second) {
+    long long a = *(const long long*) first;
+    long long b = *(const long long*) second;
+    return (a > b) - (a < b);
+}
+
+/* report_replay()
+ * ---------------
+ * Prints the replay's achieved publication rate, alongside the rate at which
+ * the publications were captured, and the distribution of the server's 
+ * delivery latency as observed by the probe.
+ *
+ * replay: the replay to report on
+ */
+void report_replay(Replay* replay) {
+    double elapsed = (double) (replay->finish - replay->start) / 
+	    NS_PER_SECOND;
+    double captured = (double) (replay->lastTime - replay->firstTime) / 
+	    NS_PER_SECOND;
+    printf("replayed %d messages through %d connections in %.3f s "
+	    "(%.0f msg/s, captured at %.0f msg/s)\n", replay->published, 
+	    replay->connectionCount, elapsed, 
+	    elapsed > 0 ? replay->published / elapsed : 0, 
+	    captured > 0 ? replay->publications / captured : 0);
+
+    if (replay->delivered > 0) {
+	long long* latencies = replay->latencies;
+	int count = replay->delivered;
+	qsort(latencies, count, sizeof(long long), compare_latencies);
+	printf("delivery latency: p50 %.1f us, p99 %.1f us, max %.1f us ",
+		latencies[(int) (count * PERCENTILE_50)] / NS_PER_US, 
+		latencies[(int) (count * PERCENTILE_99)] / NS_PER_US,
+		latencies[count - 1] / NS_PER_US);
+    } else {
+	printf("delivery latency: none measured ");
+    }
+    printf("(%d of %d delivered)\n", replay->delivered, replay->published);
+    fflush(stdout);
+}
+
+/* run_replay()
+ * ------------
+ * Runs replay mode: publishes the publications in a capture through a 
+ * number of connections at a multiple of their captured rate, and reports
+ * the rate achieved and the server's delivery latency. Each original 
+ * publisher is assigned a connection so that its publications keep their 
+ * order.
+ *
+ * port: the port number to connect to
+ * path: the capture file to replay
+ * speed: the replay speed, as a multiple of the captured rate or "max" 
+ * (defaults to 1 if NULL)
+ * connections: the number of connections to publish through (defaults to 
+ * one per original publisher if NULL)
+ *
+ * Errors: the program will exit with status 1 if the speed or number of 
+ * connections is invalid, with status 2 if the capture cannot be read, 
+ * with status 3 if the server cannot be connected to, or with status 4 if
+ * the connection to the server is terminated
+ */
+void run_replay(char* port, char* path, char* speed, char* connections) {
+    Replay replay;
+    memset(&replay, 0, sizeof(Replay));
+    char* speedEnd = "";
+    char* countEnd = "";
+    replay.speed = speed == NULL ? 1 : !strcmp(speed, "max") ? 0 : 
+	    strtod(speed, &speedEnd);
+    long count = connections == NULL ? 0 : strtol(connections, &countEnd, 
+	    BASE_10);
+    if (*speedEnd != '\0' || *countEnd != '\0' || (speed != NULL && 
+	    strcmp(speed, "max") && replay.speed <= 0) || 
+	    (connections != NULL && count <= 0)) {
+	fprintf(stderr, USAGE);
+	exit(1);
+    }
+
+    // Map the capture
+    int fd = open(path, O_RDONLY);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) || 
+	    (size_t) status.st_size < CAPTURE_HEADER_SIZE || 
+	    (replay.data = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE,
+	    fd, 0)) == MAP_FAILED || 
+	    memcmp(replay.data, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC))) {
+	fprintf(stderr, "psclient: invalid capture %s\n", path);
+	exit(2);
+    }
+    replay.length = status.st_size;
+    replay.ownName = "";
+
+    scan_capture(&replay);
+    replay.connectionCount = count > 0 ? count : 
+	    replay.publisherCount > 0 ? replay.publisherCount : 1;
+    replay.latencies = malloc(sizeof(long long) * 
+	    (replay.publications + 1));
+    signal(SIGPIPE, SIG_IGN);
+    connect_replay(&replay, port);
+    publish_replay(&replay);
+
+    // Collect deliveries until they stop arriving
+    long long quiet = now_ns() + REPLAY_DRAIN_NS;
+    while (replay.delivered < replay.published && now_ns() < quiet) {
+	int delivered = replay.delivered;
+	wait_for_probe(&replay, now_ns() + REPLAY_POLL_NS);
+	if (replay.delivered > delivered) {
+	    quiet = now_ns() + REPLAY_DRAIN_NS;
+	}
+    }
+    report_replay(&replay);
+    exit(0);
+}
+
 int main(int argc, char* argv[]) {
     handle_arguments(argc, argv);
     char* port = argv[PORT];
     char* name = argv[NAME];
+    if (!strcmp(name, MULTI_FLAG)) {
+	run_sessions(port, argc > SCRIPT ? argv[SCRIPT] : NULL);
+    } else if (!strcmp(name, REPLAY_FLAG)) {
+	run_replay(port, argv[CAPTURE_FILE], argc > SPEED ? argv[SPEED] : 
+		NULL, argc > CONNECTIONS ? argv[CONNECTIONS] : NULL);
+    }
+    capture = open_capture();
+    atexit(close_capture);
 
     // Connect to port and open file pointers for read/write
     int fd = connect_to_port(port);
@@ -148,27 +1839,44 @@ int main(int argc, char* argv[]) {
     FILE* from = fdopen(fd2, "r");
 
     // Send name to server
-    fprintf(to, "name %s\n", name);
-    fflush(to);
+    char* request = malloc(strlen("name ") + strlen(name) + 1);
+    sprintf(request, "name %s", name);
+    send_line(to, request);
+    free(request);
 
     // Send subscription requests to server
     if (argc >= TOPIC_PRESENT) {
 	for (int i = FIRST_TOPIC; i < argc; i++) {
-	    fprintf(to, "sub %s\n", argv[i]);
-	    fflush(to);
+	    request = malloc(strlen("sub ") + strlen(argv[i]) + 1);
+	    sprintf(request, "sub %s", argv[i]);
+	    send_line(to, request);
+	    free(request);
 	}
     }
 
     // Create thread to read from server
+    sem_init(&credits, 0, 0);
     pthread_t tid;
-    pthread_create(&tid, 0, read_thread, from); 
+    ServerStreams streams = {.from = from, .to = to};
+    pthread_create(&tid, 0, read_thread, &streams); 
     pthread_detach(tid);
 
-    // Read from stdin 
+    // Read from stdin, pausing before each publish until credit is granted
+    // if flow control is on
     char* line;
     while ((line = read_line(stdin)) != NULL) {
-	fprintf(to, "%s\n", line);
-	fflush(to);
+	if (!strcmp(line, "credit on")) {
+	    creditEnabled = 1;
+	} else if (!strcmp(line, "credit off")) {
+	    creditEnabled = 0;
+	    while (sem_trywait(&credits) == 0) {
+		// Discard unspent credit
+	    }
+	} else if (creditEnabled && !strncmp(line, "pub ", strlen("pub "))) {
+	    sem_wait(&credits);
+	}
+	send_line(to, line);
+	free(line);
     }
 
     exit(0);
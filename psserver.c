@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,48 +15,413 @@
 #include <stringmap.h>
 #include <semaphore.h>
 #include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <errno.h>
+#include <zlib.h>
+#include <time.h>
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define MIN_ARGS 2
 #define MAX_ARGS 3
 #define BASE_10 10
+#define MAX_INT_DIGITS 11
 #define CONNECTIONS_ARG 1
 #define PORT_ARG 2
 #define MIN_PORT_NUM 1024
 #define MAX_PORT_NUM 65535
 #define INITIAL_BUFFER_SIZE 3
+#define INITIAL_SUBSCRIBERS 4
 #define COUNT 1
 #define DONT_COUNT 0
 #define TWO_TOKENS 2
+#define FANOUT_THRESHOLD 1024
+#define FANOUT_CHUNK_SIZE 256
+#define GROUP_PREFIX "$group/"
+#define PRIORITY_TOPIC -1
+#define PRIORITY_HIGH 0
+#define PRIORITY_NORMAL 1
+#define PRIORITY_LOW 2
+#define NUM_PRIORITIES 3
+#define STARVATION_LIMIT 16
+#define COMPRESSION_NONE 0
+#define COMPRESSION_DEFLATE 1
+#define COMPRESS_THRESHOLD 256
+#define COMPRESS_LEVEL 1
+#define COMPRESS_CACHE_LIMIT 8
+#define TRACE_RECEIVE 0
+#define TRACE_PARSED 1
+#define TRACE_LOOKUP 2
+#define TRACE_ENQUEUE 3
+#define TRACE_BUFFERED 4
+#define TRACE_FLUSH 5
+#define TRACE_BUFFER_SIZE 4096
+#define DEFAULT_TRACE_FILE "psserver-trace.json"
+#define NANOSECONDS_PER_SECOND 1000000000L
+#define NANOSECONDS_PER_MICROSECOND 1000.0
+#define READ_BUFFER_SIZE 4096
+#define SSE2_WIDTH 16
+#define AVX2_WIDTH 32
+#define HANDOVER_LISTEN 0
+#define HANDOVER_PRIORITY 1
+#define HANDOVER_CLIENT 2
+#define HANDOVER_STATS 3
+#define HANDOVER_END 4
+#define HANDOVER_ACK 5
+#define HANDOVER_POLL_MICROSECONDS 1000
+#define HANDOVER_STOP_MILLISECONDS 1000
+#define HANDOVER_PARK_MILLISECONDS 2000
+#define CLIENT_STACK_SIZE (256 * 1024)
+#define MILLISECONDS_PER_SECOND 1000.0
+#define CREDIT_BATCH 64
+#define CREDIT_LOW_WATER 32
+#define CREDIT_QUEUE_LIMIT (1 << 20)
+#define CREDIT_RETRY_MILLISECONDS 10
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define TICK_MILLISECONDS 100
+#define NANOSECONDS_PER_MILLISECOND 1000000L
+#define INITIAL_CONNECTION_SLOTS 64
+#define LIMIT_REJECT 0
+#define LIMIT_DELAY 1
+#define LIMIT_DROP 2
+#define ANY_CLIENT "*"
+#define NO_CPU -1
+#define DEFAULT_QUEUE_LIMIT (16 << 20)
+#define QUEUE_DROP 0
+#define QUEUE_DISCONNECT 1
+
+/* Struct containing the positions of the separators in a received line of the
+ * form "<command> <argument>", all found in the same pass that finds the end
+ * of the line. Argument positions are relative to the start of the argument.
+ * Positions are -1 if the separator is not present */
+typedef struct LineScan {
+    int length;
+    int commandEnd;
+    int argumentSpace;
+    int argumentColon;
+} LineScan;
+
+/* Struct containing the receive buffer of a client's connection. Lines are
+ * scanned incrementally as data arrives */
+typedef struct LineReader {
+    int fd;
+    int wakeFd;
+    int interrupted;
+    char* buffer;
+    int size;
+    int start;
+    int end;
+    int scanned;
+    LineScan scan;
+} LineReader;
+
+/* Struct representing a single trace point reached by a sampled message, and
+ * the thread that recorded it */
+typedef struct TraceEvent {
+    unsigned long traceId;
+    int point;
+    int threadId;
+    long timestamp;
+} TraceEvent;
+
+/* Struct containing the ring of trace events recorded by a single thread. 
+ * Only the owning thread writes to the ring, so no locking is required. The
+ * buffer is recycled by another thread once its owner has exited, under a 
+ * new thread ID */
+typedef struct TraceBuffer {
+    TraceEvent events[TRACE_BUFFER_SIZE];
+    unsigned long recorded;
+    int threadId;
+    int inUse;
+    struct TraceBuffer* next;
+} TraceBuffer;
+
+/* Struct representing a message compressed against the message with the 
+ * given ID as its dictionary (0 for none), in a list of such blocks */
+typedef struct CompressedBlock {
+    unsigned long dictionary;
+    char* data;
+    int length;
+    struct CompressedBlock* next;
+} CompressedBlock;
+
+/* Struct containing a formatted message shared between every outbound queue
+ * it has been placed on. Freed once the last reference is released. Caches 
+ * the message compressed against the dictionaries of up to 
+ * COMPRESS_CACHE_LIMIT different preceding messages, so that it is only 
+ * compressed once for the subscribers sharing each dictionary */
+typedef struct Message {
+    unsigned long id;
+    unsigned long traceId;
+    char* text;
+    int length;
+    int refs;
+    sem_t cacheLock;
+    CompressedBlock* compressed;
+    int compressedCount;
+} Message;
+
+/* Struct representing a node in a singly linked list of queued messages */
+typedef struct QueuedMessage {
+    Message* message;
+    struct QueuedMessage* next;
+} QueuedMessage;
+
+/* Struct containing the outbound side of a client's connection. Messages are
+ * queued on one lane per priority and written to the client by a dedicated
+ * writer thread. Published messages are only queued while the lanes hold
+ * less than the queue limit */
+typedef struct Connection {
+    FILE* toClient;
+    QueuedMessage* laneHead[NUM_PRIORITIES];
+    QueuedMessage* laneTail[NUM_PRIORITIES];
+    int queuedMessages;
+    int queuedBytes;
+    int overflowed;
+    int closing;
+    int stopping;
+    int starvedCount;
+    int compression;
+    Message* switchMessage;
+    int switchCompression;
+    int deflaterReady;
+    z_stream deflater;
+    Message* lastSent;
+    int unsentBytes;
+    unsigned long flushedBytes;
+    sem_t queueLock;
+    sem_t pending;
+    pthread_t writer;
+    int slot;
+    unsigned int serial;
+} Connection;
+
+/* Struct representing a connection's idle timer, in the doubly linked list
+ * of a timer wheel slot. The client thread records the tick of the last 
+ * line received; the timer is rescheduled when it fires rather than on 
+ * every line. The bytes the client has acknowledged, not counting pings, 
+ * are noted when it fires, as a subscriber receiving messages is active 
+ * too. */
+typedef struct IdleTimer {
+    unsigned long expiry;
+    struct IdleTimer* prev;
+    struct IdleTimer* next;
+    struct IdleTimer** slot;
+    int fd;
+    Connection* connection;
+    unsigned long lastActivity;
+    unsigned long lastPing;
+    long acknowledged;
+    unsigned long pingBytes;
+} IdleTimer;
+
+/* Struct containing a hierarchical timer wheel of idle timers. Each level 
+ * has WHEEL_SLOTS slots, each spanning WHEEL_SLOTS times as many ticks as a
+ * slot of the level below. Durations are in ticks of TICK_MILLISECONDS, and
+ * are 0 when disabled. */
+typedef struct TimerWheel {
+    IdleTimer* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    unsigned long now;
+    unsigned long keepalive;
+    unsigned long timeout;
+    sem_t lock;
+} TimerWheel;
+
+/* Struct containing a client's publish credit, if it has opted into flow 
+ * control, along with the topics and volume it has published since credit 
+ * was last granted and the connection ID of the deepest queue downstream 
+ * of them when last checked (serial 0 if none) */
+typedef struct Credit {
+    int enabled;
+    int outstanding;
+    char** topics;
+    int topicCount;
+    long bytes;
+    int messages;
+    int bottleneckSlot;
+    unsigned int bottleneckSerial;
+} Credit;
+
+/* Struct containing a token bucket limiting the rate of publishes by a 
+ * client name or to a topic, kept as the theoretical arrival time of the 
+ * next publish so that it can be checked and updated with a single atomic
+ * compare-and-swap. A publish conforms if it arrives no more than the 
+ * burst's worth of intervals before that time. Copies of the limit for any
+ * client are owned by the client they were made for. */
+typedef struct RateLimit {
+    unsigned long interval;
+    unsigned long tolerance;
+    int action;
+    int owned;
+    unsigned long arrival;
+} RateLimit;
 
 /* Struct containing the characteristics of a client */
 typedef struct Client {
     char* name;
     FILE* toClient;
     FILE* fromClient;
+    Connection* connection;
     char** subbedTopics;
     int subCount;
+    Credit credit;
+    IdleTimer* idle;
+    RateLimit* limit;
 } Client;
 
-/* Struct representing a node in a singly linked list of clients */
-typedef struct ClientNode {
+/* Struct representing one subscription in an array of subscribers: a handle
+ * to the subscribed client's connection and the subscription's priority */
+typedef struct Subscriber {
+    Connection* connection;
+    int priority;
+} Subscriber;
+
+/* Struct containing the subscribers of a topic or consumer group, stored
+ * contiguously so that fan-out is a linear scan. Alongside the array is an
+ * open addressing hash table, twice the array's capacity, of the index of 
+ * each connection's subscription (or -1 for an empty slot), so that a 
+ * subscription can be found without scanning */
+typedef struct SubscriberArray {
+    Subscriber* subscribers;
+    int* slots;
+    int count;
+    int capacity;
+} SubscriberArray;
+
+/* Struct representing a consumer group in a singly linked list of the groups
+ * subscribed to a topic. Each message published to the topic is delivered to
+ * exactly one member of each group */
+typedef struct ConsumerGroup {
+    char* name;
+    SubscriberArray members;
+    int nextMember;
+    struct ConsumerGroup* next;
+} ConsumerGroup;
+
+/* Struct representing a client whose thread has stopped so that its 
+ * connection can be handed over to a new server, in a singly linked list. 
+ * The thread waits on resume in case the handover fails */
+typedef struct ParkedClient {
     Client client;
-    struct ClientNode* next;
-} ClientNode;
+    LineReader reader;
+    sem_t resume;
+    struct ParkedClient* next;
+} ParkedClient;
+
+/* Struct containing a growable buffer of serialised state sent between 
+ * servers during a hot restart */
+typedef struct Snapshot {
+    char* data;
+    int length;
+    int size;
+    int position;
+} Snapshot;
+
+/* Struct representing a contiguous run of subscribers that a fan-out worker
+ * is to deliver a message to */
+typedef struct FanoutJob {
+    Subscriber* start;
+    int count;
+    Message* message;
+    int topicPriority;
+    sem_t* done;
+    struct FanoutJob* next;
+} FanoutJob;
+
+/* Struct containing the queue of pending fan-out jobs shared between the 
+ * fan-out workers */
+typedef struct FanoutPool {
+    FanoutJob* head;
+    FanoutJob* tail;
+    sem_t queueLock;
+    sem_t jobsAvailable;
+    int workerCount;
+} FanoutPool;
+
+/* Struct containing the table of open connections through which replies are
+ * routed to requesters, indexed by the slot half of a connection ID. The 
+ * other half is a serial number that is not reused, so that a reply to a 
+ * connection that has since closed cannot reach a later connection given
+ * the same slot */
+typedef struct ConnectionTable {
+    Connection** connections;
+    int* freeSlots;
+    int freeCount;
+    int used;
+    int capacity;
+    unsigned int nextSerial;
+} ConnectionTable;
+
+/* Struct containing the cores that server threads are pinned to. Client 
+ * threads are pinned to the core that received their socket's traffic if it
+ * is one of these, otherwise to each in turn */
+typedef struct CpuPlacement {
+    int* cpus;
+    int count;
+    cpu_set_t allowed;
+    int nextCpu;
+} CpuPlacement;
 
 /* Struct containing data that is shared between each thread */
 typedef struct SharedClientInfo {
     StringMap* sm;
-    int fd;
+    StringMap* groups;
+    StringMap* priorities;
+    StringMap* clientLimits;
+    StringMap* topicLimits;
+    StringMap* prioClients;
+    FanoutPool* pool;
+    TimerWheel* wheel;
+    ConnectionTable* table;
+    CpuPlacement* placement;
+    int fdServer;
+    long connections;
     sem_t* mutexLock;
     sem_t* threadLock;
+    int slotDebt;
     sigset_t* set;
+    int wakeFd;
+    int wakeSignal;
+    int handoverFd;
+    sem_t* acceptParked;
+    sem_t* acceptResume;
+    ParkedClient* parked;
+    int parkedCount;
+    int handingOver;
+    int leavingCount;
     int currentConnections;
     int totalConnections;
     int totalPub;
     int totalSub;
     int totalUnsub;
+    int totalReaped;
+    int totalReq;
+    int totalRep;
+    int totalLimitRejects;
+    int totalLimitDelays;
+    int totalLimitDrops;
 } SharedClientInfo;
 
+/* Struct containing what a client handling thread needs to start serving a
+ * client - either a newly accepted socket or a client restored from a 
+ * previous server */
+typedef struct ClientStart {
+    SharedClientInfo* info;
+    int fd;
+    int restored;
+    Client client;
+    LineReader reader;
+    int bufferSize;
+} ClientStart;
+
 /* init_mutex_lock()
  * ----------------
  * Initialises the semaphore responsible for mutual exclusion. 
@@ -107,6 +473,177 @@ void release_lock(sem_t* l) {
     sem_post(l);
 }
 
+/* Every how many received lines a message is traced (0 when disabled) */
+static int traceSample = 0;
+
+/* Linked list of every thread's trace buffer */
+static TraceBuffer* traceBuffers = NULL;
+
+/* The thread ID given to the last trace buffer claimed */
+static int traceThreadCount = 0;
+
+/* Key whose destructor releases a thread's trace buffer when it exits */
+static pthread_key_t traceKey;
+
+/* The calling thread's trace buffer, and the sampled message it is handling */
+static __thread TraceBuffer* threadTrace = NULL;
+static __thread unsigned long currentTrace = 0;
+
+/* Bytes a connection's lanes may hold before published messages overflow 
+ * them (0 when unbounded), what is done when they do, and how often it has 
+ * been done */
+static int queueLimit = DEFAULT_QUEUE_LIMIT;
+static int queuePolicy = QUEUE_DROP;
+static int queueDrops = 0;
+static int queueDisconnects = 0;
+
+/* release_trace_buffer()
+ * ----------------------
+ * Marks a thread's trace buffer as free for reuse once the thread has exited.
+ * Its events are kept until then.
+ *
+ * arg: the trace buffer being released
+ */
+void release_trace_buffer(void* arg) {
+    TraceBuffer* buffer = (TraceBuffer*) arg;
+    __sync_lock_release(&buffer->inUse);
+}
+
+/* init_tracing()
+ * --------------
+ * Enables tracing if the PSSERVER_TRACE_SAMPLE environment variable is set
+ * to a positive number N, in which case every Nth line received by each 
+ * client thread is traced.
+ */
+void init_tracing(void) {
+    char* sample = getenv("PSSERVER_TRACE_SAMPLE");
+    if (sample != NULL) {
+	traceSample = atoi(sample) > 0 ? atoi(sample) : 0;
+    }
+    pthread_key_create(&traceKey, release_trace_buffer);
+}
+
+/* get_trace_buffer()
+ * ------------------
+ * Finds the calling thread's trace buffer, claiming a released buffer or 
+ * allocating a new one on first use.
+ *
+ * Returns: the calling thread's trace buffer
+ */
+TraceBuffer* get_trace_buffer(void) {
+    if (threadTrace != NULL) {
+	return threadTrace;
+    }
+
+    // Claim a buffer released by an exited thread
+    TraceBuffer* buffer;
+    for (buffer = traceBuffers; buffer != NULL; buffer = buffer->next) {
+	if (!__sync_lock_test_and_set(&buffer->inUse, 1)) {
+	    // Earlier events keep the exited thread's ID
+	    buffer->threadId = __sync_add_and_fetch(&traceThreadCount, 1);
+	    break;
+	}
+    }
+
+    // None free - add a new buffer to the head of the list
+    if (buffer == NULL) {
+	buffer = calloc(1, sizeof(struct TraceBuffer));
+	buffer->inUse = 1;
+	buffer->threadId = __sync_add_and_fetch(&traceThreadCount, 1);
+	do {
+	    buffer->next = traceBuffers;
+	} while (!__sync_bool_compare_and_swap(&traceBuffers, buffer->next, 
+		buffer));
+    }
+    pthread_setspecific(traceKey, buffer);
+    threadTrace = buffer;
+    return buffer;
+}
+
+/* trace_sample()
+ * --------------
+ * Decides whether the line just received by the calling thread is to be 
+ * traced, recording its receipt if so.
+ *
+ * Returns: the trace ID of the line, or 0 if it is not traced
+ */
+unsigned long trace_sample(void) {
+    static __thread int countdown = 0;
+    static unsigned long lastTraceId = 0;
+
+    if (traceSample == 0 || ++countdown < traceSample) {
+	return 0;
+    }
+    countdown = 0;
+    return __sync_add_and_fetch(&lastTraceId, 1);
+}
+
+/* trace_point()
+ * -------------
+ * Records that the given traced message has reached the given trace point,
+ * stamped with the monotonic clock. Does nothing for untraced messages.
+ *
+ * traceId: the trace ID of the message (0 if untraced)
+ * point: the trace point reached
+ */
+void trace_point(unsigned long traceId, int point) {
+    if (traceId == 0) {
+	return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    TraceBuffer* buffer = get_trace_buffer();
+    TraceEvent* event = &buffer->events[buffer->recorded % TRACE_BUFFER_SIZE];
+    event->traceId = traceId;
+    event->point = point;
+    event->threadId = buffer->threadId;
+    event->timestamp = now.tv_sec * NANOSECONDS_PER_SECOND + now.tv_nsec;
+
+    // Publish the event to the dumping thread
+    __sync_synchronize();
+    buffer->recorded++;
+}
+
+/* dump_trace()
+ * ------------
+ * Writes every thread's recorded trace events to the file named by the 
+ * PSSERVER_TRACE_FILE environment variable (or DEFAULT_TRACE_FILE) in Chrome
+ * trace JSON format. Events being overwritten while the dump runs may be 
+ * written inconsistently.
+ */
+void dump_trace(void) {
+    char* path = getenv("PSSERVER_TRACE_FILE");
+    FILE* out = fopen(path == NULL ? DEFAULT_TRACE_FILE : path, "w");
+    if (out == NULL) {
+	return;
+    }
+
+    char* names[] = {"receive", "parsed", "lookup", "enqueue", "buffered",
+	    "flush"};
+    int first = 1;
+    fprintf(out, "{\"traceEvents\":[");
+    for (TraceBuffer* buffer = traceBuffers; buffer != NULL; 
+	    buffer = buffer->next) {
+	unsigned long recorded = buffer->recorded;
+	__sync_synchronize();
+	unsigned long start = recorded > TRACE_BUFFER_SIZE ? 
+		recorded - TRACE_BUFFER_SIZE : 0;
+	for (unsigned long i = start; i < recorded; i++) {
+	    TraceEvent* event = &buffer->events[i % TRACE_BUFFER_SIZE];
+	    fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+		    "\"ts\":%.3f,\"pid\":%d,\"tid\":%d,"
+		    "\"args\":{\"message\":%lu}}", first ? "" : ",", 
+		    names[event->point], 
+		    event->timestamp / NANOSECONDS_PER_MICROSECOND, getpid(),
+		    event->threadId, event->traceId);
+	    first = 0;
+	}
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+}
+
 /* usage_error()
  * -------------
  * Prints the usage error message to standard error, flushes, and exits the 
@@ -129,432 +666,4550 @@ void socket_error() {
     exit(2);
 }
 
-/* print_invalid()
- * ---------------
- * Prints the invalid message to standard error and flushes.
+/* create_message()
+ * ----------------
+ * Wraps the given text in a reference counted message, holding one reference
+ * for the caller.
+ *
+ * text: the complete, newline terminated, dynamically allocated message text
+ * (ownership of which passes to the message)
+ *
+ * Returns: the new message
  */
-void print_invalid(Client client) {
-    fprintf(client.toClient, ":invalid\n");
-    fflush(client.toClient);
+Message* create_message(char* text) {
+    static unsigned long lastId = 0;
+    Message* message = malloc(sizeof(struct Message));
+    message->id = __sync_add_and_fetch(&lastId, 1);
+    message->traceId = currentTrace;
+    message->text = text;
+    message->length = strlen(text);
+    message->refs = 1;
+    init_mutex_lock(&message->cacheLock);
+    message->compressed = NULL;
+    message->compressedCount = 0;
+    return message;
 }
 
-/* check_spaces_colons_empty()
- * ---------------------------
- * Checks a given string for the presence of spaces and colons, and whether it
- * is empty.
+/* release_message()
+ * -----------------
+ * Releases one reference to the given message, freeing it if it was the last.
  *
- * str: the string to check
+ * message: the message to release
+ */
+void release_message(Message* message) {
+    if (__sync_sub_and_fetch(&message->refs, 1) == 0) {
+	sem_destroy(&message->cacheLock);
+	while (message->compressed != NULL) {
+	    CompressedBlock* block = message->compressed;
+	    message->compressed = block->next;
+	    free(block->data);
+	    free(block);
+	}
+	free(message->text);
+	free(message);
+    }
+}
+
+/* append_to_lane()
+ * ----------------
+ * Places the given message on the tail of the given connection's lane for the
+ * given priority. Must be called with the connection's queue lock held, and 
+ * the writer thread woken once it is released.
  *
- * Returns: 0 if the string contains spaces or colons or is empty, else 1
+ * connection: the connection to queue the message on
+ * message: the message to queue (a reference is taken on its behalf)
+ * priority: the lane to queue the message on
  */
-int check_spaces_colons_empty(char* str) {
-    if (strchr(str, ' ') != NULL ||
-	    strchr(str, ':') != NULL ||
-	    !strcmp(str, "")) {
+void append_to_lane(Connection* connection, Message* message, int priority) {
+    QueuedMessage* queued = malloc(sizeof(struct QueuedMessage));
+    queued->message = message;
+    queued->next = NULL;
+    __sync_add_and_fetch(&message->refs, 1);
+
+    if (connection->laneTail[priority] == NULL) {
+	connection->laneHead[priority] = queued;
+    } else {
+	connection->laneTail[priority]->next = queued;
+    }
+    connection->laneTail[priority] = queued;
+    connection->queuedMessages++;
+    connection->queuedBytes += message->length;
+}
+
+/* enqueue_message()
+ * -----------------
+ * Places the given message on the tail of the given connection's lane for the
+ * given priority and wakes the connection's writer thread.
+ *
+ * connection: the connection to queue the message on
+ * message: the message to queue (a reference is taken on its behalf)
+ * priority: the lane to queue the message on
+ */
+void enqueue_message(Connection* connection, Message* message, int priority) {
+    take_lock(&connection->queueLock);
+    append_to_lane(connection, message, priority);
+    release_lock(&connection->queueLock);
+    release_lock(&connection->pending);
+}
+
+/* init_queue_limit()
+ * ------------------
+ * Reads the per-connection queue limit in bytes from the PSSERVER_QUEUE_LIMIT
+ * environment variable (0 for no limit) and the overflow policy from 
+ * PSSERVER_QUEUE_POLICY, either "drop" (the default) or "disconnect".
+ */
+void init_queue_limit(void) {
+    char* limit = getenv("PSSERVER_QUEUE_LIMIT");
+    if (limit != NULL && atoi(limit) >= 0) {
+	queueLimit = atoi(limit);
+    }
+    char* policy = getenv("PSSERVER_QUEUE_POLICY");
+    if (policy != NULL && !strcmp(policy, "disconnect")) {
+	queuePolicy = QUEUE_DISCONNECT;
+    }
+}
+
+/* deliver_message()
+ * -----------------
+ * Queues the given published message on the given connection's lane for the
+ * given priority, unless that would take the connection's lanes past the 
+ * queue limit. In that case, under the drop policy the oldest messages on 
+ * lower priority lanes are discarded to make room, and the message itself is
+ * discarded if that is not enough. Under the disconnect policy the client is
+ * disconnected instead and nothing more is queued for it. Replies to the 
+ * client's own commands are queued with enqueue_message() and are never 
+ * discarded.
+ *
+ * connection: the connection to queue the message on
+ * message: the message to queue (a reference is taken on its behalf)
+ * priority: the lane to queue the message on
+ */
+void deliver_message(Connection* connection, Message* message, int priority) {
+    QueuedMessage* evicted = NULL;
+    int queue = 1;
+
+    take_lock(&connection->queueLock);
+    if (connection->overflowed) {
+	queue = 0;
+    } else if (queueLimit > 0 && 
+	    connection->queuedBytes + message->length > queueLimit) {
+	if (queuePolicy == QUEUE_DISCONNECT) {
+	    // Reader sees the shutdown and disconnects the client as usual
+	    connection->overflowed = 1;
+	    shutdown(fileno(connection->toClient), SHUT_RDWR);
+	    __sync_add_and_fetch(&queueDisconnects, 1);
+	    queue = 0;
+	}
+
+	// Make room from the lowest lane up
+	for (int lane = NUM_PRIORITIES - 1; queue && lane > priority && 
+		connection->queuedBytes + message->length > queueLimit; ) {
+	    QueuedMessage* oldest = connection->laneHead[lane];
+	    if (oldest == NULL) {
+		lane--;
+		continue;
+	    }
+	    connection->laneHead[lane] = oldest->next;
+	    if (oldest->next == NULL) {
+		connection->laneTail[lane] = NULL;
+	    }
+	    connection->queuedMessages--;
+	    connection->queuedBytes -= oldest->message->length;
+	    oldest->next = evicted;
+	    evicted = oldest;
+	    __sync_add_and_fetch(&queueDrops, 1);
+	}
+	if (queue && connection->queuedBytes + message->length > queueLimit) {
+	    __sync_add_and_fetch(&queueDrops, 1);
+	    queue = 0;
+	}
+    }
+    if (queue) {
+	append_to_lane(connection, message, priority);
+    }
+    release_lock(&connection->queueLock);
+
+    while (evicted != NULL) {
+	QueuedMessage* next = evicted->next;
+	release_message(evicted->message);
+	free(evicted);
+	evicted = next;
+    }
+    if (queue) {
+	release_lock(&connection->pending);
+    }
+}
+
+/* enqueue_text()
+ * --------------
+ * Queues a copy of the given text on the given connection's lane for the 
+ * given priority.
+ *
+ * connection: the connection to queue the text on
+ * text: the complete, newline terminated text to queue
+ * priority: the lane to queue the text on
+ */
+void enqueue_text(Connection* connection, char* text, int priority) {
+    Message* message = create_message(strdup(text));
+    enqueue_message(connection, message, priority);
+    release_message(message);
+}
+
+/* next_lane()
+ * -----------
+ * Chooses the lane the given connection's next message is to be taken from.
+ * The highest priority non-empty lane is chosen, unless higher lanes have 
+ * been chosen STARVATION_LIMIT times in a row while a lower lane was waiting,
+ * in which case the lowest priority non-empty lane is given a turn. Must be
+ * called with the connection's queue lock held and at least one message 
+ * queued.
+ *
+ * connection: the connection to choose a lane of
+ *
+ * Returns: the chosen lane
+ */
+int next_lane(Connection* connection) {
+    int highest = 0;
+    while (connection->laneHead[highest] == NULL) {
+	highest++;
+    }
+    int lowest = NUM_PRIORITIES - 1;
+    while (connection->laneHead[lowest] == NULL) {
+	lowest--;
+    }
+
+    // No lower lane waiting
+    if (highest == lowest) {
+	connection->starvedCount = 0;
+	return highest;
+    }
+
+    // Lower lane has waited long enough
+    if (connection->starvedCount >= STARVATION_LIMIT) {
+	connection->starvedCount = 0;
+	return lowest;
+    }
+    connection->starvedCount++;
+    return highest;
+}
+
+/* compress_message()
+ * ------------------
+ * Compresses the given message as a raw DEFLATE block, using the message 
+ * last sent on the given connection as a preset dictionary. Reuses the 
+ * message's cached block if it was compressed against the same dictionary, 
+ * otherwise compresses with the connection's deflater and caches the result
+ * unless COMPRESS_CACHE_LIMIT dictionaries are cached already.
+ *
+ * connection: the connection the message is to be sent on
+ * message: the message to compress
+ * block: set to the compressed block
+ * blockLength: set to the length of the compressed block
+ *
+ * Returns: 0 if compression did not shrink the message, 1 if the block is 
+ * owned by the message's cache, or 2 if the block must be freed by the caller
+ */
+int compress_message(Connection* connection, Message* message, char** block,
+	int* blockLength) {
+    Message* dictionary = connection->lastSent;
+    unsigned long dictionaryId = dictionary == NULL ? 0 : dictionary->id;
+
+    // Already compressed against this dictionary
+    take_lock(&message->cacheLock);
+    for (CompressedBlock* cached = message->compressed; cached != NULL; 
+	    cached = cached->next) {
+	if (cached->dictionary == dictionaryId) {
+	    *block = cached->data;
+	    *blockLength = cached->length;
+	    release_lock(&message->cacheLock);
+	    return 1;
+	}
+    }
+    release_lock(&message->cacheLock);
+
+    // Reuse the connection's deflater between messages
+    z_stream* deflater = &connection->deflater;
+    if (!connection->deflaterReady) {
+	memset(deflater, 0, sizeof(z_stream));
+	deflateInit2(deflater, COMPRESS_LEVEL, Z_DEFLATED, -MAX_WBITS, 
+		MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+	connection->deflaterReady = 1;
+    } else {
+	deflateReset(deflater);
+    }
+    if (dictionary != NULL) {
+	deflateSetDictionary(deflater, (Bytef*) dictionary->text, 
+		dictionary->length);
+    }
+
+    int bound = deflateBound(deflater, message->length);
+    char* compressed = malloc(bound);
+    deflater->next_in = (Bytef*) message->text;
+    deflater->avail_in = message->length;
+    deflater->next_out = (Bytef*) compressed;
+    deflater->avail_out = bound;
+    if (deflate(deflater, Z_FINISH) != Z_STREAM_END || 
+	    (int) deflater->total_out >= message->length) {
+	free(compressed);
 	return 0;
     }
-    return 1;
+    *block = compressed;
+    *blockLength = deflater->total_out;
+
+    // Cache for other connections sharing the same dictionary - another 
+    // writer may have cached it meanwhile, which is harmless
+    take_lock(&message->cacheLock);
+    if (message->compressedCount < COMPRESS_CACHE_LIMIT) {
+	CompressedBlock* cached = malloc(sizeof(struct CompressedBlock));
+	cached->dictionary = dictionaryId;
+	cached->data = compressed;
+	cached->length = *blockLength;
+	cached->next = message->compressed;
+	message->compressed = cached;
+	message->compressedCount++;
+	release_lock(&message->cacheLock);
+	return 1;
+    }
+    release_lock(&message->cacheLock);
+    return 2;
 }
 
-/* handle_name()
- * -------------
- * Ensures the given name argument is valid and, if the given client does not
- * yet have a name, sets it, otherwise ignores the command.
+/* write_message()
+ * ---------------
+ * Writes the given message to the client of the given connection. If the
+ * connection has negotiated compression and the message is at least 
+ * COMPRESS_THRESHOLD bytes, it is written as a ":z <compressed> <raw>" header
+ * line followed by the compressed block. The message then becomes the 
+ * dictionary for the next message written on the connection.
  *
- * client: the client whose name is to be set
- * name: the name to check and set
- */ 
-void handle_name(Client* client, char* name) {
-    // Invalid name
-    if (!check_spaces_colons_empty(name)) {
-	print_invalid(*client);
+ * connection: the connection to write to
+ * message: the message to write
+ * compression: the compression negotiated for the connection
+ *
+ * Returns: the number of bytes written
+ */
+int write_message(Connection* connection, Message* message, 
+	int compression) {
+    char* block;
+    int blockLength;
+    int compressed = COMPRESSION_NONE;
+    if (compression == COMPRESSION_DEFLATE && 
+	    message->length >= COMPRESS_THRESHOLD) {
+	compressed = compress_message(connection, message, &block, 
+		&blockLength);
+    }
 
-    // Name does not yet exist - set name
-    } else if (client->name == NULL) {
-	client->name = name;
+    int written;
+    if (compressed) {
+	written = fprintf(connection->toClient, ":z %d %d\n", blockLength, 
+		message->length);
+	written += fwrite(block, 1, blockLength, connection->toClient);
+	if (compressed == 2) {
+	    free(block);
+	}
+    } else {
+	written = fwrite(message->text, 1, message->length, 
+		connection->toClient);
     }
+
+    // Both ends use the last message as the next dictionary
+    __sync_add_and_fetch(&message->refs, 1);
+    if (connection->lastSent != NULL) {
+	release_message(connection->lastSent);
+    }
+    connection->lastSent = message;
+    return written > 0 ? written : 0;
 }
 
-/* add_subscribed_topic()
+/* sample_unsent_bytes()
  * ----------------------
- * Adds the given topic to the given client's array of subscribed topics. 
- * Dynamically allocates more memory to the array if it is full.
+ * Records how many bytes written to the given connection's socket are yet
+ * to be sent, for queued_bytes().
  *
- * client: the client whose array is to be modified
- * bufferSize: the current size of the client's array
- * topic: the topic to be added to the array
+ * connection: the connection to sample
  */
-void add_subscribed_topic(Client* client, int* bufferSize, char* topic) {
-    // Ensure array has sufficient space
-    if (client->subCount == *bufferSize) {
-	*bufferSize += *bufferSize;
-	client->subbedTopics = realloc(client->subbedTopics, 
-		sizeof(char*) * *bufferSize);
+void sample_unsent_bytes(Connection* connection) {
+    int unsent = 0;
+    ioctl(fileno(connection->toClient), TIOCOUTQ, &unsent);
+    __atomic_store_n(&connection->unsentBytes, unsent, __ATOMIC_RELAXED);
+}
+
+/* flush_connection()
+ * ------------------
+ * Flushes the given connection's stream to its socket and records the 
+ * flush trace point for each traced message written since the last flush.
+ * Messages that filled the stream's buffer may have reached the socket 
+ * earlier than recorded.
+ *
+ * connection: the connection to flush
+ * unflushed: the trace IDs of the traced messages written since the last 
+ * flush
+ * count: the number of trace IDs, reset to 0
+ */
+void flush_connection(Connection* connection, unsigned long* unflushed, 
+	int* count) {
+    fflush(connection->toClient);
+    for (int i = 0; i < *count; i++) {
+	trace_point(unflushed[i], TRACE_FLUSH);
     }
+    *count = 0;
+}
 
-    // Add to array
-    client->subbedTopics[client->subCount] = topic;
-    client->subCount++;
+/* writer_thread()
+ * ---------------
+ * Thread handling function responsible for writing to an individual client.
+ * Repeatedly takes the next message from the connection's lanes and writes it
+ * to the client, flushing whenever the lanes have been emptied. Returns once
+ * the connection is closed and every queued message has been written, or 
+ * once the message being written is finished if the writer is stopped.
+ *
+ * arg: the argument passed when creating the thread, in this case the 
+ * connection to write to
+ *
+ * Returns: will always return NULL
+ */
+void* writer_thread(void* arg) {
+    Connection* connection = (Connection*) arg;
+    unsigned long* unflushed = NULL;
+    int unflushedCount = 0;
+    int unflushedSize = 0;
+    int unflushedBytes = 0;
+
+    while (1) {
+	take_lock(&connection->pending);
+	take_lock(&connection->queueLock);
+
+	// Stopped for a handover - leave the rest queued
+	if (connection->stopping) {
+	    release_lock(&connection->queueLock);
+	    flush_connection(connection, unflushed, &unflushedCount);
+	    break;
+	}
+
+	// Woken without a message - either the connection is closing or the 
+	// message was discarded by deliver_message()
+	if (connection->queuedMessages == 0) {
+	    int closing = connection->closing;
+	    release_lock(&connection->queueLock);
+	    if (closing) {
+		break;
+	    }
+	    continue;
+	}
+
+	// Remove message from head of lane
+	int lane = next_lane(connection);
+	QueuedMessage* queued = connection->laneHead[lane];
+	connection->laneHead[lane] = queued->next;
+	if (connection->laneHead[lane] == NULL) {
+	    connection->laneTail[lane] = NULL;
+	}
+	connection->queuedMessages--;
+	connection->queuedBytes -= queued->message->length;
+	int drained = connection->queuedMessages == 0;
+	int compression = connection->compression;
+
+	// Messages after a ":compress" confirmation use the confirmed codec
+	if (queued->message == connection->switchMessage) {
+	    connection->compression = connection->switchCompression;
+	    connection->switchMessage = NULL;
+	}
+	release_lock(&connection->queueLock);
+
+	unflushedBytes += write_message(connection, queued->message, 
+		compression);
+	trace_point(queued->message->traceId, TRACE_BUFFERED);
+	if (queued->message->traceId != 0) {
+	    if (unflushedCount == unflushedSize) {
+		unflushedSize = unflushedSize == 0 ? 1 : unflushedSize * 2;
+		unflushed = realloc(unflushed, 
+			sizeof(unsigned long) * unflushedSize);
+	    }
+	    unflushed[unflushedCount++] = queued->message->traceId;
+	}
+	if (drained) {
+	    flush_connection(connection, unflushed, &unflushedCount);
+	    __atomic_add_fetch(&connection->flushedBytes, unflushedBytes, 
+		    __ATOMIC_RELAXED);
+	    unflushedBytes = 0;
+
+	    // Sampled here, outside the mutex lock, for queued_bytes()
+	    sample_unsent_bytes(connection);
+	}
+	release_message(queued->message);
+	free(queued);
+    }
+    free(unflushed);
+    return NULL;
+}
+
+/* start_client_thread()
+ * ---------------------
+ * Starts a detachable thread serving one client, with a CLIENT_STACK_SIZE 
+ * stack rather than the default (typically 8 MiB) - every client has two
+ * threads, so with tens of thousands of clients the default stacks alone 
+ * would reserve hundreds of gigabytes of address space.
+ *
+ * thread: set to the thread's ID
+ * function: the thread handling function
+ * arg: the argument passed to the function
+ */
+void start_client_thread(pthread_t* thread, void* (*function)(void*), 
+	void* arg) {
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setstacksize(&attributes, CLIENT_STACK_SIZE);
+    pthread_create(thread, &attributes, function, arg);
+    pthread_attr_destroy(&attributes);
+}
+
+/* open_connection()
+ * -----------------
+ * Creates the outbound side of a client's connection and starts its writer
+ * thread.
+ *
+ * to: the file pointer used to write to the client
+ *
+ * Returns: the new connection
+ */
+Connection* open_connection(FILE* to) {
+    Connection* connection = malloc(sizeof(struct Connection));
+    connection->toClient = to;
+    for (int i = 0; i < NUM_PRIORITIES; i++) {
+	connection->laneHead[i] = NULL;
+	connection->laneTail[i] = NULL;
+    }
+    connection->queuedMessages = 0;
+    connection->queuedBytes = 0;
+    connection->overflowed = 0;
+    connection->closing = 0;
+    connection->stopping = 0;
+    connection->starvedCount = 0;
+    connection->compression = COMPRESSION_NONE;
+    connection->switchMessage = NULL;
+    connection->deflaterReady = 0;
+    connection->lastSent = NULL;
+    connection->unsentBytes = 0;
+    init_mutex_lock(&connection->queueLock);
+    sem_init(&connection->pending, 0, 0);
+    start_client_thread(&connection->writer, writer_thread, connection);
+    return connection;
+}
+
+/* drain_connection()
+ * ------------------
+ * Waits for the writer thread of the given connection to write every queued
+ * message and finish. No messages may be queued on the connection once this
+ * has been called.
+ *
+ * connection: the connection to drain
+ */
+void drain_connection(Connection* connection) {
+    // Wake the writer without a message to tell it to finish
+    take_lock(&connection->queueLock);
+    connection->closing = 1;
+    release_lock(&connection->queueLock);
+    release_lock(&connection->pending);
+    pthread_join(connection->writer, NULL);
+}
+
+/* stop_writer()
+ * -------------
+ * Tells the writer thread of the given connection to stop once it has 
+ * finished the message it is writing, leaving the rest queued. The thread
+ * is waited for with wait_for_writer().
+ *
+ * connection: the connection whose writer is to stop
+ */
+void stop_writer(Connection* connection) {
+    take_lock(&connection->queueLock);
+    connection->stopping = 1;
+    release_lock(&connection->queueLock);
+    release_lock(&connection->pending);
+}
+
+/* wait_for_writer()
+ * -----------------
+ * Waits until the given time for the stopped writer thread of the given
+ * connection to finish. A writer still blocked on a client that is not 
+ * reading by then has its connection shut down, so that it gives up and 
+ * the client is disconnected.
+ *
+ * connection: the connection whose writer has been stopped
+ * deadline: the CLOCK_REALTIME time to wait until
+ */
+void wait_for_writer(Connection* connection, struct timespec* deadline) {
+    if (pthread_timedjoin_np(connection->writer, NULL, deadline) != 0) {
+	shutdown(fileno(connection->toClient), SHUT_RDWR);
+	pthread_join(connection->writer, NULL);
+    }
+}
+
+/* restart_writer()
+ * ----------------
+ * Starts a new writer thread for the given connection after its previous 
+ * one has finished or stopped, to carry on writing to the client. Must only
+ * be called while nothing else can queue messages on the connection.
+ *
+ * connection: the connection to write to
+ */
+void restart_writer(Connection* connection) {
+    take_lock(&connection->queueLock);
+    connection->closing = 0;
+    connection->stopping = 0;
+
+    // One wake per message still queued
+    while (sem_trywait(&connection->pending) == 0) {
+    }
+    for (int i = 0; i < connection->queuedMessages; i++) {
+	release_lock(&connection->pending);
+    }
+    release_lock(&connection->queueLock);
+    start_client_thread(&connection->writer, writer_thread, connection);
+}
+
+/* close_connection()
+ * ------------------
+ * Drains the given connection, then frees it.
+ *
+ * connection: the connection to close
+ */
+void close_connection(Connection* connection) {
+    drain_connection(connection);
+
+    if (connection->deflaterReady) {
+	deflateEnd(&connection->deflater);
+    }
+    if (connection->lastSent != NULL) {
+	release_message(connection->lastSent);
+    }
+
+    sem_destroy(&connection->queueLock);
+    sem_destroy(&connection->pending);
+    free(connection);
+}
+
+/* init_connection_table()
+ * -------------------------
+ * Initialises an empty table of open connections.
+ *
+ * table: the table to initialise
+ */
+void init_connection_table(ConnectionTable* table) {
+    table->capacity = INITIAL_CONNECTION_SLOTS;
+    table->connections = malloc(sizeof(Connection*) * table->capacity);
+    table->freeSlots = malloc(sizeof(int) * table->capacity);
+    table->freeCount = 0;
+    table->used = 0;
+    table->nextSerial = 1;
+}
+
+/* grow_connection_table()
+ * -----------------------
+ * Doubles the capacity of the given connection table until it has room for
+ * the given slot, marking every slot up to and including it as in use.
+ * Slots passed over are added to the free list.
+ *
+ * table: the table to grow
+ * slot: the slot that must exist
+ */
+void grow_connection_table(ConnectionTable* table, int slot) {
+    if (slot >= table->capacity) {
+	while (slot >= table->capacity) {
+	    table->capacity *= 2;
+	}
+	table->connections = realloc(table->connections, 
+		sizeof(Connection*) * table->capacity);
+	table->freeSlots = realloc(table->freeSlots, 
+		sizeof(int) * table->capacity);
+    }
+    while (table->used < slot) {
+	table->connections[table->used] = NULL;
+	table->freeSlots[table->freeCount++] = table->used++;
+    }
+    if (table->used == slot) {
+	table->connections[table->used++] = NULL;
+    }
+}
+
+/* register_connection()
+ * ---------------------
+ * Adds the given connection to the given table, giving it a connection ID
+ * made up of the most recently freed slot (or a new one) and the next 
+ * serial number. Must be called with the mutex lock held.
+ *
+ * table: the table of open connections
+ * connection: the connection to add
+ */
+void register_connection(ConnectionTable* table, Connection* connection) {
+    int slot;
+    if (table->freeCount > 0) {
+	slot = table->freeSlots[--table->freeCount];
+    } else {
+	slot = table->used;
+	grow_connection_table(table, slot);
+    }
+    connection->slot = slot;
+    connection->serial = table->nextSerial++;
+    table->connections[slot] = connection;
+}
+
+/* restore_connection()
+ * --------------------
+ * Adds the given connection to the given table under the connection ID it
+ * had in a previous server, so that replies to requests it made before a
+ * hot restart still reach it. Must be called with the mutex lock held, 
+ * before any connection is registered.
+ *
+ * table: the table of open connections
+ * connection: the connection to add
+ * slot: the slot of the connection's previous ID
+ * serial: the serial number of the connection's previous ID
+ */
+void restore_connection(ConnectionTable* table, Connection* connection, 
+	int slot, unsigned int serial) {
+    grow_connection_table(table, slot);
+
+    // Slot may have been passed over by a connection restored earlier
+    for (int i = 0; i < table->freeCount; i++) {
+	if (table->freeSlots[i] == slot) {
+	    table->freeSlots[i] = table->freeSlots[--table->freeCount];
+	    break;
+	}
+    }
+    connection->slot = slot;
+    connection->serial = serial;
+    table->connections[slot] = connection;
+    if (serial >= table->nextSerial) {
+	table->nextSerial = serial + 1;
+    }
+}
+
+/* unregister_connection()
+ * -----------------------
+ * Removes the given connection from the given table, freeing its slot for
+ * reuse. Must be called with the mutex lock held.
+ *
+ * table: the table of open connections
+ * connection: the connection to remove
+ */
+void unregister_connection(ConnectionTable* table, Connection* connection) {
+    table->connections[connection->slot] = NULL;
+    table->freeSlots[table->freeCount++] = connection->slot;
+}
+
+/* lookup_connection()
+ * -------------------
+ * Finds the open connection with the given connection ID. Must be called 
+ * with the mutex lock held.
+ *
+ * table: the table of open connections
+ * slot: the slot of the connection ID
+ * serial: the serial number of the connection ID
+ *
+ * Returns: the connection, or NULL if it has closed
+ */
+Connection* lookup_connection(ConnectionTable* table, unsigned long slot, 
+	unsigned long serial) {
+    if (slot >= (unsigned long) table->used) {
+	return NULL;
+    }
+    Connection* connection = table->connections[slot];
+    if (connection == NULL || connection->serial != serial) {
+	return NULL;
+    }
+    return connection;
+}
+
+/* print_invalid()
+ * ---------------
+ * Queues the invalid message for the given client on the high priority lane,
+ * so that it is not held up behind bulk data.
+ */
+void print_invalid(Client client) {
+    enqueue_text(client.connection, ":invalid\n", PRIORITY_HIGH);
+}
+
+/* check_spaces_colons_empty()
+ * ---------------------------
+ * Checks a given string for the presence of spaces and colons, and whether it
+ * is empty.
+ *
+ * str: the string to check
+ *
+ * Returns: 0 if the string contains spaces or colons or is empty, else 1
+ */
+int check_spaces_colons_empty(char* str) {
+    // Single pass for both separators
+    if (str[0] == '\0' || str[strcspn(str, " :")] != '\0') {
+	return 0;
+    }
+    return 1;
+}
+
+/* parse_rate_limit()
+ * ------------------
+ * Parses a rate limit given as "<rate>/<burst>/<action>": the number of 
+ * publishes allowed per second, the number that may arrive at once, and 
+ * whether publishes over the limit are rejected ("reject"), held up by not
+ * reading from the publisher until they conform ("delay"), or silently 
+ * discarded ("drop").
+ *
+ * spec: the rate limit to parse
+ *
+ * Returns: the rate limit in newly allocated memory, or NULL if invalid
+ */
+RateLimit* parse_rate_limit(char* spec) {
+    char* actions[] = {"reject", "delay", "drop"};
+    double rate;
+    int burst;
+    int consumed = 0;
+    if (sscanf(spec, "%lf/%d/%n", &rate, &burst, &consumed) != TWO_TOKENS || 
+	    consumed == 0 || rate <= 0 || burst < 1) {
+	return NULL;
+    }
+    for (int action = LIMIT_REJECT; action <= LIMIT_DROP; action++) {
+	if (!strcmp(spec + consumed, actions[action])) {
+	    RateLimit* limit = calloc(1, sizeof(struct RateLimit));
+	    limit->interval = NANOSECONDS_PER_SECOND / rate;
+	    limit->interval = limit->interval > 0 ? limit->interval : 1;
+	    limit->tolerance = limit->interval * (burst - 1);
+	    limit->action = action;
+	    return limit;
+	}
+    }
+    return NULL;
+}
+
+/* init_rate_limits()
+ * ------------------
+ * Reads the rate limits given by the PSSERVER_RATE_LIMITS environment 
+ * variable, a space separated list of "client:<name>=<limit>" and 
+ * "topic:<topic>=<limit>" entries, each limit as described in 
+ * parse_rate_limit(). A client name of "*" gives every client without a 
+ * limit of its own a separate bucket with that limit. Invalid entries are
+ * reported and ignored. The limits are not changed once read, so they are 
+ * looked up without the mutex lock.
+ *
+ * info: struct containing the shared client info, whose StringMaps of 
+ * client and topic rate limits are filled in
+ */
+void init_rate_limits(SharedClientInfo* info) {
+    char* value = getenv("PSSERVER_RATE_LIMITS");
+    if (value == NULL) {
+	return;
+    }
+    char* entries = strdup(value);
+    char* saved;
+    for (char* entry = strtok_r(entries, " ", &saved); entry != NULL; 
+	    entry = strtok_r(NULL, " ", &saved)) {
+	// Topics may contain '=', so the limit follows the last one
+	char* kind = entry;
+	char* key = strchr(entry, ':');
+	char* spec = strrchr(entry, '=');
+	RateLimit* limit = NULL;
+	StringMap* limits = NULL;
+	if (key != NULL && spec != NULL && spec > key + 1) {
+	    *key++ = '\0';
+	    *spec++ = '\0';
+	    limits = !strcmp(kind, "client") ? info->clientLimits : 
+		    !strcmp(kind, "topic") ? info->topicLimits : NULL;
+	    limit = parse_rate_limit(spec);
+	}
+	if (limits == NULL || limit == NULL || 
+		!stringmap_add(limits, key, limit)) {
+	    char* original = value + (entry - entries);
+	    fprintf(stderr, "psserver: ignoring rate limit \"%.*s\"\n", 
+		    (int) strcspn(original, " "), original);
+	    free(limit);
+	}
+    }
+    fflush(stderr);
+    free(entries);
+}
+
+/* assign_rate_limit()
+ * -------------------
+ * Gives the given client the rate limit for its name, or its own copy of 
+ * the limit for any client, if either has been configured.
+ *
+ * client: the client that has just been named
+ * info: struct containing the shared client info (used to access the 
+ * StringMap of client rate limits)
+ */
+void assign_rate_limit(Client* client, SharedClientInfo* info) {
+    client->limit = stringmap_search(info->clientLimits, client->name);
+    if (client->limit == NULL) {
+	RateLimit* any = stringmap_search(info->clientLimits, ANY_CLIENT);
+	if (any != NULL) {
+	    client->limit = malloc(sizeof(struct RateLimit));
+	    *client->limit = *any;
+	    client->limit->owned = 1;
+	}
+    }
+}
+
+/* time_until_token()
+ * ------------------
+ * Works out how long a publish arriving at the given time must wait for a 
+ * token, given the arrival time the bucket would next grant one at.
+ *
+ * limit: the rate limit to check
+ * arrival: the bucket's next arrival time
+ * now: the current time
+ *
+ * Returns: the number of nanoseconds until the publish conforms, or 0 if it
+ * conforms now
+ */
+unsigned long time_until_token(RateLimit* limit, unsigned long arrival, 
+	unsigned long now) {
+    unsigned long start = arrival > now ? arrival : now;
+    return start - now > limit->tolerance ? 
+	    start - now - limit->tolerance : 0;
+}
+
+/* now_nanoseconds()
+ * -----------------
+ * Returns: the current monotonic time in nanoseconds
+ */
+unsigned long now_nanoseconds(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * NANOSECONDS_PER_SECOND + time.tv_nsec;
+}
+
+/* peek_token()
+ * ------------
+ * Checks whether a publish arriving now would conform to the given bucket,
+ * without taking a token.
+ *
+ * limit: the rate limit to check (may be NULL if none applies)
+ *
+ * Returns: the number of nanoseconds until the publish conforms, or 0 if it
+ * conforms now
+ */
+unsigned long peek_token(RateLimit* limit) {
+    if (limit == NULL) {
+	return 0;
+    }
+    return time_until_token(limit, 
+	    __atomic_load_n(&limit->arrival, __ATOMIC_RELAXED), 
+	    now_nanoseconds());
+}
+
+/* take_token()
+ * ------------
+ * Takes a token from the given bucket for a publish arriving now, without 
+ * taking any lock. A publish that does not conform only takes a token if 
+ * it is to wait for it.
+ *
+ * limit: the rate limit to check
+ * wait: whether a publish that does not conform is to wait for its token
+ *
+ * Returns: the number of nanoseconds until the publish conforms, or 0 if it
+ * conforms now
+ */
+unsigned long take_token(RateLimit* limit, int wait) {
+    unsigned long now = now_nanoseconds();
+    unsigned long arrival = __atomic_load_n(&limit->arrival, 
+	    __ATOMIC_RELAXED);
+    while (1) {
+	unsigned long start = arrival > now ? arrival : now;
+	unsigned long early = time_until_token(limit, arrival, now);
+	if (early > 0 && !wait) {
+	    return early;
+	}
+	if (__atomic_compare_exchange_n(&limit->arrival, &arrival, 
+		start + limit->interval, 0, __ATOMIC_RELAXED, 
+		__ATOMIC_RELAXED)) {
+	    return early;
+	}
+    }
+}
+
+/* return_token()
+ * --------------
+ * Gives back a token taken from the given bucket by a publish that then did
+ * not go ahead.
+ *
+ * limit: the rate limit the token was taken from
+ */
+void return_token(RateLimit* limit) {
+    __atomic_fetch_sub(&limit->arrival, limit->interval, __ATOMIC_RELAXED);
+}
+
+/* take_tokens()
+ * -------------
+ * Takes a token from each of the given buckets for one publish, or from 
+ * none of them if a limit that rejects or drops does not let it through. 
+ * Both buckets are checked before either token is taken, and a token is 
+ * given back if another publish takes the last token of the other bucket 
+ * in between. Limits that delay always take their token.
+ *
+ * limits: the rate limits to apply (each may be NULL if none applies)
+ * count: the number of rate limits
+ * delay: set to the number of nanoseconds the publish must wait
+ *
+ * Returns: the action of the limit that refused the publish, else 
+ * LIMIT_DELAY
+ */
+int take_tokens(RateLimit** limits, int count, unsigned long* delay) {
+    *delay = 0;
+
+    // A limit that would refuse now refuses without taking any token
+    for (int i = 0; i < count; i++) {
+	if (limits[i] != NULL && limits[i]->action != LIMIT_DELAY && 
+		peek_token(limits[i]) > 0) {
+	    return limits[i]->action;
+	}
+    }
+
+    // Take from limits that can refuse first, giving back on a race
+    for (int i = 0; i < count; i++) {
+	if (limits[i] == NULL || limits[i]->action == LIMIT_DELAY || 
+		take_token(limits[i], 0) == 0) {
+	    continue;
+	}
+	for (int j = 0; j < i; j++) {
+	    if (limits[j] != NULL && limits[j]->action != LIMIT_DELAY) {
+		return_token(limits[j]);
+	    }
+	}
+	return limits[i]->action;
+    }
+
+    // Then wait for the latest of the limits that delay
+    for (int i = 0; i < count; i++) {
+	if (limits[i] != NULL && limits[i]->action == LIMIT_DELAY) {
+	    unsigned long early = take_token(limits[i], 1);
+	    *delay = early > *delay ? early : *delay;
+	}
+    }
+    return LIMIT_DELAY;
+}
+
+/* admit_publish()
+ * ---------------
+ * Checks a publish or request from the given client to the given topic 
+ * against the client's rate limit and the topic's, waiting for it to 
+ * conform if a limit delays, and counts the outcome. A rejected publish is
+ * answered with ":ratelimited <topic>".
+ *
+ * client: the publishing client
+ * topic: the topic published to
+ * info: struct containing the shared client info (used to access the 
+ * StringMap of topic rate limits and count outcomes)
+ *
+ * Returns: 1 if the publish is to go ahead, else 0
+ */
+int admit_publish(Client client, char* topic, SharedClientInfo* info) {
+    RateLimit* limits[] = {client.limit, 
+	    stringmap_search(info->topicLimits, topic)};
+    unsigned long early;
+    int outcome = take_tokens(limits, sizeof(limits) / sizeof(RateLimit*),
+	    &early);
+
+    if (outcome == LIMIT_REJECT) {
+	__sync_add_and_fetch(&info->totalLimitRejects, 1);
+	char* text = malloc(strlen(":ratelimited \n") + strlen(topic) + 1);
+	sprintf(text, ":ratelimited %s\n", topic);
+	Message* message = create_message(text);
+	enqueue_message(client.connection, message, PRIORITY_HIGH);
+	release_message(message);
+    } else if (outcome == LIMIT_DROP) {
+	__sync_add_and_fetch(&info->totalLimitDrops, 1);
+    } else if (early > 0) {
+	// Not reading from the publisher pushes back on it through TCP
+	__sync_add_and_fetch(&info->totalLimitDelays, 1);
+	struct timespec delay = {.tv_sec = early / NANOSECONDS_PER_SECOND,
+		.tv_nsec = early % NANOSECONDS_PER_SECOND};
+	while (nanosleep(&delay, &delay) < 0) {
+	    // Interrupted - sleep for the remainder
+	}
+    }
+    return outcome == LIMIT_DELAY;
+}
+
+/* handle_name()
+ * -------------
+ * Ensures the given name argument is valid and, if the given client does not
+ * yet have a name, sets it along with its rate limit, otherwise ignores the 
+ * command.
+ *
+ * client: the client whose name is to be set
+ * name: the name to check and set
+ * info: struct containing the shared client info (used to look up the 
+ * client's rate limit)
+ */ 
+void handle_name(Client* client, char* name, SharedClientInfo* info) {
+    // Invalid name
+    if (!check_spaces_colons_empty(name)) {
+	print_invalid(*client);
+
+    // Name does not yet exist - set name
+    } else if (client->name == NULL) {
+	client->name = name;
+	assign_rate_limit(client, info);
+    }
+}
+
+/* add_subscribed_topic()
+ * ----------------------
+ * Adds the given topic to the given client's array of subscribed topics. 
+ * Dynamically allocates more memory to the array if it is full.
+ *
+ * client: the client whose array is to be modified
+ * bufferSize: the current size of the client's array
+ * topic: the topic to be added to the array
+ */
+void add_subscribed_topic(Client* client, int* bufferSize, char* topic) {
+    // Ensure array has sufficient space
+    if (client->subCount == *bufferSize) {
+	*bufferSize += *bufferSize;
+	client->subbedTopics = realloc(client->subbedTopics, 
+		sizeof(char*) * *bufferSize);
+    }
+
+    // Add to array
+    client->subbedTopics[client->subCount] = topic;
+    client->subCount++;
+}
+
+/* parse_priority()
+ * ----------------
+ * Converts the given priority name to its lane.
+ *
+ * name: the priority name, one of "high", "normal" or "low"
+ *
+ * Returns: the lane, or PRIORITY_TOPIC if the name is not a priority
+ */
+int parse_priority(char* name) {
+    if (!strcmp(name, "high")) {
+	return PRIORITY_HIGH;
+    } else if (!strcmp(name, "normal")) {
+	return PRIORITY_NORMAL;
+    } else if (!strcmp(name, "low")) {
+	return PRIORITY_LOW;
+    }
+    return PRIORITY_TOPIC;
+}
+
+/* take_priority()
+ * ---------------
+ * Removes a trailing priority name from the given subscription argument, if
+ * the argument has one more space separated word than the given number. The
+ * given string is modified.
+ *
+ * arg: the subscription argument
+ * words: the number of words in the argument without a priority
+ *
+ * Returns: the lane of the removed priority, or PRIORITY_TOPIC if there was
+ * none (in which case the topic's priority applies)
+ */
+int take_priority(char* arg, int words) {
+    int spaces = 0;
+    char* lastSpace = NULL;
+    for (char* c = arg; *c != '\0'; c++) {
+	if (*c == ' ') {
+	    spaces++;
+	    lastSpace = c;
+	}
+    }
+
+    // No trailing word
+    if (spaces != words) {
+	return PRIORITY_TOPIC;
+    }
+
+    int priority = parse_priority(lastSpace + 1);
+    if (priority != PRIORITY_TOPIC) {
+	*lastSpace = '\0';
+    }
+    return priority;
+}
+
+/* topic_priority()
+ * ----------------
+ * Looks up the priority assigned to the given topic with the "prio" command.
+ * Must be called with the mutex lock held.
+ *
+ * info: struct containing the shared client info (used to access the 
+ * StringMap of topic priorities)
+ * topic: the topic to look up
+ *
+ * Returns: the topic's lane, or PRIORITY_NORMAL if none has been assigned
+ */
+int topic_priority(SharedClientInfo* info, char* topic) {
+    int* priority = stringmap_search(info->priorities, topic);
+    return priority == NULL ? PRIORITY_NORMAL : *priority;
+}
+
+/* is_group_spec()
+ * ---------------
+ * Checks whether the given subscription argument names a consumer group, 
+ * i.e. is of the form "$group/<group> <topic>".
+ *
+ * str: the subscription argument to check
+ *
+ * Returns: 1 if the argument names a consumer group, else 0
+ */
+int is_group_spec(char* str) {
+    return !strncmp(str, GROUP_PREFIX, strlen(GROUP_PREFIX));
+}
+
+/* parse_group_spec()
+ * ------------------
+ * Splits a subscription argument of the form "$group/<group> <topic>" into 
+ * its group name and topic. The given string is modified.
+ *
+ * spec: the subscription argument to split
+ * group: set to the group name
+ * topic: set to the topic (or NULL if none is present)
+ *
+ * Returns: 1 if both the group name and topic are present and valid, else 0
+ */
+int parse_group_spec(char* spec, char** group, char** topic) {
+    char** tokens = split_by_char(spec + strlen(GROUP_PREFIX), ' ', 
+	    TWO_TOKENS);
+    *group = tokens[0];
+    *topic = tokens[1];
+    free(tokens);
+    return *topic != NULL && check_spaces_colons_empty(*group) && 
+	    check_spaces_colons_empty(*topic);
+}
+
+/* find_group()
+ * ------------
+ * Searches a topic's linked list of consumer groups for the given group.
+ *
+ * groups: the head of the topic's linked list of groups
+ * name: the name of the group to find
+ *
+ * Returns: the group if found, else NULL
+ */
+ConsumerGroup* find_group(ConsumerGroup* groups, char* name) {
+    while (groups != NULL && strcmp(groups->name, name)) {
+	groups = groups->next;
+    }
+    return groups;
+}
+
+/* hash_connection()
+ * -----------------
+ * Returns: a hash of the given connection's address
+ */
+unsigned long hash_connection(Connection* connection) {
+    unsigned long hash = (unsigned long) connection;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdUL;
+    return hash ^ (hash >> 33);
+}
+
+/* find_slot()
+ * -----------
+ * Probes an array of subscribers' hash table for the given connection. The
+ * array must have a non-zero capacity.
+ *
+ * array: the array of subscribers to search
+ * connection: the connection to find
+ *
+ * Returns: the slot holding the index of the connection's subscription, or 
+ * the empty slot it would be stored in if the connection is not subscribed
+ */
+int find_slot(SubscriberArray* array, Connection* connection) {
+    int mask = 2 * array->capacity - 1;
+    int slot = hash_connection(connection) & mask;
+    while (array->slots[slot] >= 0 && 
+	    array->subscribers[array->slots[slot]].connection != connection) {
+	slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/* clear_slot()
+ * ------------
+ * Empties a slot of an array of subscribers' hash table, moving back any 
+ * later entries of the same probe run that would otherwise no longer be 
+ * found.
+ *
+ * array: the array of subscribers
+ * slot: the slot to empty
+ */
+void clear_slot(SubscriberArray* array, int slot) {
+    int mask = 2 * array->capacity - 1;
+    for (int next = (slot + 1) & mask; array->slots[next] >= 0; 
+	    next = (next + 1) & mask) {
+	Connection* connection = 
+		array->subscribers[array->slots[next]].connection;
+	int home = hash_connection(connection) & mask;
+
+	// Entry's home slot is at or before the empty slot - move it back
+	if (((next - home) & mask) >= ((next - slot) & mask)) {
+	    array->slots[slot] = array->slots[next];
+	    slot = next;
+	}
+    }
+    array->slots[slot] = -1;
+}
+
+/* find_subscriber()
+ * -----------------
+ * Looks up the given connection in an array of subscribers.
+ *
+ * array: the array of subscribers to search
+ * connection: the connection to find
+ *
+ * Returns: the index of the connection's subscription, or -1 if not found
+ */
+int find_subscriber(SubscriberArray* array, Connection* connection) {
+    if (array->capacity == 0) {
+	return -1;
+    }
+    return array->slots[find_slot(array, connection)];
+}
+
+/* add_subscriber()
+ * ----------------
+ * Appends a subscription to an array of subscribers, doubling the array's 
+ * capacity (and rebuilding its hash table) if it is full. The connection 
+ * must not already be subscribed.
+ *
+ * array: the array of subscribers to append to
+ * connection: the subscribed client's connection
+ * priority: the priority of the subscription
+ */
+void add_subscriber(SubscriberArray* array, Connection* connection, 
+	int priority) {
+    if (array->count == array->capacity) {
+	array->capacity = array->capacity == 0 ? INITIAL_SUBSCRIBERS : 
+		array->capacity * 2;
+	array->subscribers = realloc(array->subscribers, 
+		sizeof(struct Subscriber) * array->capacity);
+	free(array->slots);
+	array->slots = malloc(sizeof(int) * 2 * array->capacity);
+	memset(array->slots, -1, sizeof(int) * 2 * array->capacity);
+	for (int i = 0; i < array->count; i++) {
+	    array->slots[find_slot(array, 
+		    array->subscribers[i].connection)] = i;
+	}
+    }
+    array->slots[find_slot(array, connection)] = array->count;
+    array->subscribers[array->count].connection = connection;
+    array->subscribers[array->count].priority = priority;
+    array->count++;
+}
+
+/* remove_subscriber()
+ * -------------------
+ * Removes a subscription from an array of subscribers by moving the last 
+ * subscription into its place.
+ *
+ * array: the array of subscribers to remove from
+ * index: the index of the subscription to remove
+ */
+void remove_subscriber(SubscriberArray* array, int index) {
+    clear_slot(array, find_slot(array, 
+	    array->subscribers[index].connection));
+    array->count--;
+    if (index != array->count) {
+	array->slots[find_slot(array, 
+		array->subscribers[array->count].connection)] = index;
+	array->subscribers[index] = array->subscribers[array->count];
+    }
+}
+
+/* handle_group_sub()
+ * ------------------
+ * Adds the given client as a member of the named consumer group on the given
+ * topic (creating the group if none exists). Updates relevant statistics. 
+ * Ignores if the client does not have a name or the group or topic are 
+ * invalid. If the client is already a member, only its priority is updated.
+ *
+ * client: the client to be added to the group
+ * spec: the subscription argument, of the form "$group/<group> <topic>"
+ * priority: the lane the client's messages from the group are queued on
+ * info: struct containing the shared client info (used to access the 
+ * StringMap of topics and their consumer groups, the required semaphore, 
+ * and the relevant statistics)
+ * bufferSize: the current size of the client's array of subscribed topics
+ * countStat: integer value representing whether or not a successful sub 
+ * should be counted in the statistics
+ */
+void handle_group_sub(Client* client, char* spec, int priority, 
+	SharedClientInfo* info, int* bufferSize, int countStat) {
+    // Kept whole in the client's subscribed topics for cleaning up
+    char* stored = strdup(spec);
+    char* name;
+    char* topic;
+
+    // Invalid group or topic
+    if (!parse_group_spec(spec, &name, &topic)) {
+	print_invalid(*client);
+	free(stored);
+	return;
+    }
+
+    // Name has not been set
+    if (client->name == NULL) {
+	free(stored);
+	return;
+    }
+
+    take_lock(info->mutexLock);
+    ConsumerGroup* groups = stringmap_search(info->groups, topic);
+    ConsumerGroup* group = find_group(groups, name);
+
+    // First member of group - add group to head of topic's list of groups
+    if (group == NULL) {
+	group = malloc(sizeof(struct ConsumerGroup));
+	group->name = strdup(name);
+	group->members = (SubscriberArray) {.subscribers = NULL, .slots = NULL, 
+		.count = 0, 
+		.capacity = 0};
+	group->nextMember = 0;
+	group->next = groups;
+	stringmap_remove(info->groups, topic);
+	stringmap_add(info->groups, topic, group);
+    }
+
+    // Add to members unless already a member
+    int index = find_subscriber(&group->members, client->connection);
+    if (index < 0) {
+	add_subscriber(&group->members, client->connection, priority);
+	add_subscribed_topic(client, bufferSize, stored);
+	if (countStat) {
+	    info->totalSub++;
+	}
+    } else {
+	group->members.subscribers[index].priority = priority;
+	free(stored);
+    }
+    release_lock(info->mutexLock);
+}
+
+/* handle_group_unsub()
+ * --------------------
+ * Removes the given client from the named consumer group on the given topic,
+ * rebalancing the group's remaining members and removing the group once it
+ * is empty. Updates relevant statistics. Ignores if the client does not have
+ * a name or the group or topic are invalid or the client is not a member.
+ *
+ * client: the client to be removed from the group
+ * spec: the subscription argument, of the form "$group/<group> <topic>"
+ * info: struct containing the shared client info (used to access the 
+ * StringMap of topics and their consumer groups, the required semaphore, 
+ * and the relevant statistics)
+ * countStat: integer value representing whether or not a successful unsub
+ * should be counted in the statistics
+ */
+void handle_group_unsub(Client client, char* spec, SharedClientInfo* info, 
+	int countStat) {
+    char* copy = strdup(spec);
+    char* name;
+    char* topic;
+
+    // Invalid group or topic
+    if (!parse_group_spec(copy, &name, &topic)) {
+	print_invalid(client);
+
+    // Name has been set
+    } else if (client.name != NULL) {
+	take_lock(info->mutexLock);
+	ConsumerGroup* groups = stringmap_search(info->groups, topic);
+	ConsumerGroup* group = find_group(groups, name);
+
+	// Group exists - find client amongst its members
+	int index;
+	if (group != NULL && 
+		(index = find_subscriber(&group->members, 
+		client.connection)) >= 0) {
+	    // Remove it and rebalance the round-robin cursor
+	    remove_subscriber(&group->members, index);
+	    if (group->nextMember >= group->members.count) {
+		group->nextMember = 0;
+	    }
+	    if (countStat) {
+		info->totalUnsub++;
+	    }
+
+	    // Group now empty - remove it from the topic's list of groups
+	    if (group->members.count == 0) {
+		if (group == groups) {
+		    stringmap_remove(info->groups, topic);
+		    stringmap_add(info->groups, topic, group->next);
+		} else {
+		    ConsumerGroup* before = groups;
+		    while (before->next != group) {
+			before = before->next;
+		    }
+		    before->next = group->next;
+		}
+		free(group->members.subscribers);
+		free(group->members.slots);
+		free(group->name);
+		free(group);
+	    }
+	}
+	release_lock(info->mutexLock);
+    }
+    free(copy);
+}
+
+/* handle_sub()
+ * ------------
+ * Adds the given client to the given topic's array of subscribers (or 
+ * creates one if none exists). Updates relevant statistics. 
+ * Ignores if the client does not have a name or the topic is invalid. The
+ * topic may be followed by a priority for the subscription, otherwise the
+ * topic's priority applies; subscribing again only updates the priority.
+ * Group subscriptions are passed on to handle_group_sub().
+ *
+ * client: the client to be added to the array
+ * topic: the topic being subscribed to, optionally followed by a priority
+ * info: struct containing the shared client info (used to access the 
+ * StringMap of topics and their subscribed clients, the required semaphore, 
+ * and the relevant statistics)
+ * bufferSize: the current size of the client's array of subscribed topics
+ * countStat: integer value representing whether or not a successful sub 
+ * should be counted in the statistics
+ */
+void handle_sub(Client* client, char* topic, SharedClientInfo* info, 
+	int* bufferSize, int countStat) {
+    int isGroup = is_group_spec(topic);
+    int priority = take_priority(topic, isGroup ? TWO_TOKENS : 1);
+
+    // Group subscription
+    if (isGroup) {
+	handle_group_sub(client, topic, priority, info, bufferSize, 
+		countStat);
+
+    // Invalid topic
+    } else if (!check_spaces_colons_empty(topic)) {
+	print_invalid(*client);
+
+    // Name has been set
+    } else if (client->name != NULL) {
+	SubscriberArray* item;
+	take_lock(info->mutexLock);
+
+	// First client to subscribe to topic - create new array
+	if (!(item = stringmap_search(info->sm, topic))) {
+	    item = malloc(sizeof(struct SubscriberArray));
+	    *item = (SubscriberArray) {.subscribers = NULL, .slots = NULL, 
+		.count = 0, 
+		    .capacity = 0};
+	    stringmap_add(info->sm, topic, item);
+	}
+
+	// Add to array unless already subscribed
+	int index = find_subscriber(item, client->connection);
+	if (index < 0) {
+	    add_subscriber(item, client->connection, priority);
+	    add_subscribed_topic(client, bufferSize, topic);
+	    if (countStat) {
+		info->totalSub++;
+	    }
+	} else {
+	    item->subscribers[index].priority = priority;
+	}
+	release_lock(info->mutexLock);
+    }
+}
+
+/* handle_unsub()
+ * --------------
+ * Removes the given client from the given topic's array of subscribers, 
+ * removing the array once it is empty. Updates relevant statistics. Ignores
+ * if the client does not have a name or the topic is invalid or the client 
+ * is not subscribed to the topic.
+ * Group subscriptions are passed on to handle_group_unsub().
+ *
+ * client: the client to be removed from the array
+ * topic: the topic being unsubscribed from
+ * info: struct containing the shared client info (used to access the 
+ * StringMap of topics and their subscribed clients, the required semaphore, 
+ * and the relevant statistics)
+ * countStat: integer value representing whether or not a successful unsub
+ * should be counted in the statistics
+ */
+void handle_unsub(Client client, char* topic, SharedClientInfo* info, 
+	int countStat) {
+    // Group subscription
+    if (is_group_spec(topic)) {
+	handle_group_unsub(client, topic, info, countStat);
+
+    // Invalid topic
+    } else if (!check_spaces_colons_empty(topic)) {
+	print_invalid(client);
+
+    // Name has been set
+    } else if (client.name != NULL) {
+	SubscriberArray* item;
+	int index;
+	take_lock(info->mutexLock);
+
+	// Client found in array - remove it
+	if ((item = stringmap_search(info->sm, topic)) != NULL && 
+		(index = find_subscriber(item, client.connection)) >= 0) {
+	    remove_subscriber(item, index);
+	    if (countStat) {
+		info->totalUnsub++;
+	    }
+
+	    // Last subscriber - remove array
+	    if (item->count == 0) {
+		stringmap_remove(info->sm, topic);
+		free(item->subscribers);
+		free(item->slots);
+		free(item);
+	    }
+	}
+	release_lock(info->mutexLock);
+    }
+}
+
+/* handle_compress()
+ * -----------------
+ * Negotiates compression of messages sent to the given client. The client is
+ * sent ":compress <codec>" to confirm the codec. The writer thread switches 
+ * codec once it has written the confirmation, so messages written before it 
+ * (including those on higher lanes queued earlier) use the previous codec 
+ * and, with deflate, messages of at least COMPRESS_THRESHOLD bytes written 
+ * after it may be sent compressed.
+ *
+ * client: the client negotiating compression
+ * codec: the codec requested, either "deflate" or "none"
+ */
+void handle_compress(Client client, char* codec) {
+    int compression;
+    if (!strcmp(codec, "deflate")) {
+	compression = COMPRESSION_DEFLATE;
+    } else if (!strcmp(codec, "none")) {
+	compression = COMPRESSION_NONE;
+    } else {
+	print_invalid(client);
+	return;
+    }
+
+    Message* confirmation = create_message(strdup(
+	    compression == COMPRESSION_DEFLATE ? ":compress deflate\n" : 
+	    ":compress none\n"));
+    Connection* connection = client.connection;
+    take_lock(&connection->queueLock);
+    connection->switchMessage = confirmation;
+    connection->switchCompression = compression;
+    append_to_lane(connection, confirmation, PRIORITY_HIGH);
+    release_lock(&connection->queueLock);
+    release_lock(&connection->pending);
+    release_message(confirmation);
+}
+
+/* init_prio_clients()
+ * -------------------
+ * Reads the names of the clients allowed to assign topic priorities from the
+ * PSSERVER_PRIO_CLIENTS environment variable, a space separated list in 
+ * which "*" allows every client. Nobody is allowed if it is not set. The 
+ * names are not changed once read, so they are looked up without the mutex
+ * lock.
+ *
+ * info: struct containing the shared client info, whose StringMap of 
+ * clients allowed to assign priorities is filled in
+ */
+void init_prio_clients(SharedClientInfo* info) {
+    char* value = getenv("PSSERVER_PRIO_CLIENTS");
+    if (value == NULL) {
+	return;
+    }
+    char* names = strdup(value);
+    char* saved;
+    for (char* name = strtok_r(names, " ", &saved); name != NULL; 
+	    name = strtok_r(NULL, " ", &saved)) {
+	char* allowed = strdup(name);
+	if (!stringmap_add(info->prioClients, name, allowed)) {
+	    free(allowed);
+	}
+    }
+    free(names);
+}
+
+/* handle_prio()
+ * -------------
+ * Assigns the given priority to the given topic for every subscriber. 
+ * Subscriptions made without a priority of their own have the topic's 
+ * messages queued on this lane. As this affects other clients, only the 
+ * clients named in PSSERVER_PRIO_CLIENTS may do so - others choose a lane 
+ * for their own subscription with "sub <topic> <priority>". Invalid if the
+ * topic or priority are invalid or the client is not allowed, and ignored 
+ * if the client does not have a name.
+ *
+ * client: the client assigning the priority
+ * topicAndPriority: string containing the topic and the priority name
+ * info: struct containing the shared client info (used to access the 
+ * StringMap of topic priorities and the required semaphore)
+ */
+void handle_prio(Client client, char* topicAndPriority, 
+	SharedClientInfo* info) {
+    char** tokens = split_by_char(topicAndPriority, ' ', TWO_TOKENS);
+    char* topic = tokens[0];
+    int priority = tokens[1] == NULL ? PRIORITY_TOPIC : 
+	    parse_priority(tokens[1]);
+
+    // Invalid topic or priority
+    if (!check_spaces_colons_empty(topic) || priority == PRIORITY_TOPIC) {
+	print_invalid(client);
+
+    // Name has been set
+    } else if (client.name != NULL) {
+	// Not allowed to change the topic for everyone
+	if (stringmap_search(info->prioClients, client.name) == NULL && 
+		stringmap_search(info->prioClients, ANY_CLIENT) == NULL) {
+	    print_invalid(client);
+	    free(tokens);
+	    return;
+	}
+	take_lock(info->mutexLock);
+	int* stored = stringmap_search(info->priorities, topic);
+	if (stored == NULL) {
+	    stored = malloc(sizeof(int));
+	    stringmap_add(info->priorities, topic, stored);
+	}
+	*stored = priority;
+	release_lock(info->mutexLock);
+    }
+    free(tokens);
+}
+
+/* subscription_lane()
+ * -------------------
+ * Determines the lane a subscription's messages are to be queued on.
+ *
+ * subscriber: the subscription
+ * topicPriority: the priority of the subscription's topic
+ *
+ * Returns: the subscription's own priority if it has one, else the topic's
+ */
+int subscription_lane(Subscriber* subscriber, int topicPriority) {
+    return subscriber->priority == PRIORITY_TOPIC ? topicPriority : 
+	    subscriber->priority;
+}
+
+/* deliver_to_run()
+ * ----------------
+ * Queues the given message for a run of consecutive subscribers in a topic's
+ * array of subscribers.
+ *
+ * start: the first subscriber in the run
+ * count: the number of subscribers in the run
+ * message: the message to queue
+ * topicPriority: the priority of the topic the message was published to
+ */
+void deliver_to_run(Subscriber* start, int count, Message* message, 
+	int topicPriority) {
+    for (Subscriber* temp = start; temp < start + count; temp++) {
+	deliver_message(temp->connection, message, 
+		subscription_lane(temp, topicPriority));
+    }
+}
+
+/* submit_fanout_job()
+ * -------------------
+ * Adds a job to the tail of the fan-out pool's queue and wakes a worker.
+ *
+ * pool: the fan-out pool to submit to
+ * job: the job to be submitted
+ */
+void submit_fanout_job(FanoutPool* pool, FanoutJob* job) {
+    job->next = NULL;
+    take_lock(&pool->queueLock);
+    if (pool->tail == NULL) {
+	pool->head = job;
+    } else {
+	pool->tail->next = job;
+    }
+    pool->tail = job;
+    release_lock(&pool->queueLock);
+    release_lock(&pool->jobsAvailable);
+}
+
+/* fanout_worker()
+ * ---------------
+ * Thread handling function responsible for delivering messages on behalf of
+ * publishing clients. Repeatedly waits for a job, delivers the job's message
+ * to its run of subscribers and signals the publisher that the job is done.
+ *
+ * arg: the argument passed when creating the thread, in this case the 
+ * fan-out pool to take jobs from
+ *
+ * Returns: will always return NULL
+ */
+void* fanout_worker(void* arg) {
+    FanoutPool* pool = (FanoutPool*) arg;
+
+    while (1) {
+	take_lock(&pool->jobsAvailable);
+	take_lock(&pool->queueLock);
+	FanoutJob* job = pool->head;
+	pool->head = job->next;
+	if (pool->head == NULL) {
+	    pool->tail = NULL;
+	}
+	release_lock(&pool->queueLock);
+
+	deliver_to_run(job->start, job->count, job->message, 
+		job->topicPriority);
+	release_lock(job->done);
+	free(job);
+    }
+    return NULL;
+}
+
+/* pin_thread()
+ * ------------
+ * Restricts the given thread to run on the given core, reporting if it 
+ * cannot be.
+ *
+ * thread: the thread to pin
+ * cpu: the core to pin it to
+ *
+ * Returns: 1 if the thread was pinned, else 0
+ */
+int pin_thread(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int error = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &set);
+    if (error) {
+	fprintf(stderr, "psserver: unable to pin thread to CPU %d: %s\n", 
+		cpu, strerror(error));
+	fflush(stderr);
+    }
+    return !error;
+}
+
+/* init_cpu_placement()
+ * --------------------
+ * Reads the cores to pin server threads to from the PSSERVER_CPUS 
+ * environment variable, a comma separated list of cores and ranges of 
+ * cores such as "0-7,16-23". Cores the process may not run on are reported
+ * and ignored. Pins the calling thread, and so the threads it goes on to 
+ * create, to the first core.
+ *
+ * Returns: the placement, or NULL if PSSERVER_CPUS is not set, names no 
+ * usable cores or the cores available cannot be read
+ */
+CpuPlacement* init_cpu_placement(void) {
+    char* value = getenv("PSSERVER_CPUS");
+    if (value == NULL) {
+	return NULL;
+    }
+    cpu_set_t available;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &available) < 0) {
+	fprintf(stderr, "psserver: unable to read available CPUs: %s\n", 
+		strerror(errno));
+	fflush(stderr);
+	return NULL;
+    }
+
+    CpuPlacement* placement = calloc(1, sizeof(struct CpuPlacement));
+    placement->cpus = malloc(sizeof(int) * CPU_SETSIZE);
+    CPU_ZERO(&placement->allowed);
+    char* range = value;
+    while (*range != '\0') {
+	char* end;
+	long first = strtol(range, &end, BASE_10);
+	long last = first;
+	if (end != range && *end == '-') {
+	    char* lastStart = end + 1;
+	    last = strtol(lastStart, &end, BASE_10);
+	    if (end == lastStart) {
+		last = -1;
+	    }
+	}
+	if (end == range || first < 0 || last < first || 
+		last >= CPU_SETSIZE || (*end != ',' && *end != '\0')) {
+	    end += strcspn(end, ",");
+	    fprintf(stderr, "psserver: ignoring CPUs \"%.*s\"\n", 
+		    (int) (end - range), range);
+	    last = first - 1;
+	}
+	for (long cpu = first; cpu <= last; cpu++) {
+	    if (!CPU_ISSET(cpu, &available)) {
+		fprintf(stderr, "psserver: ignoring unavailable CPU %ld\n", 
+			cpu);
+	    } else if (!CPU_ISSET(cpu, &placement->allowed)) {
+		CPU_SET(cpu, &placement->allowed);
+		placement->cpus[placement->count++] = cpu;
+	    }
+	}
+	range = *end == ',' ? end + 1 : end;
+    }
+    fflush(stderr);
+
+    if (placement->count == 0) {
+	free(placement->cpus);
+	free(placement);
+	return NULL;
+    }
+    pin_thread(pthread_self(), placement->cpus[0]);
+    return placement;
+}
+
+/* place_client_thread()
+ * ---------------------
+ * Pins the calling client handling thread to the core that received the 
+ * most recent traffic on the given socket, so that the thread runs where 
+ * the socket's receive queue is processed, or to the next configured core
+ * in turn if that core is not one the server is pinned to. Called before 
+ * the client's state is allocated, so that the memory is first touched, 
+ * and so placed, on the core's NUMA node. A writer thread the client 
+ * thread goes on to create inherits the placement. The state of a client 
+ * restored by a hot restart was allocated by take_over() on the first 
+ * configured core, so stays on that core's node; only its threads move.
+ *
+ * placement: the cores to pin to (may be NULL if threads are not pinned)
+ * fd: the client's socket
+ *
+ * Returns: the core pinned to, or NO_CPU if threads are not pinned or the 
+ * thread could not be
+ */
+int place_client_thread(CpuPlacement* placement, int fd) {
+    if (placement == NULL) {
+	return NO_CPU;
+    }
+    int cpu = NO_CPU;
+    socklen_t length = sizeof(int);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) < 0 || 
+	    cpu < 0 || cpu >= CPU_SETSIZE || 
+	    !CPU_ISSET(cpu, &placement->allowed)) {
+	int turn = __sync_fetch_and_add(&placement->nextCpu, 1);
+	cpu = placement->cpus[turn % placement->count];
+    }
+    return pin_thread(pthread_self(), cpu) ? cpu : NO_CPU;
+}
+
+/* init_fanout_pool()
+ * ------------------
+ * Initialises the fan-out pool and starts one worker per online processor,
+ * or one pinned to each configured core if server threads are pinned.
+ *
+ * pool: the fan-out pool to be initialised
+ * placement: the cores to pin to (may be NULL if threads are not pinned)
+ */
+void init_fanout_pool(FanoutPool* pool, CpuPlacement* placement) {
+    pool->head = NULL;
+    pool->tail = NULL;
+    init_mutex_lock(&pool->queueLock);
+    sem_init(&pool->jobsAvailable, 0, 0);
+
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    pool->workerCount = placement != NULL ? placement->count : 
+	    processors > 0 ? processors : 1;
+    for (int i = 0; i < pool->workerCount; i++) {
+	pthread_t threadID;
+	pthread_create(&threadID, NULL, fanout_worker, pool);
+	if (placement != NULL) {
+	    pin_thread(threadID, placement->cpus[i]);
+	}
+	pthread_detach(threadID);
+    }
+}
+
+/* fan_out()
+ * ---------
+ * Delivers the given message to every client in the given array of 
+ * subscribers. Arrays of at least FANOUT_THRESHOLD subscribers are split into
+ * runs of FANOUT_CHUNK_SIZE which are delivered in parallel by the fan-out 
+ * workers, smaller arrays are delivered inline. Does not return until every
+ * subscriber has been written to, so that messages published while the 
+ * caller holds the mutex lock reach each subscriber in order.
+ *
+ * array: the topic's subscribers
+ * message: the message to deliver
+ * topicPriority: the priority of the topic the message was published to
+ * pool: the fan-out pool used to deliver large arrays
+ */
+void fan_out(SubscriberArray* array, Message* message, int topicPriority, 
+	FanoutPool* pool) {
+    // Small topic - deliver on the publishing client's thread
+    if (array->count < FANOUT_THRESHOLD) {
+	deliver_to_run(array->subscribers, array->count, message, 
+		topicPriority);
+	return;
+    }
+
+    // Large topic - split into runs and hand to the workers
+    sem_t done;
+    sem_init(&done, 0, 0);
+    int jobs = 0;
+    for (int start = 0; start < array->count; start += FANOUT_CHUNK_SIZE) {
+	FanoutJob* job = malloc(sizeof(struct FanoutJob));
+	job->start = array->subscribers + start;
+	job->count = array->count - start < FANOUT_CHUNK_SIZE ? 
+		array->count - start : FANOUT_CHUNK_SIZE;
+	job->message = message;
+	job->topicPriority = topicPriority;
+	job->done = &done;
+	submit_fanout_job(pool, job);
+	jobs++;
+    }
+
+    // Wait for every run to be delivered
+    for (int i = 0; i < jobs; i++) {
+	take_lock(&done);
+    }
+    sem_destroy(&done);
+}
+
+/* queued_bytes()
+ * --------------
+ * Determines the depth of the given connection's outbound queue, i.e. the 
+ * number of bytes waiting in its lanes plus those last found written to 
+ * its socket but yet to be sent (see sample_unsent_bytes()). Makes no 
+ * system call, so that it is cheap enough to call for every group member 
+ * on every publish with the mutex lock held.
+ *
+ * connection: the connection whose queue depth is to be determined
+ *
+ * Returns: the number of unsent bytes
+ */
+int queued_bytes(Connection* connection) {
+    take_lock(&connection->queueLock);
+    int queued = connection->queuedBytes;
+    release_lock(&connection->queueLock);
+    return queued + __atomic_load_n(&connection->unsentBytes, 
+	    __ATOMIC_RELAXED);
+}
+
+/* select_group_member()
+ * ---------------------
+ * Chooses which member of a consumer group is to receive the next message. 
+ * The member with the shallowest outbound queue is chosen, with ties broken
+ * round-robin starting from the group's cursor, which is then advanced past
+ * the chosen member.
+ *
+ * group: the group to choose a member of
+ *
+ * Returns: the chosen member
+ */
+Subscriber* select_group_member(ConsumerGroup* group) {
+    int count = group->members.count;
+    int chosen = -1;
+    int chosenQueued = 0;
+    int chosenTurn = 0;
+
+    for (int index = 0; index < count; index++) {
+	// Position of member in round-robin order from the cursor
+	int turn = (index - group->nextMember + count) % count;
+	Connection* member = group->members.subscribers[index].connection;
+	int queued = queued_bytes(member);
+	if (chosen < 0 || queued < chosenQueued || 
+		(queued == chosenQueued && turn < chosenTurn)) {
+	    chosen = index;
+	    chosenQueued = queued;
+	    chosenTurn = turn;
+	}
+    }
+    group->nextMember = (chosen + 1) % count;
+    return &group->members.subscribers[chosen];
+}
+
+/* deliver_to_groups()
+ * -------------------
+ * Queues the given message for one member of each of a topic's consumer 
+ * groups.
+ *
+ * groups: the head of the topic's linked list of groups
+ * message: the message to deliver
+ * topicPriority: the priority of the topic the message was published to
+ */
+void deliver_to_groups(ConsumerGroup* groups, Message* message, 
+	int topicPriority) {
+    for (ConsumerGroup* group = groups; group != NULL; group = group->next) {
+	Subscriber* member = select_group_member(group);
+	deliver_message(member->connection, message, 
+		subscription_lane(member, topicPriority));
+    }
+}
+
+/* deliver_to_topic()
+ * ------------------
+ * Queues the given message for every client subscribed to the given topic
+ * and for one member of each consumer group subscribed to it. Must be called
+ * with the mutex lock held.
+ *
+ * info: struct containing the shared client info (used to access the 
+ * StringMaps of topics and their subscribed clients, groups and priorities,
+ * and the fan-out pool)
+ * topic: the topic the message was published to
+ * message: the message to deliver
+ *
+ * Returns: 1 if the message was queued for at least one client, else 0
+ */
+int deliver_to_topic(SharedClientInfo* info, char* topic, Message* message) {
+    int priority = topic_priority(info, topic);
+    SubscriberArray* item = stringmap_search(info->sm, topic);
+    ConsumerGroup* groups = stringmap_search(info->groups, topic);
+    trace_point(message->traceId, TRACE_LOOKUP);
+
+    // At least one client is subscribed
+    if (item != NULL) {
+	fan_out(item, message, priority, info->pool);
+    }
+
+    // At least one consumer group is subscribed
+    if (groups != NULL) {
+	deliver_to_groups(groups, message, priority);
+    }
+    trace_point(message->traceId, TRACE_ENQUEUE);
+    return item != NULL || groups != NULL;
+}
+
+/* handle_pub()
+ * ------------
+ * Publishes the given value from the given client to all clients subscribed
+ * to the given topic and to one member of each consumer group subscribed to
+ * the given topic. Updates relevant statistics. Ignores if the topic or
+ * value are invalid or the client does not have a name or there are no clients
+ * subscribed to the topic.
+ *
+ * client: the client to publish the message
+ * topicAndValue: string containing the topic to publish to and the value to
+ * publish
+ * scan: the separators found when the line was read, used to split and
+ * validate the topic without scanning it again
+ * info: struct containing the shared client info (used to access the 
+ * StringMaps of topics and their subscribed clients, groups and priorities,
+ * the required semaphore, the fan-out pool and the relevant statistics)
+ *
+ * Returns: 1 if the message was admitted for publishing (whether or not 
+ * anyone is subscribed), else 0
+ */
+int handle_pub(Client client, char* topicAndValue, LineScan* scan, 
+	SharedClientInfo* info) {
+    char* topic = topicAndValue;
+    char* value = NULL;
+    if (scan->argumentSpace >= 0) {
+	topicAndValue[scan->argumentSpace] = '\0';
+	value = topicAndValue + scan->argumentSpace + 1;
+    }
+
+    // Topic must be non-empty, end before the argument's first colon and
+    // not be reserved for naming consumer groups
+    int validTopic = scan->argumentSpace > 0 && (scan->argumentColon < 0 ||
+	    scan->argumentColon > scan->argumentSpace) && 
+	    !is_group_spec(topic);
+
+    // Invalid topic or publish message
+    if (!validTopic || value == NULL || value[0] == '\0') {
+	print_invalid(client);
+
+    // Name has been set and publish is within rate limits
+    } else if (client.name != NULL && admit_publish(client, topic, info)) {
+	// Format the message once for every subscriber
+	int length = snprintf(NULL, 0, "%s:%s:%s\n", client.name, topic, 
+		value);
+	char* text = malloc(length + 1);
+	sprintf(text, "%s:%s:%s\n", client.name, topic, value);
+	Message* message = create_message(text);
+
+	take_lock(info->mutexLock);
+	deliver_to_topic(info, topic, message);
+	info->totalPub++;
+	release_lock(info->mutexLock);
+	release_message(message);
+	return 1;
+    }
+    return 0;
+}
+
+/* handle_req()
+ * ------------
+ * Sends a request from the given client to all clients subscribed to the 
+ * given topic and to one member of each consumer group subscribed to it, as
+ * ":req <slot>.<serial>.<correlation> <name>:<topic>:<value>". The first 
+ * part is the reply address: the requester's connection ID and the 
+ * correlation ID it chose. If nobody is subscribed, ":noreply <correlation>"
+ * is sent back to the requester. Updates relevant statistics. Ignores if the
+ * topic, correlation ID or value are invalid or the client does not have a
+ * name.
+ *
+ * client: the client making the request
+ * arg: string containing the topic, the correlation ID and the value
+ * scan: the separators found when the line was read, used to split and
+ * validate the topic without scanning it again
+ * info: struct containing the shared client info (used to deliver the 
+ * request, the required semaphore and the relevant statistics)
+ *
+ * Returns: 1 if the request was admitted (whether or not anyone is 
+ * subscribed), else 0
+ */
+int handle_req(Client client, char* arg, LineScan* scan, 
+	SharedClientInfo* info) {
+    char* topic = arg;
+    char* correlation = NULL;
+    char* value = NULL;
+    if (scan->argumentSpace >= 0) {
+	arg[scan->argumentSpace] = '\0';
+	correlation = arg + scan->argumentSpace + 1;
+	value = strchr(correlation, ' ');
+	if (value != NULL) {
+	    *value++ = '\0';
+	}
+    }
+
+    // Topic must be non-empty, end before the argument's first colon and
+    // not be reserved for naming consumer groups
+    int validTopic = scan->argumentSpace > 0 && (scan->argumentColon < 0 ||
+	    scan->argumentColon > scan->argumentSpace) && 
+	    !is_group_spec(topic);
+
+    // Invalid topic, correlation ID or request
+    if (!validTopic || value == NULL || value[0] == '\0' || 
+	    !check_spaces_colons_empty(correlation)) {
+	print_invalid(client);
+
+    // Name has been set and request is within rate limits
+    } else if (client.name != NULL && admit_publish(client, topic, info)) {
+	Connection* connection = client.connection;
+	int length = snprintf(NULL, 0, ":req %d.%u.%s %s:%s:%s\n", 
+		connection->slot, connection->serial, correlation, 
+		client.name, topic, value);
+	char* text = malloc(length + 1);
+	sprintf(text, ":req %d.%u.%s %s:%s:%s\n", connection->slot, 
+		connection->serial, correlation, client.name, topic, value);
+	Message* message = create_message(text);
+
+	take_lock(info->mutexLock);
+	int delivered = deliver_to_topic(info, topic, message);
+	info->totalReq++;
+	release_lock(info->mutexLock);
+	release_message(message);
+
+	// Nobody to answer
+	if (!delivered) {
+	    text = malloc(strlen(":noreply \n") + strlen(correlation) + 1);
+	    sprintf(text, ":noreply %s\n", correlation);
+	    message = create_message(text);
+	    enqueue_message(connection, message, PRIORITY_HIGH);
+	    release_message(message);
+	}
+	return 1;
+    }
+    return 0;
+}
+
+/* handle_rep()
+ * ------------
+ * Sends a reply from the given client straight to the connection that made
+ * a request, found from the reply address in the connection table, as 
+ * ":rep <correlation> <name>:<value>". The reply is dropped if the 
+ * requester has disconnected. Updates relevant statistics. Ignores if the
+ * reply address or value are invalid or the client does not have a name.
+ *
+ * client: the client replying
+ * arg: string containing the reply address of the request and the value
+ * scan: the separators found when the line was read, used to split off the
+ * value without scanning it again
+ * info: struct containing the shared client info (used to access the 
+ * connection table, the required semaphore and the relevant statistics)
+ */
+void handle_rep(Client client, char* arg, LineScan* scan, 
+	SharedClientInfo* info) {
+    char* value = NULL;
+    if (scan->argumentSpace >= 0) {
+	arg[scan->argumentSpace] = '\0';
+	value = arg + scan->argumentSpace + 1;
+    }
+
+    // Reply address is "<slot>.<serial>.<correlation>"
+    char* end;
+    unsigned long slot = strtoul(arg, &end, BASE_10);
+    unsigned long serial = 0;
+    char* correlation = NULL;
+    if (isdigit((unsigned char) arg[0]) && *end == '.' && 
+	    isdigit((unsigned char) end[1])) {
+	serial = strtoul(end + 1, &end, BASE_10);
+	if (*end == '.') {
+	    correlation = end + 1;
+	}
+    }
+
+    // Invalid reply address or reply
+    if (correlation == NULL || !check_spaces_colons_empty(correlation) || 
+	    value == NULL || value[0] == '\0') {
+	print_invalid(client);
+
+    // Name has been set
+    } else if (client.name != NULL) {
+	int length = snprintf(NULL, 0, ":rep %s %s:%s\n", correlation, 
+		client.name, value);
+	char* text = malloc(length + 1);
+	sprintf(text, ":rep %s %s:%s\n", correlation, client.name, value);
+	Message* message = create_message(text);
+
+	take_lock(info->mutexLock);
+	Connection* requester = lookup_connection(info->table, slot, serial);
+	trace_point(message->traceId, TRACE_LOOKUP);
+
+	// Requester still connected
+	if (requester != NULL) {
+	    deliver_message(requester, message, PRIORITY_NORMAL);
+	}
+	trace_point(message->traceId, TRACE_ENQUEUE);
+	info->totalRep++;
+	release_lock(info->mutexLock);
+	release_message(message);
+    }
+}
+
+/* reset_credit_topics()
+ * ---------------------
+ * Forgets the topics published to, their volume and the deepest queue 
+ * downstream of them, since credit was last granted.
+ *
+ * credit: the client's credit
+ */
+void reset_credit_topics(Credit* credit) {
+    for (int i = 0; i < credit->topicCount; i++) {
+	free(credit->topics[i]);
+    }
+    free(credit->topics);
+    credit->topics = NULL;
+    credit->topicCount = 0;
+    credit->bytes = 0;
+    credit->messages = 0;
+    credit->bottleneckSerial = 0;
+}
+
+/* grant_credit()
+ * --------------
+ * Grants the given client a number of publish credits, sending them as 
+ * ":credit <n>" ahead of any other queued output.
+ *
+ * client: the client to grant credit to
+ * credits: the number of credits to grant
+ */
+void grant_credit(Client* client, int credits) {
+    char grant[sizeof(":credit \n") + MAX_INT_DIGITS];
+    sprintf(grant, ":credit %d\n", credits);
+    client->credit.outstanding += credits;
+    enqueue_text(client->connection, grant, PRIORITY_HIGH);
+}
+
+/* refund_credit()
+ * ---------------
+ * Gives back the credit the given client spent on a publish that was not
+ * admitted (invalid, unnamed or over a rate limit), sending it as 
+ * ":credit 1". The client counts every publish it sends against its 
+ * credit, so the credit is sent back rather than simply not taken.
+ *
+ * client: the publishing client
+ */
+void refund_credit(Client* client) {
+    enqueue_text(client->connection, ":credit 1\n", PRIORITY_HIGH);
+}
+
+/* spend_credit()
+ * --------------
+ * Spends one of the given client's credits on an admitted publish, 
+ * remembering the topic so that its subscribers' queues are considered 
+ * when credit is next granted.
+ *
+ * client: the publishing client
+ * topic: the topic published to
+ * length: the length of the publish request
+ */
+void spend_credit(Client* client, char* topic, int length) {
+    Credit* credit = &client->credit;
+    credit->outstanding--;
+    credit->bytes += length;
+    credit->messages++;
+    for (int i = 0; i < credit->topicCount; i++) {
+	if (!strcmp(credit->topics[i], topic)) {
+	    return;
+	}
+    }
+    credit->topics = realloc(credit->topics, 
+	    sizeof(char*) * (credit->topicCount + 1));
+    credit->topics[credit->topicCount++] = strdup(topic);
+}
+
+/* is_downstream()
+ * ---------------
+ * Checks whether the given connection subscribes, directly or as a consumer
+ * group member, to any of the topics the given client has published to 
+ * since credit was last granted. Must be called with the mutex lock held.
+ *
+ * client: the publishing client
+ * connection: the connection to check
+ * info: struct containing the shared client info (used to access the 
+ * StringMaps of topics and their subscribed clients and groups)
+ *
+ * Returns: 1 if the connection is downstream of the client, else 0
+ */
+int is_downstream(Client* client, Connection* connection, 
+	SharedClientInfo* info) {
+    for (int i = 0; i < client->credit.topicCount; i++) {
+	char* topic = client->credit.topics[i];
+	SubscriberArray* subscribers = stringmap_search(info->sm, topic);
+	if (subscribers != NULL && 
+		find_subscriber(subscribers, connection) >= 0) {
+	    return 1;
+	}
+	for (ConsumerGroup* group = stringmap_search(info->groups, topic); 
+		group != NULL; group = group->next) {
+	    if (find_subscriber(&group->members, connection) >= 0) {
+		return 1;
+	    }
+	}
+    }
+    return 0;
+}
+
+/* bottleneck_depth()
+ * ------------------
+ * Determines the depth of the queue found deepest by the last call to 
+ * downstream_depth() for the given client, if its connection is still open
+ * and downstream of the client. While that queue is too deep for credit to
+ * be granted nothing else need be checked, so a client waiting for credit 
+ * does not scan every subscriber under the mutex lock on each retry. The
+ * bytes yet to be sent from its socket are sampled afresh, since its writer
+ * only samples them as it writes, and nothing more may be published to it
+ * until it has drained.
+ *
+ * client: the publishing client
+ * info: struct containing the shared client info
+ *
+ * Returns: the number of unsent bytes in the queue, or -1 if there is none
+ */
+int bottleneck_depth(Client* client, SharedClientInfo* info) {
+    Credit* credit = &client->credit;
+    if (credit->bottleneckSerial == 0) {
+	return -1;
+    }
+    int depth = -1;
+    take_lock(info->mutexLock);
+    Connection* connection = lookup_connection(info->table, 
+	    credit->bottleneckSlot, credit->bottleneckSerial);
+    if (connection != NULL && is_downstream(client, connection, info)) {
+	sample_unsent_bytes(connection);
+	depth = queued_bytes(connection);
+    }
+    release_lock(info->mutexLock);
+    return depth;
+}
+
+/* downstream_depth()
+ * ------------------
+ * Determines the depth of the deepest outbound queue amongst the 
+ * subscribers and consumer group members of the topics the given client 
+ * has published to since credit was last granted, remembering whose it is
+ * for bottleneck_depth().
+ *
+ * client: the publishing client
+ * info: struct containing the shared client info (used to access the 
+ * StringMaps of topics and their subscribed clients and groups, and the 
+ * required semaphore)
+ *
+ * Returns: the number of unsent bytes in the deepest queue
+ */
+int downstream_depth(Client* client, SharedClientInfo* info) {
+    int deepest = 0;
+    Connection* bottleneck = NULL;
+    take_lock(info->mutexLock);
+    for (int i = 0; i < client->credit.topicCount; i++) {
+	char* topic = client->credit.topics[i];
+	SubscriberArray* subscribers = stringmap_search(info->sm, topic);
+	for (int j = 0; subscribers != NULL && j < subscribers->count; j++) {
+	    Connection* connection = subscribers->subscribers[j].connection;
+	    int queued = queued_bytes(connection);
+	    if (queued > deepest) {
+		deepest = queued;
+		bottleneck = connection;
+	    }
+	}
+	for (ConsumerGroup* group = stringmap_search(info->groups, topic); 
+		group != NULL; group = group->next) {
+	    for (int j = 0; j < group->members.count; j++) {
+		Connection* connection = 
+			group->members.subscribers[j].connection;
+		int queued = queued_bytes(connection);
+		if (queued > deepest) {
+		    deepest = queued;
+		    bottleneck = connection;
+		}
+	    }
+	}
+    }
+    client->credit.bottleneckSerial = 0;
+    if (bottleneck != NULL) {
+	client->credit.bottleneckSlot = bottleneck->slot;
+	client->credit.bottleneckSerial = bottleneck->serial;
+    }
+    release_lock(info->mutexLock);
+    return deepest;
+}
+
+/* refresh_credit()
+ * ----------------
+ * Tops the given client's credit back up to CREDIT_BATCH once it has fallen
+ * to CREDIT_LOW_WATER, limited by the room left below CREDIT_QUEUE_LIMIT in
+ * the deepest downstream queue divided by the average size of the client's
+ * recent publishes. The queue that held credit back last time is checked 
+ * first, and every downstream queue only once it has room.
+ *
+ * client: the publishing client
+ * info: struct containing the shared client info
+ *
+ * Returns: the number of credits granted
+ */
+int refresh_credit(Client* client, SharedClientInfo* info) {
+    Credit* credit = &client->credit;
+    if (!credit->enabled || credit->outstanding > CREDIT_LOW_WATER) {
+	return 0;
+    }
+
+    long average = credit->messages > 0 ? 
+	    credit->bytes / credit->messages + 1 : 1;
+    long room = CREDIT_QUEUE_LIMIT - bottleneck_depth(client, info);
+    if (room >= average) {
+	room = CREDIT_QUEUE_LIMIT - downstream_depth(client, info);
+    }
+    long credits = CREDIT_BATCH - 
+	    (credit->outstanding > 0 ? credit->outstanding : 0);
+    if (room / average < credits) {
+	credits = room > 0 ? room / average : 0;
+    }
+    if (credits > 0) {
+	grant_credit(client, credits);
+	reset_credit_topics(credit);
+    }
+    return credits;
+}
+
+/* account_publish()
+ * -----------------
+ * Charges a publish or request against the given client's credit, if it has
+ * opted into flow control: one that was admitted spends a credit, which 
+ * is topped up if running low, and one that was not is refunded.
+ *
+ * client: the publishing client
+ * admitted: whether the publish was admitted
+ * topic: the topic published to, if admitted
+ * length: the length of the publish request
+ * info: struct containing the shared client info
+ */
+void account_publish(Client* client, int admitted, char* topic, int length, 
+	SharedClientInfo* info) {
+    if (!client->credit.enabled) {
+	return;
+    } else if (admitted) {
+	spend_credit(client, topic, length);
+	refresh_credit(client, info);
+    } else {
+	refund_credit(client);
+    }
+}
+
+/* wait_for_credit()
+ * -----------------
+ * Stops reading from a client that has run out of credit until downstream
+ * queues have drained enough for credit to be granted, checking every 
+ * CREDIT_RETRY_MILLISECONDS. Stops waiting if the client disconnects or the
+ * connection is to be handed over.
+ *
+ * client: the publishing client
+ * reader: the client's line reader, marked as interrupted on handover
+ * info: struct containing the shared client info
+ *
+ * Returns: 1 if the client's input should be read, or 0 if the connection
+ * is being handed over
+ */
+int wait_for_credit(Client* client, LineReader* reader, 
+	SharedClientInfo* info) {
+    struct pollfd wake = {.fd = info->wakeFd, .events = POLLIN};
+    char peek;
+    while (client->credit.enabled && client->credit.outstanding <= 0 && 
+	    refresh_credit(client, info) == 0) {
+	// Client disconnected - let the reader find the end of input
+	if (recv(reader->fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+	    return 1;
+	}
+	if (poll(&wake, 1, CREDIT_RETRY_MILLISECONDS) > 0 && 
+		(wake.revents & POLLIN)) {
+	    reader->interrupted = 1;
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+/* handle_credit()
+ * ---------------
+ * Turns publish flow control on or off for the given client. While on, 
+ * each "pub" spends one credit and the client is expected not to publish 
+ * without credit. Turning it on grants a first batch of credit, sent as 
+ * ":credit <n>".
+ *
+ * client: the client opting in or out
+ * mode: "on" or "off"
+ */
+void handle_credit(Client* client, char* mode) {
+    if (!strcmp(mode, "on")) {
+	if (!client->credit.enabled) {
+	    client->credit.enabled = 1;
+	    client->credit.outstanding = 0;
+	    grant_credit(client, CREDIT_BATCH);
+	}
+    } else if (!strcmp(mode, "off")) {
+	client->credit.enabled = 0;
+	reset_credit_topics(&client->credit);
+	enqueue_text(client->connection, ":credit off\n", PRIORITY_HIGH);
+    } else {
+	print_invalid(*client);
+    }
+}
+
+/* wheel_insert()
+ * --------------
+ * Adds a timer to the slot of the timer wheel covering the given expiry 
+ * tick. Timers due within WHEEL_SLOTS ticks go in the lowest level, which
+ * is expired a slot per tick; timers due later go in the level whose slots
+ * are coarse enough, and are moved down a level as their slot comes round.
+ * A timer moved down on the tick it is due goes in the current slot, which
+ * advance_wheel() expires after moving timers down. Must be called with the
+ * wheel's lock held.
+ *
+ * wheel: the timer wheel
+ * timer: the timer to add
+ * expiry: the tick at which the timer is to fire
+ */
+void wheel_insert(TimerWheel* wheel, IdleTimer* timer, unsigned long expiry) {
+    unsigned long span = 1UL << (WHEEL_BITS * WHEEL_LEVELS);
+    if (expiry < wheel->now) {
+	expiry = wheel->now;
+    } else if (expiry - wheel->now >= span) {
+	expiry = wheel->now + span - 1;
+    }
+
+    int level = 0;
+    while (expiry - wheel->now >= 1UL << (WHEEL_BITS * (level + 1))) {
+	level++;
+    }
+    IdleTimer** slot = &wheel->slots[level][(expiry >> 
+	    (WHEEL_BITS * level)) & WHEEL_MASK];
+    timer->expiry = expiry;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot != NULL) {
+	(*slot)->prev = timer;
+    }
+    *slot = timer;
+    timer->slot = slot;
+}
+
+/* wheel_remove()
+ * --------------
+ * Removes a timer from its slot of the timer wheel, if it is in one. Must 
+ * be called with the wheel's lock held.
+ *
+ * timer: the timer to remove
+ */
+void wheel_remove(IdleTimer* timer) {
+    if (timer->slot == NULL) {
+	return;
+    }
+    if (timer->prev == NULL) {
+	*timer->slot = timer->next;
+    } else {
+	timer->prev->next = timer->next;
+    }
+    if (timer->next != NULL) {
+	timer->next->prev = timer->prev;
+    }
+    timer->slot = NULL;
+}
+
+/* schedule_idle_timer()
+ * ---------------------
+ * Adds an idle timer to the timer wheel at the next tick at which its 
+ * connection could need a keepalive or be reaped. Must be called with the
+ * wheel's lock held.
+ *
+ * wheel: the timer wheel
+ * timer: the timer to schedule
+ */
+void schedule_idle_timer(TimerWheel* wheel, IdleTimer* timer) {
+    unsigned long active = __atomic_load_n(&timer->lastActivity, 
+	    __ATOMIC_RELAXED);
+    unsigned long quiet = timer->lastPing > active ? timer->lastPing : active;
+    unsigned long expiry = wheel->keepalive > 0 ? quiet + wheel->keepalive : 
+	    active + wheel->timeout;
+    if (wheel->timeout > 0 && active + wheel->timeout < expiry) {
+	expiry = active + wheel->timeout;
+    }
+    wheel_insert(wheel, timer, expiry);
+}
+
+/* note_acknowledged()
+ * -------------------
+ * Counts a connection as active if its client has acknowledged more of 
+ * what was flushed to it since its idle timer last fired, so that a 
+ * subscriber that is receiving messages is not reaped for sending nothing.
+ * Pings are not counted, or a client could be kept alive by acknowledging 
+ * them alone. Acknowledgement is by the client's TCP stack: a client that
+ * has stopped reading is only seen as idle once its receive window fills.
+ * Must be called with the wheel's lock held.
+ *
+ * wheel: the timer wheel
+ * timer: the connection's idle timer
+ */
+void note_acknowledged(TimerWheel* wheel, IdleTimer* timer) {
+    int unsent = 0;
+    ioctl(timer->fd, TIOCOUTQ, &unsent);
+    long acknowledged = (long) (__atomic_load_n(
+	    &timer->connection->flushedBytes, __ATOMIC_RELAXED) - 
+	    timer->pingBytes) - unsent;
+    if (acknowledged > timer->acknowledged) {
+	timer->acknowledged = acknowledged;
+	__atomic_store_n(&timer->lastActivity, wheel->now, __ATOMIC_RELAXED);
+    }
+}
+
+/* expire_idle_timer()
+ * -------------------
+ * Handles an idle timer that has fired. Client threads only record the tick
+ * of their last line, so the timer is checked against that here rather than
+ * moved on every line, along with what the client has acknowledged. A 
+ * connection silent for the idle timeout, having neither sent a line nor 
+ * acknowledged a message, is reaped by shutting its socket down, which ends
+ * its client thread's read so that the thread cleans up after it as for a 
+ * disconnection. A connection silent for the keepalive interval is sent 
+ * ":ping <tick>", to which clients reply "pong <tick>". Unless reaped, the 
+ * timer is then rescheduled. Must be called with the wheel's lock held.
+ *
+ * wheel: the timer wheel
+ * timer: the timer that has fired
+ * info: struct containing the shared client info (used to count reaped 
+ * connections)
+ */
+void expire_idle_timer(TimerWheel* wheel, IdleTimer* timer, 
+	SharedClientInfo* info) {
+    note_acknowledged(wheel, timer);
+    unsigned long active = __atomic_load_n(&timer->lastActivity, 
+	    __ATOMIC_RELAXED);
+
+    // Silent for the idle timeout - reap
+    if (wheel->timeout > 0 && wheel->now - active >= wheel->timeout) {
+	shutdown(timer->fd, SHUT_RDWR);
+	take_lock(info->mutexLock);
+	info->totalReaped++;
+	release_lock(info->mutexLock);
+	return;
+    }
+
+    // Silent for the keepalive interval since the last line or ping
+    unsigned long quiet = timer->lastPing > active ? timer->lastPing : active;
+    if (wheel->keepalive > 0 && wheel->now - quiet >= wheel->keepalive) {
+	char ping[sizeof(":ping \n") + sizeof(unsigned long) * 3];
+	timer->pingBytes += sprintf(ping, ":ping %lu\n", wheel->now);
+	enqueue_text(timer->connection, ping, PRIORITY_HIGH);
+	timer->lastPing = wheel->now;
+    }
+    schedule_idle_timer(wheel, timer);
+}
+
+/* advance_wheel()
+ * ---------------
+ * Advances the timer wheel by one tick. Whenever a level's slot index wraps
+ * to zero, the next slot of the level above is emptied into the levels 
+ * below, then every timer in the lowest level's current slot is expired. 
+ * Each timer is moved at most once per level, so the cost per tick does not
+ * depend on the number of timers. Must be called with the wheel's lock held.
+ *
+ * wheel: the timer wheel
+ * info: struct containing the shared client info
+ */
+void advance_wheel(TimerWheel* wheel, SharedClientInfo* info) {
+    __atomic_store_n(&wheel->now, wheel->now + 1, __ATOMIC_RELAXED);
+
+    // Cascade timers down from the higher levels
+    for (int level = 1; level < WHEEL_LEVELS && 
+	    (wheel->now & ((1UL << (WHEEL_BITS * level)) - 1)) == 0; 
+	    level++) {
+	IdleTimer** slot = &wheel->slots[level][(wheel->now >> 
+		(WHEEL_BITS * level)) & WHEEL_MASK];
+	IdleTimer* timer = *slot;
+	*slot = NULL;
+	while (timer != NULL) {
+	    IdleTimer* next = timer->next;
+	    wheel_insert(wheel, timer, timer->expiry);
+	    timer = next;
+	}
+    }
+
+    // Expire the current slot
+    IdleTimer** slot = &wheel->slots[0][wheel->now & WHEEL_MASK];
+    IdleTimer* timer = *slot;
+    *slot = NULL;
+    while (timer != NULL) {
+	IdleTimer* next = timer->next;
+	timer->slot = NULL;
+	expire_idle_timer(wheel, timer, info);
+	timer = next;
+    }
+}
+
+/* timer_thread()
+ * --------------
+ * Thread handling function responsible for advancing the timer wheel every
+ * TICK_MILLISECONDS. Ticks are scheduled against the monotonic clock, so a
+ * late tick is caught up rather than lost.
+ *
+ * arg: the argument passed when creating the thread, in this case the 
+ * struct containing the shared client info
+ *
+ * Returns: will always return NULL
+ */
+void* timer_thread(void* arg) {
+    SharedClientInfo* info = (SharedClientInfo*) arg;
+    TimerWheel* wheel = info->wheel;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (1) {
+	next.tv_nsec += TICK_MILLISECONDS * NANOSECONDS_PER_MILLISECOND;
+	if (next.tv_nsec >= NANOSECONDS_PER_SECOND) {
+	    next.tv_sec++;
+	    next.tv_nsec -= NANOSECONDS_PER_SECOND;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, 
+		NULL) != 0) {
+	    // Interrupted - sleep again
+	}
+
+	take_lock(&wheel->lock);
+	advance_wheel(wheel, info);
+	release_lock(&wheel->lock);
+    }
+    return NULL;
+}
+
+/* seconds_to_ticks()
+ * ------------------
+ * Reads a duration in seconds from the given environment variable.
+ *
+ * name: the name of the environment variable
+ *
+ * Returns: the duration in ticks, or 0 if the variable is not set to a 
+ * positive number
+ */
+unsigned long seconds_to_ticks(char* name) {
+    char* value = getenv(name);
+    double seconds = value == NULL ? 0 : atof(value);
+    if (seconds <= 0) {
+	return 0;
+    }
+    unsigned long ticks = seconds * MILLISECONDS_PER_SECOND / 
+	    TICK_MILLISECONDS;
+    return ticks > 0 ? ticks : 1;
+}
+
+/* init_timer_wheel()
+ * ------------------
+ * Enables idle detection if the PSSERVER_KEEPALIVE or PSSERVER_IDLE_TIMEOUT
+ * environment variables are set to a positive number of seconds, starting 
+ * the thread that advances the timer wheel.
+ *
+ * info: struct containing the shared client info, whose timer wheel is set
+ * (or left NULL if idle detection is disabled)
+ */
+void init_timer_wheel(SharedClientInfo* info) {
+    unsigned long keepalive = seconds_to_ticks("PSSERVER_KEEPALIVE");
+    unsigned long timeout = seconds_to_ticks("PSSERVER_IDLE_TIMEOUT");
+    if (keepalive == 0 && timeout == 0) {
+	return;
+    }
+
+    TimerWheel* wheel = calloc(1, sizeof(struct TimerWheel));
+    wheel->keepalive = keepalive;
+    wheel->timeout = timeout;
+    init_mutex_lock(&wheel->lock);
+    info->wheel = wheel;
+
+    pthread_t threadID;
+    pthread_create(&threadID, NULL, timer_thread, info);
+    pthread_detach(threadID);
+}
+
+/* start_idle_timer()
+ * ------------------
+ * Creates and schedules the idle timer for a connection.
+ *
+ * wheel: the timer wheel (or NULL if idle detection is disabled)
+ * fd: the connection's socket
+ * connection: the connection's outbound queue, used to send keepalives
+ *
+ * Returns: the timer, or NULL if idle detection is disabled
+ */
+IdleTimer* start_idle_timer(TimerWheel* wheel, int fd, 
+	Connection* connection) {
+    if (wheel == NULL) {
+	return NULL;
+    }
+    IdleTimer* timer = calloc(1, sizeof(struct IdleTimer));
+    timer->fd = fd;
+    timer->connection = connection;
+
+    take_lock(&wheel->lock);
+    timer->lastActivity = wheel->now;
+    schedule_idle_timer(wheel, timer);
+    release_lock(&wheel->lock);
+    return timer;
+}
+
+/* touch_idle_timer()
+ * ------------------
+ * Records that a line has been received on a connection. Does not take the
+ * wheel's lock; the timer is rescheduled when it next fires.
+ *
+ * wheel: the timer wheel (or NULL if idle detection is disabled)
+ * timer: the connection's idle timer
+ */
+void touch_idle_timer(TimerWheel* wheel, IdleTimer* timer) {
+    if (timer != NULL) {
+	__atomic_store_n(&timer->lastActivity, 
+		__atomic_load_n(&wheel->now, __ATOMIC_RELAXED), 
+		__ATOMIC_RELAXED);
+    }
+}
+
+/* stop_idle_timer()
+ * -----------------
+ * Removes a connection's idle timer from the timer wheel and frees it.
+ *
+ * wheel: the timer wheel (or NULL if idle detection is disabled)
+ * timer: the connection's idle timer
+ */
+void stop_idle_timer(TimerWheel* wheel, IdleTimer* timer) {
+    if (timer != NULL) {
+	take_lock(&wheel->lock);
+	wheel_remove(timer);
+	release_lock(&wheel->lock);
+	free(timer);
+    }
+}
+
+/* clean_up_client()
+ * -----------------
+ * For the given client, stops its idle timer, unsubscribes from all 
+ * subscribed topics and leaves all consumer groups (rebalancing their 
+ * remaining members), frees relevant memory, closes relevant file pointers 
+ * and update relevant statistics.
+ *
+ * client: the client to clean up
+ * info: struct containing the shared client info (used to access the required 
+ * semaphores and the relevant statistics)
+ */
+void clean_up_client(Client client, SharedClientInfo* info) {
+    stop_idle_timer(info->wheel, client.idle);
+
+    // Unsub from each subscribed topic
+    for (int i = 0; i < client.subCount; i++) {
+	handle_unsub(client, client.subbedTopics[i], info, DONT_COUNT);	
+
+	// Group subscriptions are stored as copies
+	if (is_group_spec(client.subbedTopics[i])) {
+	    free(client.subbedTopics[i]);
+	}
+    }
+
+    // Free memory
+    free(client.subbedTopics);
+    reset_credit_topics(&client.credit);
+    if (client.limit != NULL && client.limit->owned) {
+	free(client.limit);
+    }
+
+    // No further replies can be routed to the connection, and a handover
+    // need not wait for it to drain
+    take_lock(info->mutexLock);
+    unregister_connection(info->table, client.connection);
+    info->leavingCount++;
+    release_lock(info->mutexLock);
+
+    // Write any messages still queued
+    close_connection(client.connection);
+
+    // Close file pointers 
+    fclose(client.toClient);
+    fclose(client.fromClient);   
+
+    // Update statistics
+    take_lock(info->mutexLock);
+    info->leavingCount--;
+    info->currentConnections--;
+    info->totalConnections++;
+    int owed = info->slotDebt > 0;
+    if (owed) {
+	info->slotDebt--;
+    }
+    release_lock(info->mutexLock);
+    if (!owed) {
+	release_lock(info->threadLock);
+    }
+}
+
+/* record_separators()
+ * -------------------
+ * Records the positions of the spaces and colons found in one block of a 
+ * line being scanned, given as bit masks of their positions in the block.
+ *
+ * scan: the scan of the line so far
+ * base: the position in the line of the start of the block
+ * spaces: bit mask of the positions of spaces in the block
+ * colons: bit mask of the positions of colons in the block
+ */
+void record_separators(LineScan* scan, int base, unsigned long spaces, 
+	unsigned long colons) {
+    while (spaces != 0 && scan->argumentSpace < 0) {
+	int position = base + __builtin_ctzl(spaces);
+	spaces &= spaces - 1;
+	if (scan->commandEnd < 0) {
+	    scan->commandEnd = position;
+	} else {
+	    scan->argumentSpace = position - scan->commandEnd - 1;
+	}
+    }
+
+    // Only colons in the argument are of interest
+    if (scan->argumentColon < 0 && scan->commandEnd >= 0) {
+	int skip = scan->commandEnd - base + 1;
+	if (skip >= (int) (sizeof(unsigned long) * 8)) {
+	    colons = 0;
+	} else if (skip > 0) {
+	    colons &= ~((1UL << skip) - 1);
+	}
+	if (colons != 0) {
+	    scan->argumentColon = base + __builtin_ctzl(colons) - 
+		    scan->commandEnd - 1;
+	}
+    }
+}
+
+/* scan_scalar()
+ * -------------
+ * Scans part of a line one byte at a time for its end and its separators.
+ *
+ * line: the start of the line
+ * from: the position to start scanning from
+ * to: the position to stop scanning at
+ * scan: the scan of the line so far, updated with the separators found
+ *
+ * Returns: the position of the newline ending the line, or -1 if not found
+ */
+int scan_scalar(char* line, int from, int to, LineScan* scan) {
+    for (int i = from; i < to; i++) {
+	if (line[i] == '\n') {
+	    return i;
+	} else if (line[i] == ' ') {
+	    record_separators(scan, i, 1, 0);
+	} else if (line[i] == ':') {
+	    record_separators(scan, i, 0, 1);
+	}
+    }
+    return -1;
+}
+
+/* scan_libc()
+ * -----------
+ * Scans part of a line for its end and its separators with a memchr() per 
+ * character sought, each over no more of the line than it needs to.
+ *
+ * line: the start of the line
+ * from: the position to start scanning from
+ * to: the position to stop scanning at
+ * scan: the scan of the line so far, updated with the separators found
+ *
+ * Returns: the position of the newline ending the line, or -1 if not found
+ */
+int scan_libc(char* line, int from, int to, LineScan* scan) {
+    char* newline = memchr(line + from, '\n', to - from);
+    int end = newline == NULL ? to : newline - line;
+    if (scan->commandEnd < 0) {
+	char* space = memchr(line + from, ' ', end - from);
+	if (space == NULL) {
+	    return newline == NULL ? -1 : end;
+	}
+	scan->commandEnd = space - line;
+    }
+
+    // Only the part of the argument not already scanned is searched
+    int argument = scan->commandEnd + 1 > from ? scan->commandEnd + 1 : from;
+    if (scan->argumentSpace < 0 && argument < end) {
+	char* space = memchr(line + argument, ' ', end - argument);
+	if (space != NULL) {
+	    scan->argumentSpace = space - line - scan->commandEnd - 1;
+	}
+    }
+    if (scan->argumentColon < 0 && argument < end) {
+	char* colon = memchr(line + argument, ':', end - argument);
+	if (colon != NULL) {
+	    scan->argumentColon = colon - line - scan->commandEnd - 1;
+	}
+    }
+    return newline == NULL ? -1 : end;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* scan_sse2()
+ * -----------
+ * Scans part of a line sixteen bytes at a time for its end and its 
+ * separators, finishing any remainder with scan_scalar().
+ *
+ * line: the start of the line
+ * from: the position to start scanning from
+ * to: the position to stop scanning at
+ * scan: the scan of the line so far, updated with the separators found
+ *
+ * Returns: the position of the newline ending the line, or -1 if not found
+ */
+__attribute__((target("sse2")))
+int scan_sse2(char* line, int from, int to, LineScan* scan) {
+    __m128i newlines = _mm_set1_epi8('\n');
+    __m128i spaces = _mm_set1_epi8(' ');
+    __m128i colons = _mm_set1_epi8(':');
+    int i = from;
+    for (; i + SSE2_WIDTH <= to; i += SSE2_WIDTH) {
+	__m128i block = _mm_loadu_si128((__m128i*) (line + i));
+	unsigned long newlineMask = _mm_movemask_epi8(
+		_mm_cmpeq_epi8(block, newlines));
+	unsigned long spaceMask = _mm_movemask_epi8(
+		_mm_cmpeq_epi8(block, spaces));
+	unsigned long colonMask = _mm_movemask_epi8(
+		_mm_cmpeq_epi8(block, colons));
+
+	// Ignore separators after the end of the line
+	if (newlineMask != 0) {
+	    int end = __builtin_ctzl(newlineMask);
+	    unsigned long before = (1UL << end) - 1;
+	    record_separators(scan, i, spaceMask & before, colonMask & before);
+	    return i + end;
+	}
+	if ((spaceMask | colonMask) != 0) {
+	    record_separators(scan, i, spaceMask, colonMask);
+	}
+    }
+    return scan_scalar(line, i, to, scan);
+}
+
+/* avx2_matches()
+ * --------------
+ * Returns: a block with every byte that is a newline, space or colon in 
+ * the given block set to all ones, and every other byte zero
+ */
+__attribute__((target("avx2")))
+static inline __m256i avx2_matches(__m256i block) {
+    return _mm256_or_si256(_mm256_or_si256(
+	    _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n')), 
+	    _mm256_cmpeq_epi8(block, _mm256_set1_epi8(' '))), 
+	    _mm256_cmpeq_epi8(block, _mm256_set1_epi8(':')));
+}
+
+/* scan_avx2()
+ * -----------
+ * Scans part of a line thirty-two bytes at a time for its end and its 
+ * separators, finishing any remainder with scan_sse2(). Runs of bytes with
+ * nothing of interest in them, such as most of a long value, are skipped 
+ * sixty-four bytes at a time. The upper halves of the vector registers are
+ * cleared before leaving, since the compiler does not do so for a function
+ * only built for AVX2 by its target attribute, and SSE code run while they
+ * are dirty pays a transition penalty.
+ *
+ * line: the start of the line
+ * from: the position to start scanning from
+ * to: the position to stop scanning at
+ * scan: the scan of the line so far, updated with the separators found
+ *
+ * Returns: the position of the newline ending the line, or -1 if not found
+ */
+__attribute__((target("avx2")))
+int scan_avx2(char* line, int from, int to, LineScan* scan) {
+    __m256i newlines = _mm256_set1_epi8('\n');
+    __m256i spaces = _mm256_set1_epi8(' ');
+    __m256i colons = _mm256_set1_epi8(':');
+    int i = from;
+    while (i + AVX2_WIDTH <= to) {
+	// Skip pairs of blocks that hold no newline, space or colon
+	for (; i + 2 * AVX2_WIDTH <= to; i += 2 * AVX2_WIDTH) {
+	    __m256i found = _mm256_or_si256(
+		    avx2_matches(_mm256_loadu_si256((__m256i*) (line + i))), 
+		    avx2_matches(_mm256_loadu_si256((__m256i*) 
+		    (line + i + AVX2_WIDTH))));
+	    if (!_mm256_testz_si256(found, found)) {
+		break;
+	    }
+	}
+	if (i + AVX2_WIDTH > to) {
+	    break;
+	}
+
+	__m256i block = _mm256_loadu_si256((__m256i*) (line + i));
+	unsigned long newlineMask = (unsigned int) _mm256_movemask_epi8(
+		_mm256_cmpeq_epi8(block, newlines));
+	unsigned long spaceMask = (unsigned int) _mm256_movemask_epi8(
+		_mm256_cmpeq_epi8(block, spaces));
+	unsigned long colonMask = (unsigned int) _mm256_movemask_epi8(
+		_mm256_cmpeq_epi8(block, colons));
+
+	// Ignore separators after the end of the line
+	if (newlineMask != 0) {
+	    int end = __builtin_ctzl(newlineMask);
+	    unsigned long before = (1UL << end) - 1;
+	    _mm256_zeroupper();
+	    record_separators(scan, i, spaceMask & before, colonMask & before);
+	    return i + end;
+	}
+	if ((spaceMask | colonMask) != 0) {
+	    record_separators(scan, i, spaceMask, colonMask);
+	}
+	i += AVX2_WIDTH;
+    }
+    _mm256_zeroupper();
+    return scan_sse2(line, i, to, scan);
+}
+#endif
+
+/* select_scanner()
+ * ----------------
+ * Chooses the line scanner named by the PSSERVER_SCANNER environment 
+ * variable ("libc", "scalar", "sse2" or "avx2") if the processor supports
+ * it, otherwise scan_libc(). The SIMD scanners are not the default: 
+ * bench/scan_bench has them level with scan_libc() on short lines and 
+ * behind it on long ones, where glibc's memchr() is faster still.
+ *
+ * Returns: the chosen scanner
+ */
+int (*select_scanner(void))(char*, int, int, LineScan*) {
+    char* name = getenv("PSSERVER_SCANNER");
+    if (name != NULL && !strcmp(name, "scalar")) {
+	return scan_scalar;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (name != NULL && !strcmp(name, "avx2") && 
+	    __builtin_cpu_supports("avx2")) {
+	return scan_avx2;
+    } else if (name != NULL && !strcmp(name, "sse2") && 
+	    __builtin_cpu_supports("sse2")) {
+	return scan_sse2;
+    }
+#endif
+    return scan_libc;
+}
+
+/* handover_requested()
+ * --------------------
+ * Waits until the given socket is readable or a hot restart has been 
+ * requested.
+ *
+ * fd: the socket to wait for
+ * wakeFd: the read end of the pipe written to when a hot restart begins
+ *
+ * Returns: 1 if a hot restart has been requested, else 0
+ */
+int handover_requested(int fd, int wakeFd) {
+    struct pollfd fds[] = {{.fd = fd, .events = POLLIN}, 
+	    {.fd = wakeFd, .events = POLLIN}};
+    while (poll(fds, 2, -1) < 0) {
+	// Interrupted - wait again
+    }
+    return (fds[1].revents & POLLIN) != 0;
+}
+
+/* init_line_reader()
+ * ------------------
+ * Initialises the receive buffer for reading lines from the given socket.
+ *
+ * reader: the line reader to initialise
+ * fd: the socket to read from
+ * wakeFd: the read end of the pipe written to when a hot restart begins, or
+ * -1 if hot restarts are disabled
+ */
+void init_line_reader(LineReader* reader, int fd, int wakeFd) {
+    reader->fd = fd;
+    reader->wakeFd = wakeFd;
+    reader->interrupted = 0;
+    reader->size = READ_BUFFER_SIZE;
+    reader->buffer = malloc(reader->size);
+    reader->start = 0;
+    reader->end = 0;
+    reader->scanned = 0;
+    reader->scan = (LineScan) {.length = 0, .commandEnd = -1, 
+	    .argumentSpace = -1, .argumentColon = -1};
+}
+
+/* next_line()
+ * -----------
+ * Reads the next line from the given line reader's socket, locating its end
+ * and separators with the scanner chosen by select_scanner(). Bytes
+ * already scanned are not scanned again when more data arrives.
+ *
+ * reader: the line reader to read from
+ * scan: set to the separators found in the line
+ *
+ * Returns: the line (without its newline) in newly allocated memory, or NULL
+ * if the socket was closed before any more characters were read or a hot
+ * restart has begun (in which case the reader is marked as interrupted and
+ * any partial line is left in its buffer)
+ */
+char* next_line(LineReader* reader, LineScan* scan) {
+    static int (*scanner)(char*, int, int, LineScan*) = NULL;
+    if (scanner == NULL) {
+	scanner = select_scanner();
+    }
+
+    int newline;
+    while ((newline = scanner(reader->buffer + reader->start, 
+	    reader->scanned, reader->end - reader->start, 
+	    &reader->scan)) < 0) {
+	reader->scanned = reader->end - reader->start;
+
+	// Move partial line to front of buffer, growing it if full
+	if (reader->start > 0) {
+	    memmove(reader->buffer, reader->buffer + reader->start, 
+		    reader->scanned);
+	    reader->start = 0;
+	    reader->end = reader->scanned;
+	} else if (reader->end == reader->size) {
+	    reader->size += reader->size;
+	    reader->buffer = realloc(reader->buffer, reader->size);
+	}
+
+	// Leave unread data in the socket for the new server
+	if (reader->wakeFd >= 0 && 
+		handover_requested(reader->fd, reader->wakeFd)) {
+	    reader->interrupted = 1;
+	    return NULL;
+	}
+
+	ssize_t received = read(reader->fd, reader->buffer + reader->end, 
+		reader->size - reader->end);
+
+	// Socket closed - return final unterminated line if any
+	if (received <= 0) {
+	    if (reader->scanned == 0) {
+		return NULL;
+	    }
+	    newline = reader->scanned;
+	    break;
+	}
+	reader->end += received;
+    }
+
+    char* line = malloc(newline + 1);
+    memcpy(line, reader->buffer + reader->start, newline);
+    line[newline] = '\0';
+    *scan = reader->scan;
+    scan->length = newline;
+
+    // Start scanning the next line
+    reader->start = newline < reader->end - reader->start ? 
+	    reader->start + newline + 1 : reader->end;
+    reader->scanned = 0;
+    reader->scan = (LineScan) {.length = 0, .commandEnd = -1, 
+	    .argumentSpace = -1, .argumentColon = -1};
+    return line;
+}
+
+/* park_client()
+ * -------------
+ * Stops the calling client handling thread so that its client can be handed
+ * over to a new server, leaving the client's socket open and no longer timed
+ * for idleness. The process exits once the handover is complete, so this 
+ * only returns if the handover fails, with the client timed again. Returns
+ * at once if the handover has already been abandoned.
+ *
+ * client: the client being handed over
+ * reader: the client's line reader, holding any unprocessed input
+ * info: struct containing the shared client info (used to access the list
+ * of parked clients and the required semaphore)
+ */
+void park_client(Client* client, LineReader* reader, SharedClientInfo* info) {
+    stop_idle_timer(info->wheel, client->idle);
+    client->idle = NULL;
+    ParkedClient* parked = malloc(sizeof(struct ParkedClient));
+    parked->client = *client;
+    parked->reader = *reader;
+    sem_init(&parked->resume, 0, 0);
+
+    take_lock(info->mutexLock);
+    if (info->handingOver) {
+	parked->next = info->parked;
+	info->parked = parked;
+	info->parkedCount++;
+    } else {
+	release_lock(&parked->resume);
+    }
+    release_lock(info->mutexLock);
+
+    // Handover failed - serve the client again
+    take_lock(&parked->resume);
+    sem_destroy(&parked->resume);
+    free(parked);
+    reader->interrupted = 0;
+    client->idle = start_idle_timer(info->wheel, reader->fd, 
+	    client->connection);
+}
+
+/* read_client_line()
+ * ------------------
+ * Reads the next line from the given client once it has credit to publish,
+ * parking the client while a hot restart is attempted.
+ *
+ * client: the client to read from
+ * reader: the client's line reader
+ * scan: set to the separators found in the line
+ * info: struct containing the shared client info
+ *
+ * Returns: the line, or NULL once the client has disconnected
+ */
+char* read_client_line(Client* client, LineReader* reader, LineScan* scan, 
+	SharedClientInfo* info) {
+    while (1) {
+	char* line = NULL;
+	if (wait_for_credit(client, reader, info)) {
+	    line = next_line(reader, scan);
+	}
+	if (line != NULL || !reader->interrupted) {
+	    return line;
+	}
+	park_client(client, reader, info);
+    }
+}
+
+/* client_thread()
+ * ---------------
+ * Thread handling function responsible for handling an individual client.
+ * Moves to the core handling the client's socket if server threads are 
+ * pinned, then repeatedly reads single lines from the client and handles 
+ * each line accordingly, updating statistics where necessary. Cleans up the
+ * client upon disconnection, including when reaped for idleness. 
+ *
+ * arg: the argument passed when creating the thread, in this case the struct
+ * containing the client's socket (or restored state) and the shared client 
+ * info
+ *
+ * Returns: will always return NULL
+ */
+void* client_thread(void* arg) {
+    ClientStart* start = (ClientStart*) arg;
+    SharedClientInfo* info = start->info;
+    Client client;
+    LineReader reader;
+    int bufferSize;
+    int cpu = place_client_thread(info->placement, start->fd);
+
+    // Client handed over from a previous server - state already restored 
+    // (and allocated where take_over() ran, see place_client_thread())
+    if (start->restored) {
+	client = start->client;
+	reader = start->reader;
+	bufferSize = start->bufferSize;
+	if (cpu != NO_CPU) {
+	    pin_thread(client.connection->writer, cpu);
+	}
+    } else {
+	int fd2 = dup(start->fd);
+	FILE* to = fdopen(start->fd, "w");
+	FILE* from = fdopen(fd2, "r");
+
+	bufferSize = INITIAL_BUFFER_SIZE;
+	char** subbedTopics = malloc(sizeof(char*) * bufferSize);
+
+	client = (Client) {.toClient = to, .fromClient = from, 
+		.connection = open_connection(to), 
+		.subbedTopics = subbedTopics, .subCount = 0};
+	init_line_reader(&reader, fd2, info->wakeFd);
+
+	take_lock(info->mutexLock);
+	register_connection(info->table, client.connection);
+	release_lock(info->mutexLock);
+    }
+    free(start);
+    client.idle = start_idle_timer(info->wheel, reader.fd, client.connection);
+    LineScan scan;
+
+    char* line;
+    while ((line = read_client_line(&client, &reader, &scan, info)) != NULL) {
+	currentTrace = trace_sample();
+	trace_point(currentTrace, TRACE_RECEIVE);
+	touch_idle_timer(info->wheel, client.idle);
+
+	// No second argument received
+	if (scan.commandEnd < 0) {
+    	    print_invalid(client);
+	    continue;
+	}
+
+	// Split at the first space, found when the line was read
+	line[scan.commandEnd] = '\0';
+	char* tokens[TWO_TOKENS] = {line, line + scan.commandEnd + 1};
+	trace_point(currentTrace, TRACE_PARSED);
+
+	// Handle "name <name>" message
+	if (!strcmp(tokens[0], "name")) {
+	    handle_name(&client, tokens[1], info); 
+
+	// Handle "sub <topic>" message
+	} else if (!strcmp(tokens[0], "sub")) {
+	    handle_sub(&client, tokens[1], info, &bufferSize, COUNT);
+	
+	// Handle "unsub <topic>" message
+	} else if (!strcmp(tokens[0], "unsub")) {
+	    handle_unsub(client, tokens[1], info, COUNT);
+	
+	// Handle "pub <topic> <values>" message - tokens[1] is left holding 
+	// the topic if the message is admitted
+	} else if (!strcmp(tokens[0], "pub")) {
+	    int admitted = handle_pub(client, tokens[1], &scan, info);
+	    account_publish(&client, admitted, tokens[1], scan.length, info);
+
+	    // Nothing refers to a published line once it has been handled
+	    free(line);
+
+	// Handle "req <topic> <correlation> <value>" message
+	} else if (!strcmp(tokens[0], "req")) {
+	    int admitted = handle_req(client, tokens[1], &scan, info);
+	    account_publish(&client, admitted, tokens[1], scan.length, info);
+	    free(line);
+
+	// Handle "rep <reply address> <value>" message
+	} else if (!strcmp(tokens[0], "rep")) {
+	    handle_rep(client, tokens[1], &scan, info);
+	    free(line);
+
+	// Handle "prio <topic> <priority>" message
+	} else if (!strcmp(tokens[0], "prio")) {
+	    handle_prio(client, tokens[1], info);
+
+	// Handle "compress <codec>" message
+	} else if (!strcmp(tokens[0], "compress")) {
+	    handle_compress(client, tokens[1]);
+
+	// Handle "credit <on|off>" message
+	} else if (!strcmp(tokens[0], "credit")) {
+	    handle_credit(&client, tokens[1]);
+
+	// Handle "pong <tick>" keepalive reply - already recorded as activity
+	} else if (!strcmp(tokens[0], "pong")) {
+	    free(line);
+   
+	// Message invalid
+	} else {
+	    print_invalid(client);
+	}
+    }
+
+    free(reader.buffer);
+    clean_up_client(client, info);
+    return NULL;
+}
+
+/* sig_thread()
+ * ------------
+ * Thread handling function responsible for handling the SIGHUP and SIGUSR1
+ * signals. Repeatedly waits until a signal is received and, upon receipt of
+ * SIGHUP, prints relevant statistics, or upon receipt of SIGUSR1, dumps the
+ * recorded trace events.
+ *
+ * arg: the argument passed when creating the thread, in this case the struct
+ * containing the shared client info (used to retrieve statistics)
+ *
+ * Reference: this code was adapted from the pthread_sigmask(3) man page
+ */
+static void* sig_thread(void* arg) {
+    SharedClientInfo* info = (SharedClientInfo*) arg;
+    int sig;
+
+    // Repeatedly wait for SIGHUP or SIGUSR1 signal
+    while (1) {
+	sigwait(info->set, &sig);
+	if (sig == SIGUSR1) {
+	    dump_trace();
+	    continue;
+	}
+	take_lock(info->mutexLock);
+
+	// Print statistics
+	fprintf(stderr, "Connected clients:%d\nCompleted clients:%d\n"
+		"pub operations:%d\nsub operations:%d\nunsub operations:%d\n"
+		"Reaped clients:%d\nreq operations:%d\nrep operations:%d\n"
+		"Rate limited rejects:%d\nRate limited delays:%d\n"
+		"Rate limited drops:%d\nQueue overflow drops:%d\n"
+		"Queue overflow disconnects:%d\n", 
+		info->currentConnections, 
+		info->totalConnections,
+		info->totalPub,
+		info->totalSub,
+		info->totalUnsub,
+		info->totalReaped,
+		info->totalReq,
+		info->totalRep,
+		info->totalLimitRejects,
+		info->totalLimitDelays,
+		info->totalLimitDrops,
+		queueDrops,
+		queueDisconnects);
+	fflush(stderr);
+	release_lock(info->mutexLock);
+    }
+    return NULL;
+}
+
+/* print_port()
+ * ------------
+ * Prints the port number of the given listening socket.
+ *
+ * listenFD: the listening socket file descriptor
+ *
+ * Errors: the program will exit with status 2 if the port number could not
+ * be determined
+ */
+void print_port(int listenFD) {
+    struct sockaddr_in ad;
+    memset(&ad, 0, sizeof(struct sockaddr_in));
+    socklen_t len = sizeof(struct sockaddr_in);
+    if (getsockname(listenFD, (struct sockaddr*) &ad, &len)) {
+	socket_error();
+    }
+    fprintf(stderr, "%u\n", ntohs(ad.sin_port));
+    fflush(stderr);
+}
+
+/* put_bytes()
+ * -----------
+ * Appends the given bytes to the given snapshot, growing it if required.
+ *
+ * snapshot: the snapshot to append to
+ * bytes: the bytes to append
+ * length: the number of bytes to append
+ */
+void put_bytes(Snapshot* snapshot, const void* bytes, int length) {
+    if (snapshot->length + length > snapshot->size) {
+	snapshot->size = (snapshot->length + length) * 2;
+	snapshot->data = realloc(snapshot->data, snapshot->size);
+    }
+    memcpy(snapshot->data + snapshot->length, bytes, length);
+    snapshot->length += length;
+}
+
+/* put_int()
+ * ---------
+ * Appends the given integer to the given snapshot.
+ *
+ * snapshot: the snapshot to append to
+ * value: the integer to append
+ */
+void put_int(Snapshot* snapshot, int value) {
+    put_bytes(snapshot, &value, sizeof(int));
+}
+
+/* put_string()
+ * ------------
+ * Appends the given string, preceded by its length, to the given snapshot.
+ *
+ * snapshot: the snapshot to append to
+ * str: the string to append (may be NULL)
+ */
+void put_string(Snapshot* snapshot, char* str) {
+    if (str == NULL) {
+	put_int(snapshot, -1);
+	return;
+    }
+    put_int(snapshot, strlen(str));
+    put_bytes(snapshot, str, strlen(str));
+}
+
+/* get_int()
+ * ---------
+ * Takes the next integer from the given snapshot.
+ *
+ * snapshot: the snapshot to read from
+ *
+ * Returns: the integer
+ */
+int get_int(Snapshot* snapshot) {
+    int value;
+    memcpy(&value, snapshot->data + snapshot->position, sizeof(int));
+    snapshot->position += sizeof(int);
+    return value;
+}
+
+/* get_string()
+ * ------------
+ * Takes the next length-prefixed string from the given snapshot.
+ *
+ * snapshot: the snapshot to read from
+ * length: if not NULL, set to the length of the string
+ *
+ * Returns: the string in newly allocated memory, or NULL if a NULL string
+ * was appended
+ */
+char* get_string(Snapshot* snapshot, int* length) {
+    int stringLength = get_int(snapshot);
+    if (length != NULL) {
+	*length = stringLength < 0 ? 0 : stringLength;
+    }
+    if (stringLength < 0) {
+	return NULL;
+    }
+    char* str = malloc(stringLength + 1);
+    memcpy(str, snapshot->data + snapshot->position, stringLength);
+    str[stringLength] = '\0';
+    snapshot->position += stringLength;
+    return str;
+}
+
+/* send_record()
+ * -------------
+ * Sends one record of a hot restart to the new server: a header containing
+ * the record type and payload length, optionally carrying a file descriptor,
+ * followed by the payload.
+ *
+ * sock: the Unix domain socket connected to the new server
+ * type: the type of record
+ * payload: the record's payload (may be NULL if empty)
+ * fd: the file descriptor to pass, or -1 if none
+ *
+ * Returns: 0 if the record was sent, else -1
+ */
+int send_record(int sock, int type, Snapshot* payload, int fd) {
+    int header[TWO_TOKENS] = {type, payload == NULL ? 0 : payload->length};
+    struct iovec iov = {.iov_base = header, .iov_len = sizeof(header)};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    // Attach file descriptor to the header
+    if (fd >= 0) {
+	memset(control, 0, sizeof(control));
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    if (sendmsg(sock, &msg, 0) != sizeof(header)) {
+	return -1;
+    }
+
+    // Send payload
+    int sent = 0;
+    while (payload != NULL && sent < payload->length) {
+	ssize_t written = write(sock, payload->data + sent, 
+		payload->length - sent);
+	if (written <= 0) {
+	    return -1;
+	}
+	sent += written;
+    }
+    return 0;
+}
+
+/* receive_record()
+ * ----------------
+ * Receives one record of a hot restart from the previous server.
+ *
+ * sock: the Unix domain socket connected to the previous server
+ * payload: filled with the record's payload
+ * fd: set to the file descriptor passed with the record, or -1 if none
+ *
+ * Returns: the type of record, or -1 if the connection failed
+ */
+int receive_record(int sock, Snapshot* payload, int* fd) {
+    int header[TWO_TOKENS];
+    char control[CMSG_SPACE(sizeof(int))];
+    int received = 0;
+    *fd = -1;
+
+    // Receive header, and the file descriptor attached to its first byte
+    while (received < (int) sizeof(header)) {
+	struct iovec iov = {.iov_base = (char*) header + received, 
+		.iov_len = sizeof(header) - received};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t count = recvmsg(sock, &msg, 0);
+	if (count <= 0) {
+	    return -1;
+	}
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) {
+	    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	received += count;
+    }
+
+    // Receive payload
+    payload->length = header[1];
+    payload->size = header[1];
+    payload->position = 0;
+    payload->data = malloc(header[1] + 1);
+    received = 0;
+    while (received < header[1]) {
+	ssize_t count = read(sock, payload->data + received, 
+		header[1] - received);
+	if (count <= 0) {
+	    return -1;
+	}
+	received += count;
+    }
+    return header[0];
 }
 
-/* handle_sub()
- * ------------
- * Adds the given client to the given topic's linked list of subscribed 
- * clients (or creates one if none exists). Updates relevant statistics. 
- * Ignores if the client does not have a name or the topic is invalid. 
+/* find_subscription()
+ * -------------------
+ * Finds the given client's subscription to the given topic or consumer 
+ * group. Must be called with the mutex lock held.
  *
- * client: the client to be added to the linked list
- * topic: the topic being subscribed to
  * info: struct containing the shared client info (used to access the 
- * StringMap of topics and their subscribed clients, the required semaphore, 
- * and the relevant statistics)
+ * StringMaps of topics and their subscribed clients and groups)
+ * client: the client whose subscription is to be found
+ * spec: the subscribed topic, or "$group/<group> <topic>"
+ *
+ * Returns: the subscription, or NULL if the client is not subscribed
  */
-void handle_sub(Client* client, char* topic, SharedClientInfo* info, 
-	int* bufferSize) {
-    // Invalid topic
-    if (!check_spaces_colons_empty(topic)) {
-	print_invalid(*client);
+Subscriber* find_subscription(SharedClientInfo* info, Client client, 
+	char* spec) {
+    SubscriberArray* members;
+    if (is_group_spec(spec)) {
+	char* copy = strdup(spec);
+	char* name;
+	char* topic;
+	parse_group_spec(copy, &name, &topic);
+	ConsumerGroup* group = find_group(stringmap_search(info->groups, 
+		topic), name);
+	members = group == NULL ? NULL : &group->members;
+	free(copy);
+    } else {
+	members = stringmap_search(info->sm, spec);
+    }
 
-    // Name has been set
-    } else if (client->name != NULL) {
-	ClientNode* item;
-	take_lock(info->mutexLock);
+    int index = members == NULL ? -1 : 
+	    find_subscriber(members, client.connection);
+    return index < 0 ? NULL : &members->subscribers[index];
+}
 
-	// First client to subscribe to topic - create new linked list
-	if (!(item = stringmap_search(info->sm, topic))) {
-	    ClientNode* head = malloc(sizeof(struct ClientNode));
-	    head->client = *client;
-	    head->next = NULL;
-	    stringmap_add(info->sm, topic, head);
-	    add_subscribed_topic(client, bufferSize, topic);
-	    info->totalSub++;
+/* snapshot_client()
+ * -----------------
+ * Serialises the state of a parked client: its name, connection ID, 
+ * negotiated compression, publish credit, last message sent (the dictionary
+ * for its next compressed message), messages queued but not yet sent, 
+ * subscriptions with their priorities, and any input not yet processed. 
+ * Must be called with the mutex lock held and the client's writer thread 
+ * stopped.
+ *
+ * info: struct containing the shared client info (used to look up the 
+ * client's subscriptions)
+ * parked: the parked client
+ * snapshot: the snapshot to append to
+ */
+void snapshot_client(SharedClientInfo* info, ParkedClient* parked, 
+	Snapshot* snapshot) {
+    Client client = parked->client;
+    Connection* connection = client.connection;
+    put_string(snapshot, client.name);
+    put_int(snapshot, connection->slot);
+    put_int(snapshot, connection->serial);
+    put_int(snapshot, connection->compression);
+    put_int(snapshot, client.credit.enabled);
+    put_int(snapshot, client.credit.outstanding);
+    put_string(snapshot, connection->lastSent == NULL ? NULL : 
+	    connection->lastSent->text);
 
-	// Linked list already exists - add to it
-	} else {
-	    ClientNode* temp = item;
-
-	    // Check if client already subscribed to topic
-	    int alreadySubbed = 0;
-	    while (temp != NULL) {
-		if (temp->client.toClient == client->toClient) {
-		    alreadySubbed = 1;
-		    break;
-		}
-		temp = temp->next;
-	    }
+    // Unsent messages, marking a ":compress" confirmation not yet sent
+    put_int(snapshot, connection->switchCompression);
+    for (int lane = 0; lane < NUM_PRIORITIES; lane++) {
+	int count = 0;
+	QueuedMessage* queued;
+	for (queued = connection->laneHead[lane]; queued != NULL; 
+		queued = queued->next) {
+	    count++;
+	}
+	put_int(snapshot, count);
+	for (queued = connection->laneHead[lane]; queued != NULL; 
+		queued = queued->next) {
+	    put_string(snapshot, queued->message->text);
+	    put_int(snapshot, queued->message == connection->switchMessage);
+	}
+    }
 
-	    // Add to head of list
-	    if (!alreadySubbed) {
-		ClientNode* newHead = malloc(sizeof(struct ClientNode));
-		newHead->client = *client;
-		newHead->next = item;
-		stringmap_remove(info->sm, topic);
-		stringmap_add(info->sm, topic, newHead);
-		add_subscribed_topic(client, bufferSize, topic);
-		info->totalSub++;
-	    }
+    // Subscriptions - skipping topics since unsubscribed from
+    Snapshot subscriptions = {.data = NULL, .length = 0, .size = 0};
+    int count = 0;
+    for (int i = 0; i < client.subCount; i++) {
+	Subscriber* subscriber = find_subscription(info, client, 
+		client.subbedTopics[i]);
+	if (subscriber != NULL) {
+	    put_string(&subscriptions, client.subbedTopics[i]);
+	    put_int(&subscriptions, subscriber->priority);
+	    count++;
 	}
-	release_lock(info->mutexLock);
     }
+    put_int(snapshot, count);
+    put_bytes(snapshot, subscriptions.data, subscriptions.length);
+    free(subscriptions.data);
+
+    // Unprocessed input
+    LineReader* reader = &parked->reader;
+    put_int(snapshot, reader->end - reader->start);
+    put_bytes(snapshot, reader->buffer + reader->start, 
+	    reader->end - reader->start);
 }
 
-/* handle_unsub()
- * --------------
- * Removes the given client from the given topic's linked list of subscribed 
- * clients. Updates relevant statistics. Ignores if the client does not have a 
- * name or the topic is invalid or the client is not subscribed to the topic.
+/* send_handover()
+ * ---------------
+ * Sends the listening socket, topic priorities, every parked client and the
+ * statistics to the new server, ending with HANDOVER_END. Must be called 
+ * with the mutex lock held, every client parked and their writer threads 
+ * stopped.
  *
- * client: the client to be added to the linked list
- * topic: the topic being subscribed to
- * info: struct containing the shared client info (used to access the 
- * StringMap of topics and their subscribed clients, the required semaphore, 
- * and the relevant statistics)
- * countStat: integer value representing whether or not a successful unsub
- * should be counted in the statistics
+ * sock: the Unix domain socket connected to the new server
+ * info: struct containing the shared client info
+ *
+ * Returns: 0 if everything was sent, else -1
  */
-void handle_unsub(Client client, char* topic, SharedClientInfo* info, 
-	int countStat) {
-    // Invalid topic
-    if (!check_spaces_colons_empty(topic)) {
-	print_invalid(client);
+int send_handover(int sock, SharedClientInfo* info) {
+    if (send_record(sock, HANDOVER_LISTEN, NULL, info->fdServer) < 0) {
+	return -1;
+    }
 
-    // Name has been set
-    } else if (client.name != NULL) {
-	ClientNode* item;
-	take_lock(info->mutexLock);
+    // Topic priorities
+    StringMapItem* item = NULL;
+    while ((item = stringmap_iterate(info->priorities, item)) != NULL) {
+	Snapshot snapshot = {.data = NULL, .length = 0, .size = 0};
+	put_string(&snapshot, item->key);
+	put_int(&snapshot, *((int*) item->item));
+	int sent = send_record(sock, HANDOVER_PRIORITY, &snapshot, -1);
+	free(snapshot.data);
+	if (sent < 0) {
+	    return -1;
+	}
+    }
 
-	// List exists
-	if ((item = stringmap_search(info->sm, topic)) != NULL) {
-	    ClientNode* temp = item;
-	    ClientNode* prev;
+    // Clients
+    for (ParkedClient* parked = info->parked; parked != NULL; 
+	    parked = parked->next) {
+	Snapshot snapshot = {.data = NULL, .length = 0, .size = 0};
+	snapshot_client(info, parked, &snapshot);
+	int sent = send_record(sock, HANDOVER_CLIENT, &snapshot, 
+		fileno(parked->client.toClient));
+	free(snapshot.data);
+	if (sent < 0) {
+	    return -1;
+	}
+    }
 
-	    // Client is at head of list
-	    if (temp->client.toClient == client.toClient) {
-		ClientNode* newHead = temp->next;
-		stringmap_remove(info->sm, topic);
-		stringmap_add(info->sm, topic, newHead);
-		free(temp);
-		if (countStat) {
-		    info->totalUnsub++;
-		}
+    // Statistics
+    Snapshot stats = {.data = NULL, .length = 0, .size = 0};
+    put_int(&stats, info->totalConnections);
+    put_int(&stats, info->totalPub);
+    put_int(&stats, info->totalSub);
+    put_int(&stats, info->totalUnsub);
+    put_int(&stats, info->totalReaped);
+    put_int(&stats, info->totalReq);
+    put_int(&stats, info->totalRep);
+    put_int(&stats, info->table->nextSerial);
+    put_int(&stats, info->totalLimitRejects);
+    put_int(&stats, info->totalLimitDelays);
+    put_int(&stats, info->totalLimitDrops);
+    put_int(&stats, queueDrops);
+    put_int(&stats, queueDisconnects);
+    int sent = send_record(sock, HANDOVER_STATS, &stats, -1);
+    free(stats.data);
+    if (sent < 0) {
+	return -1;
+    }
+    return send_record(sock, HANDOVER_END, NULL, -1);
+}
 
-	    // Iterate through list until client is found
-	    } else {
-		while (temp != NULL && 
-			temp->client.toClient != client.toClient) {
-		    prev = temp;
-		    temp = temp->next;
-		}
+/* abandon_handover()
+ * ------------------
+ * Goes back to serving every client after a failed handover: restarts the 
+ * writer threads stopped for the handover, wakes every parked client 
+ * handling thread and the accept loop. Must be called with the mutex lock
+ * held, which is released.
+ *
+ * info: struct containing the shared client info
+ */
+void abandon_handover(SharedClientInfo* info) {
+    // Take back the wake signal so that readers stop parking
+    char signal;
+    while (read(info->wakeFd, &signal, 1) < 0 && errno == EINTR) {
+    }
 
-		// Client found in list
-		if (temp != NULL && countStat) {
-		    info->totalUnsub++;
-		
-	    	    // Remove client from list
-	    	    prev->next = temp->next;
-	    	    free(temp);
-	    	    free(prev);
-		}
-	    }
-	}
-	release_lock(info->mutexLock);
+    ParkedClient* parked = info->parked;
+    while (parked != NULL) {
+	ParkedClient* next = parked->next;
+	restart_writer(parked->client.connection);
+	release_lock(&parked->resume);
+	parked = next;
     }
+    info->parked = NULL;
+    info->parkedCount = 0;
+    info->handingOver = 0;
+    release_lock(info->mutexLock);
+    release_lock(info->acceptResume);
+
+    fprintf(stderr, "psserver: handover failed, still serving\n");
+    fflush(stderr);
 }
 
-/* handle_pub()
- * ------------
- * Publishes the given value from the given client to all clients subscribed
- * to the given topic. Updates relevant statistics. Ignores if the topic or
- * value are invalid or the client does not have a name or there are no clients
- * subscribed to the topic.
+/* hand_over()
+ * -----------
+ * Hands the listening socket, every client's socket and the topic registry
+ * over to a new server connected to the given socket, then exits once the 
+ * new server has acknowledged them. Stops accepting connections, waits up
+ * to HANDOVER_PARK_MILLISECONDS for every client handling thread to park 
+ * (clients already disconnecting are not handed over, and lose anything 
+ * they have not yet been sent when this server exits) and stops every 
+ * writer thread at a message boundary, giving them 
+ * HANDOVER_STOP_MILLISECONDS in total before disconnecting clients that 
+ * are not reading. Then holds the mutex lock 
+ * while each client's state, including its unsent messages, is sent. If 
+ * anything could not be sent, a client handling thread did not park in 
+ * time or the new server does not acknowledge the handover, carries on 
+ * serving every client instead.
  *
- * client: the client to publish the message
- * topicAndValue: string containing the topic to publish to and the value to
- * publish
- * info: struct containing the shared client info (used to access the 
- * StringMap of topics and their subscribed clients, the required semaphore, 
- * and the relevant statistics)
+ * sock: the Unix domain socket connected to the new server
+ * info: struct containing the shared client info
  */
-void handle_pub(Client client, char* topicAndValue, SharedClientInfo* info) {
-    char** pubTokens = split_by_char(topicAndValue, ' ', TWO_TOKENS);
-    char* topic = pubTokens[0];
-    char* value = pubTokens[1];
-
-    // Invalid topic or publish message
-    if (topic == NULL || !check_spaces_colons_empty(topic) || 
-	    value == NULL || !strcmp(value, "")) {
-	print_invalid(client);
+void hand_over(int sock, SharedClientInfo* info) {
+    // Wake the accept loop and every client thread
+    take_lock(info->mutexLock);
+    info->handingOver = 1;
+    release_lock(info->mutexLock);
+    if (write(info->wakeSignal, "x", 1) != 1) {
+	take_lock(info->mutexLock);
+	info->handingOver = 0;
+	release_lock(info->mutexLock);
+	fprintf(stderr, "psserver: unable to start handover\n");
+	fflush(stderr);
+	return;
+    }
+    take_lock(info->acceptParked);
 
-    // Name has been set
-    } else if (client.name != NULL) {
+    // Wait until every connected client has parked or is leaving - one 
+    // held up handling a line abandons the handover
+    struct timespec began;
+    clock_gettime(CLOCK_MONOTONIC, &began);
+    while (1) {
 	take_lock(info->mutexLock);
-	ClientNode* item;
-
-	// At least one client is subscribed
-	if ((item = stringmap_search(info->sm, topic))) {
-	    ClientNode* temp = malloc(sizeof(struct ClientNode));
-	    temp->client = item->client;
-	    temp->next = item->next;
-
-	    // Print to each subscribed client
-	    while (temp != NULL) {
-		fprintf(temp->client.toClient, 
-			"%s:%s:%s\n", client.name, topic, value);
-		fflush(temp->client.toClient);
-		temp = temp->next;
-	    }
-	    free(temp);
+	if (info->parkedCount + info->leavingCount == 
+		info->currentConnections) {
+	    break;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((now.tv_sec - began.tv_sec) * MILLISECONDS_PER_SECOND + 
+		(now.tv_nsec - began.tv_nsec) / NANOSECONDS_PER_MILLISECOND >
+		HANDOVER_PARK_MILLISECONDS) {
+	    fprintf(stderr, "psserver: %d of %d clients did not stop for "
+		    "the handover\n", info->currentConnections - 
+		    info->parkedCount - info->leavingCount, 
+		    info->currentConnections);
+	    abandon_handover(info);
+	    return;
 	}
-	info->totalPub++;
 	release_lock(info->mutexLock);
+	usleep(HANDOVER_POLL_MICROSECONDS);
+    }
+
+    // Stop writing without the mutex lock, which a stuck writer would hold
+    // up - parked clients cannot be sent anything new meanwhile
+    release_lock(info->mutexLock);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += HANDOVER_STOP_MILLISECONDS * 
+	    NANOSECONDS_PER_MILLISECOND;
+    deadline.tv_sec += deadline.tv_nsec / NANOSECONDS_PER_SECOND;
+    deadline.tv_nsec %= NANOSECONDS_PER_SECOND;
+    for (ParkedClient* parked = info->parked; parked != NULL; 
+	    parked = parked->next) {
+	stop_writer(parked->client.connection);
+    }
+    for (ParkedClient* parked = info->parked; parked != NULL; 
+	    parked = parked->next) {
+	wait_for_writer(parked->client.connection, &deadline);
+    }
+    take_lock(info->mutexLock);
+
+    // Sockets stay open in the new server once it has them all
+    Snapshot ack = {.data = NULL};
+    int fd;
+    if (send_handover(sock, info) == 0 && 
+	    receive_record(sock, &ack, &fd) == HANDOVER_ACK) {
+	exit(0);
     }
+    free(ack.data);
+    abandon_handover(info);
 }
 
-/* clean_up_client()
+/* same_user()
+ * -----------
+ * Checks that the process at the other end of the given Unix domain socket
+ * is running as the same user as this server.
+ *
+ * sock: the connected socket
+ *
+ * Returns: 1 if the peer's user ID matches ours, else 0
+ */
+int same_user(int sock) {
+    struct ucred peer;
+    socklen_t length = sizeof(struct ucred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &peer, &length) < 0) {
+	return 0;
+    }
+    return peer.uid == getuid();
+}
+
+/* handover_thread()
  * -----------------
- * For the given client, unsubscribes from all subscribed topics, frees 
- * relevant memory, closes relevant file pointers and update relevant 
- * statistics.
+ * Thread handling function responsible for hot restarts. Repeatedly waits 
+ * for a new server to connect to the handover socket, then hands over to 
+ * it. Connections from processes run by other users are closed without a
+ * handover. Only carries on waiting if a handover fails.
  *
- * client: the client to clean up
- * info: struct containing the shared client info (used to access the required 
- * semaphores and the relevant statistics)
+ * arg: the argument passed when creating the thread, in this case the 
+ * struct containing the shared client info
+ *
+ * Returns: never returns
  */
-void clean_up_client(Client client, SharedClientInfo* info) {
-    // Unsub from each subscribed topic
-    for (int i = 0; i < client.subCount; i++) {
-	handle_unsub(client, client.subbedTopics[i], info, DONT_COUNT);	
+void* handover_thread(void* arg) {
+    SharedClientInfo* info = (SharedClientInfo*) arg;
+    while (1) {
+	int sock = accept(info->handoverFd, NULL, NULL);
+	if (sock >= 0) {
+	    if (same_user(sock)) {
+		hand_over(sock, info);
+	    }
+	    close(sock);
+	}
     }
+    return NULL;
+}
 
-    // Free memory
-    free(client.subbedTopics);
+/* open_handover()
+ * ---------------
+ * Listens on the Unix domain socket at the given path for a new server to 
+ * hand over to, and starts the thread that waits for it. The socket is
+ * created accessible only to the user running the server, since whoever
+ * connects to it is handed every client's connection.
+ *
+ * path: the path of the handover socket
+ * info: struct containing the shared client info
+ *
+ * Errors: the program will exit with status 2 if the socket could not be 
+ * opened
+ */
+void open_handover(char* path, SharedClientInfo* info) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
 
-    // Close file pointers 
-    fclose(client.toClient);
-    fclose(client.fromClient);   
+    info->handoverFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    mode_t mask = umask(S_IRWXG | S_IRWXO);
+    int bound = bind(info->handoverFd, (struct sockaddr*) &addr, 
+	    sizeof(struct sockaddr_un));
+    umask(mask);
+    if (bound < 0 || listen(info->handoverFd, 1) < 0) {
+	socket_error();
+    }
 
-    // Update statistics
-    take_lock(info->mutexLock);
-    info->currentConnections--;
-    info->totalConnections++;
-    release_lock(info->mutexLock);
-    release_lock(info->threadLock);
+    pthread_t threadID;
+    pthread_create(&threadID, NULL, handover_thread, info);
+    pthread_detach(threadID);
 }
 
-/* client_thread()
- * ---------------
- * Thread handling function responsible for handling an individual client.
- * Repeatedly reads single lines from the client and handles each line 
- * accordingly, updating statistics where necessary. Cleans up the client upon
- * disconnection. 
+/* restore_client()
+ * ----------------
+ * Recreates a client handed over by a previous server from its serialised 
+ * state, resubscribing it to its topics and consumer groups without counting
+ * the subscriptions in the statistics.
  *
- * arg: the argument passed when creating the thread, in this case the struct
- * containing the shared client info
+ * info: struct containing the shared client info
+ * snapshot: the client's serialised state
+ * fd: the client's socket
  *
- * Returns: will always return NULL
+ * Returns: the start of the client's handling thread
  */
-void* client_thread(void* arg) {
-    SharedClientInfo* info = (SharedClientInfo*) arg;
-    int fd2 = dup(info->fd);
-    FILE* to = fdopen(info->fd, "w");
-    FILE* from = fdopen(fd2, "r");
-
-    int bufferSize = INITIAL_BUFFER_SIZE;
-    char** subbedTopics = malloc(sizeof(char*) * bufferSize);
+ClientStart* restore_client(SharedClientInfo* info, Snapshot* snapshot, 
+	int fd) {
+    ClientStart* start = malloc(sizeof(struct ClientStart));
+    start->info = info;
+    start->fd = fd;
+    start->restored = 1;
+    start->bufferSize = INITIAL_BUFFER_SIZE;
 
-    Client client = {.toClient = to, .fromClient = from, 
-	    .subbedTopics = subbedTopics, .subCount = 0};
+    int fd2 = dup(fd);
+    FILE* to = fdopen(fd, "w");
+    FILE* from = fdopen(fd2, "r");
+    Client* client = &start->client;
+    *client = (Client) {.toClient = to, .fromClient = from, 
+	    .connection = open_connection(to), 
+	    .subbedTopics = malloc(sizeof(char*) * start->bufferSize), 
+	    .subCount = 0};
 
+    client->name = get_string(snapshot, NULL);
+    int slot = get_int(snapshot);
+    unsigned int serial = get_int(snapshot);
     take_lock(info->mutexLock);
-    info->currentConnections++;
+    restore_connection(info->table, client->connection, slot, serial);
     release_lock(info->mutexLock);
+    if (client->name != NULL) {
+	assign_rate_limit(client, info);
+    }
+    client->connection->compression = get_int(snapshot);
+    client->credit.enabled = get_int(snapshot);
+    client->credit.outstanding = get_int(snapshot);
+    char* lastSent = get_string(snapshot, NULL);
+    if (lastSent != NULL) {
+	client->connection->lastSent = create_message(lastSent);
+    }
 
-    char* line;
-    while ((line = read_line(from)) != NULL) {
-	char** tokens = split_by_char(line, ' ', TWO_TOKENS);
-
-	// No second argument received
-	if (tokens[1] == NULL) {
-    	    print_invalid(client);
-	    continue;
+    // Unsent messages, in their original lanes and order
+    Connection* connection = client->connection;
+    connection->switchCompression = get_int(snapshot);
+    for (int lane = 0; lane < NUM_PRIORITIES; lane++) {
+	int queued = get_int(snapshot);
+	for (int i = 0; i < queued; i++) {
+	    Message* message = create_message(get_string(snapshot, NULL));
+	    take_lock(&connection->queueLock);
+	    if (get_int(snapshot)) {
+		connection->switchMessage = message;
+	    }
+	    append_to_lane(connection, message, lane);
+	    release_lock(&connection->queueLock);
+	    release_lock(&connection->pending);
+	    release_message(message);
 	}
+    }
 
-	// Handle "name <name>" message
-	if (!strcmp(tokens[0], "name")) {
-	    handle_name(&client, tokens[1]); 
-
-	// Handle "sub <topic>" message
-	} else if (!strcmp(tokens[0], "sub")) {
-	    handle_sub(&client, tokens[1], info, &bufferSize);
-	
-	// Handle "unsub <topic>" message
-	} else if (!strcmp(tokens[0], "unsub")) {
-	    handle_unsub(client, tokens[1], info, COUNT);
-	
-	// Handle "pub <topic> <values>" message
-	} else if (!strcmp(tokens[0], "pub")) {
-	    handle_pub(client, tokens[1], info);
-   
-	// Message invalid
-	} else {
-	    print_invalid(client);
+    // Resubscribe with the same priorities
+    char* priorityNames[] = {"high", "normal", "low"};
+    int count = get_int(snapshot);
+    for (int i = 0; i < count; i++) {
+	char* spec = get_string(snapshot, NULL);
+	int priority = get_int(snapshot);
+	if (priority != PRIORITY_TOPIC) {
+	    char* withPriority = malloc(strlen(spec) + 
+		    strlen(priorityNames[priority]) + 2);
+	    sprintf(withPriority, "%s %s", spec, priorityNames[priority]);
+	    free(spec);
+	    spec = withPriority;
 	}
+	handle_sub(client, spec, info, &start->bufferSize, DONT_COUNT);
     }
-    clean_up_client(client, info);
-    return NULL;
+
+    // Unprocessed input
+    LineReader* reader = &start->reader;
+    init_line_reader(reader, fd2, info->wakeFd);
+    int pendingLength;
+    char* pending = get_string(snapshot, &pendingLength);
+    if (pendingLength > reader->size) {
+	reader->size = pendingLength;
+	reader->buffer = realloc(reader->buffer, reader->size);
+    }
+    memcpy(reader->buffer, pending, pendingLength);
+    reader->end = pendingLength;
+    free(pending);
+    return start;
 }
 
-/* sig_thread()
- * ------------
- * Thread handling function responsible for handling the SIGHUP signal.
- * Repeatedly waits until a SIGHUP signal is received and, upon receipt, 
- * prints relevant statistics.
+/* take_over()
+ * -----------
+ * Connects to the handover socket of a running server at the given path and
+ * takes over its listening socket, clients and topic registry, then starts a
+ * handling thread for each client. Prints the port number as if it had been
+ * opened for listening, and the time taken by the handover.
  *
- * arg: the argument passed when creating the thread, in this case the struct
- * containing the shared client info (used to retrieve statistics)
+ * path: the path of the previous server's handover socket
+ * info: struct containing the shared client info
  *
- * Reference: this code was adapted from the pthread_sigmask(3) man page
+ * Returns: the listening socket file descriptor
+ * Errors: the program will exit with status 2 if the handover socket could
+ * not be connected to or the handover did not complete
  */
-static void* sig_thread(void* arg) {
-    SharedClientInfo* info = (SharedClientInfo*) arg;
-    int sig;
+int take_over(char* path, SharedClientInfo* info) {
+    struct timespec began;
+    clock_gettime(CLOCK_MONOTONIC, &began);
 
-    // Repeatedly wait for SIGHUP signal
-    while (1) {
-	sigwait(info->set, &sig);
-	take_lock(info->mutexLock);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(sock, (struct sockaddr*) &addr, 
+	    sizeof(struct sockaddr_un)) < 0) {
+	socket_error();
+    }
 
-	// Print statistics
-	fprintf(stderr, "Connected clients:%d\nCompleted clients:%d\n"
-		"pub operations:%d\nsub operations:%d\nunsub operations:%d\n", 
-		info->currentConnections, 
-		info->totalConnections,
-		info->totalPub,
-		info->totalSub,
-		info->totalUnsub);
-	fflush(stderr);
+    int listenFD = -1;
+    int clientCount = 0;
+    ClientStart** clients = NULL;
+    Snapshot snapshot;
+    int fd;
+    int type;
+    while ((type = receive_record(sock, &snapshot, &fd)) != HANDOVER_END) {
+	if (type < 0) {
+	    socket_error(); // Previous server failed mid-handover
+	} else if (type == HANDOVER_LISTEN) {
+	    listenFD = fd;
+	    print_port(listenFD);
+	} else if (type == HANDOVER_PRIORITY) {
+	    char* topic = get_string(&snapshot, NULL);
+	    int* priority = malloc(sizeof(int));
+	    *priority = get_int(&snapshot);
+	    stringmap_add(info->priorities, topic, priority);
+	    free(topic);
+	} else if (type == HANDOVER_CLIENT) {
+	    clients = realloc(clients, sizeof(ClientStart*) * 
+		    (clientCount + 1));
+	    clients[clientCount++] = restore_client(info, &snapshot, fd);
+	} else if (type == HANDOVER_STATS) {
+	    info->totalConnections = get_int(&snapshot);
+	    info->totalPub = get_int(&snapshot);
+	    info->totalSub = get_int(&snapshot);
+	    info->totalUnsub = get_int(&snapshot);
+	    info->totalReaped = get_int(&snapshot);
+	    info->totalReq = get_int(&snapshot);
+	    info->totalRep = get_int(&snapshot);
+	    info->table->nextSerial = get_int(&snapshot);
+	    info->totalLimitRejects = get_int(&snapshot);
+	    info->totalLimitDelays = get_int(&snapshot);
+	    info->totalLimitDrops = get_int(&snapshot);
+	    queueDrops = get_int(&snapshot);
+	    queueDisconnects = get_int(&snapshot);
+	}
+	free(snapshot.data);
+    }
+    free(snapshot.data);
+
+    // Previous server exits once acknowledged - if it has already gone, 
+    // serve its clients regardless
+    send_record(sock, HANDOVER_ACK, NULL, -1);
+    close(sock);
+
+    // Every client is subscribed - start serving them, even beyond the 
+    // connection limit, in which case the slots are owed until enough leave
+    for (int i = 0; i < clientCount; i++) {
+	take_lock(info->mutexLock);
+	if (info->connections > 0 && sem_trywait(info->threadLock) < 0) {
+	    info->slotDebt++;
+	}
+	info->currentConnections++;
 	release_lock(info->mutexLock);
+
+	pthread_t threadID;
+	start_client_thread(&threadID, client_thread, clients[i]);
+	pthread_detach(threadID);
+    }
+    free(clients);
+
+    struct timespec ended;
+    clock_gettime(CLOCK_MONOTONIC, &ended);
+    fprintf(stderr, "psserver: took over %d clients in %.3f ms\n", 
+	    clientCount, (ended.tv_sec - began.tv_sec) * 
+	    MILLISECONDS_PER_SECOND + (ended.tv_nsec - began.tv_nsec) / 
+	    (NANOSECONDS_PER_SECOND / MILLISECONDS_PER_SECOND));
+    fflush(stderr);
+    return listenFD;
+}
+
+
+/* wait_for_slot()
+ * ---------------
+ * Waits until a connection slot is free and takes it, or until a hot 
+ * restart has been requested. Checks for a hot restart every 
+ * HANDOVER_POLL_MICROSECONDS.
+ *
+ * info: struct containing the shared client info (used to access the 
+ * semaphore responsible for connection limiting and the wake pipe)
+ *
+ * Returns: 1 if a slot was taken, or 0 if a hot restart has been requested
+ */
+int wait_for_slot(SharedClientInfo* info) {
+    if (info->wakeFd < 0) {
+	take_lock(info->threadLock);
+	return 1;
+    }
+    struct pollfd wake = {.fd = info->wakeFd, .events = POLLIN};
+    while (1) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_nsec += HANDOVER_POLL_MICROSECONDS * 1000L;
+	if (deadline.tv_nsec >= NANOSECONDS_PER_SECOND) {
+	    deadline.tv_sec++;
+	    deadline.tv_nsec -= NANOSECONDS_PER_SECOND;
+	}
+	if (sem_timedwait(info->threadLock, &deadline) == 0) {
+	    return 1;
+	}
+	if (poll(&wake, 1, 0) > 0 && (wake.revents & POLLIN)) {
+	    return 0;
+	}
     }
-    return NULL;
 }
 
 /* process_connections()
  * ---------------------
- * Initialises the struct containing the shared client info and creates the 
- * SIGUP signal handling thread. Then repeatedly waits for connections from
- * clients, creating client handling threads as required.
+ * Initialises the struct containing the shared client info, pins server 
+ * threads to the cores given by PSSERVER_CPUS if set, reads the rate 
+ * limits, starts the fan-out workers and creates the SIGUP signal handling
+ * thread. Takes over from a running server if requested, and listens for a
+ * server to hand over to if the PSSERVER_HANDOVER_PATH environment variable
+ * is set. Then repeatedly waits for connections from clients, creating 
+ * client handling threads as required, until handing over.
  *
- * fdServer: the listening socket file descriptor
+ * fdServer: the listening socket file descriptor (ignored when taking over)
  * connections: the maximum number of connections to be allowed
+ * takeoverPath: the path of the handover socket of the server to take over
+ * from, or NULL if not taking over
  *
  * Reference: this code was adapted from the Week 10 "server-multithreaded.c"
  * lecture example and the pthread_sigmask(3) man page
  */
-void process_connections(int fdServer, long connections) {
+void process_connections(int fdServer, long connections, 
+	char* takeoverPath) {
     int fd;
     struct sockaddr_in fromAddr;
     socklen_t fromAddrSize;
 
     StringMap* sm = stringmap_init();
+    StringMap* groups = stringmap_init();
+    StringMap* priorities = stringmap_init();
+    StringMap* clientLimits = stringmap_init();
+    StringMap* topicLimits = stringmap_init();
+    StringMap* prioClients = stringmap_init();
+    FanoutPool pool;
+    CpuPlacement* placement = init_cpu_placement();
+    ConnectionTable table;
+    init_connection_table(&table);
     sem_t mutexLock; // Lock responsible for ensuring mutual exclusion
     init_mutex_lock(&mutexLock);
     sem_t threadLock; // Lock responsible for connection limiting
     init_thread_lock(&threadLock, connections);
+    sem_t acceptParked; // Signalled once accepting stops for a handover
+    sem_init(&acceptParked, 0, 0);
+    sem_t acceptResume; // Signalled if the handover fails
+    sem_init(&acceptResume, 0, 0);
+
+    // Pipe written to when handing over, to wake threads waiting on sockets
+    char* handoverPath = getenv("PSSERVER_HANDOVER_PATH");
+    int wakePipe[] = {-1, -1};
+    if (handoverPath != NULL && pipe(wakePipe) < 0) {
+	fprintf(stderr, "psserver: unable to create handover pipe, hot "
+		"restarts disabled\n");
+	fflush(stderr);
+	handoverPath = NULL;
+    }
 
-    // Set up SIGHUP signal handling functionality
+    // Set up SIGHUP and SIGUSR1 signal handling functionality
     pthread_t sigThread; 
     sigset_t set;
     sigemptyset(&set);
     sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR1);
     pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    // Writer threads may still be writing to clients that have disconnected
+    signal(SIGPIPE, SIG_IGN);
+
+    // Start fan-out workers (after blocking signals so they inherit the mask)
+    init_fanout_pool(&pool, placement);
+    init_tracing();
+    init_queue_limit();
    
     // Shared data structure between clients
-    SharedClientInfo info = {.sm = sm, .mutexLock = &mutexLock, 
-	    .threadLock = &threadLock, .set = &set, .currentConnections = 0, 
+    SharedClientInfo info = {.sm = sm, .groups = groups, 
+	    .priorities = priorities, .clientLimits = clientLimits, 
+	    .topicLimits = topicLimits, .prioClients = prioClients, 
+	    .pool = &pool, .wheel = NULL, .table = &table, 
+	    .placement = placement, .mutexLock = &mutexLock, 
+	    .threadLock = &threadLock, .slotDebt = 0, .set = &set, 
+	    .fdServer = fdServer, .connections = connections, 
+	    .wakeFd = wakePipe[0], .wakeSignal = wakePipe[1], .handoverFd = -1, 
+	    .acceptParked = &acceptParked, .acceptResume = &acceptResume, 
+	    .parked = NULL, .parkedCount = 0, .handingOver = 0, 
+	    .leavingCount = 0, .currentConnections = 0, 
 	    .totalConnections = 0, .totalPub = 0, .totalSub = 0, 
-	    .totalUnsub = 0};
+	    .totalUnsub = 0, .totalReaped = 0, .totalReq = 0, .totalRep = 0, 
+	    .totalLimitRejects = 0, .totalLimitDelays = 0, 
+	    .totalLimitDrops = 0};
+    init_rate_limits(&info);
+    init_prio_clients(&info);
     
-    // Create dedicated signal handling thread
+    // Create dedicated signal handling and timer threads
     pthread_create(&sigThread, NULL, &sig_thread, &info);
+    init_timer_wheel(&info);
+
+    // Hot restart
+    if (takeoverPath != NULL) {
+	fdServer = info.fdServer = take_over(takeoverPath, &info);
+    }
+    if (handoverPath != NULL) {
+	open_handover(handoverPath, &info);
+    }
 
     // Repeatedly wait for new client connections
     while (1) {
+	// Connection limit specified - take a slot before accepting so that 
+	// a handover is not held up waiting for one
+	int handingOver = connections > 0 && !wait_for_slot(&info);
+	if (!handingOver && handoverPath != NULL && 
+		handover_requested(fdServer, info.wakeFd)) {
+	    handingOver = 1;
+	    if (connections > 0) {
+		release_lock(&threadLock);
+	    }
+	}
+
+	// Handing over - stop accepting until it is complete or has failed
+	if (handingOver) {
+	    release_lock(&acceptParked);
+	    take_lock(&acceptResume);
+	    continue;
+	}
+
 	fromAddrSize = sizeof(struct sockaddr_in);
 	fd = accept(fdServer, (struct sockaddr*) &fromAddr, &fromAddrSize);
 	char hostname[NI_MAXHOST];
 	getnameinfo((struct sockaddr*) &fromAddr, fromAddrSize,	hostname, 
 		NI_MAXHOST, NULL, 0, 0);
 
-	info.fd = fd;
+	ClientStart* start = malloc(sizeof(struct ClientStart));
+	start->info = &info;
+	start->fd = fd;
+	start->restored = 0;
 	pthread_t threadID;
 
-	// Connection limit specified
-	if (connections > 0) {
-	    take_lock(&threadLock);
-	}
+	// Counted before the thread starts so a handover waits for it
+	take_lock(&mutexLock);
+	info.currentConnections++;
+	release_lock(&mutexLock);
 
 	// Create client handling thread
-	pthread_create(&threadID, NULL, client_thread, &info);
+	start_client_thread(&threadID, client_thread, start);
 	pthread_detach(threadID);
     }
 }
@@ -605,14 +5260,7 @@ int open_listen(char* port) {
     }
 
     // Obtain port number if ephemeral and print
-    struct sockaddr_in ad;
-    memset(&ad, 0, sizeof(struct sockaddr_in));
-    socklen_t len = sizeof(struct sockaddr_in);
-    if (getsockname(listenFD, (struct sockaddr*) &ad, &len)) {
-	socket_error();
-    }
-    fprintf(stderr, "%u\n", ntohs(ad.sin_port));
-    fflush(stderr);
+    print_port(listenFD);
 
     return listenFD;
 }
@@ -647,7 +5295,9 @@ int main(int argc, char* argv[]) {
 	port = argv[PORT_ARG];
     }
 
-    int fdServer = open_listen(port);
-    process_connections(fdServer, connections);
+    // Inherit the listening socket when taking over from a running server
+    char* takeoverPath = getenv("PSSERVER_TAKEOVER");
+    int fdServer = takeoverPath == NULL ? open_listen(port) : -1;
+    process_connections(fdServer, connections, takeoverPath);
     return 0;
 }
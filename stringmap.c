@@ -2,20 +2,79 @@
 #include <string.h>
 #include <stdlib.h>
 
-/* Struct representing a node in a singly linked list of StringMapItems */
+#define INITIAL_BUCKETS 16
+
+/* Struct representing a node in a doubly linked list of StringMapItems, kept
+ * in the order they were added, which is also chained into the bucket of
+ * its key's hash */
 typedef struct StringMapNode {
     StringMapItem data;
     struct StringMapNode* next;
+    struct StringMapNode* prev;
+    struct StringMapNode* chain;
+    unsigned long hash;
 } StringMapNode;
 
-/* Struct containing the root node in the StringMap singly linked list */
+/* Struct containing the ends of the StringMap linked list and the hash
+ * table indexing it by key, which doubles in size once it holds as many
+ * items as buckets */
 struct StringMap {
     StringMapNode* root;
+    StringMapNode* tail;
+    StringMapNode** buckets;
+    unsigned long bucketCount;
+    unsigned long count;
 };
 
+/* hash_key()
+ * ----------
+ * Returns: the FNV-1a hash of the given key
+ */
+static unsigned long hash_key(const char* key) {
+    unsigned long hash = 14695981039346656037UL;
+    for (; *key != '\0'; key++) {
+	hash = (hash ^ (unsigned char) *key) * 1099511628211UL;
+    }
+    return hash;
+}
+
+/* find_node()
+ * -----------
+ * Returns: the node with the given key and hash, or NULL if there is none
+ */
+static StringMapNode* find_node(StringMap* sm, const char* key,
+	unsigned long hash) {
+    StringMapNode* node = sm->buckets[hash & (sm->bucketCount - 1)];
+    while (node != NULL && (node->hash != hash ||
+	    strcmp(key, node->data.key))) {
+	node = node->chain;
+    }
+    return node;
+}
+
+/* grow_buckets()
+ * --------------
+ * Doubles the number of buckets, rechaining every node.
+ */
+static void grow_buckets(StringMap* sm) {
+    free(sm->buckets);
+    sm->bucketCount *= 2;
+    sm->buckets = calloc(sm->bucketCount, sizeof(StringMapNode*));
+    for (StringMapNode* node = sm->root; node != NULL; node = node->next) {
+	StringMapNode** bucket = &sm->buckets[node->hash &
+		(sm->bucketCount - 1)];
+	node->chain = *bucket;
+	*bucket = node;
+    }
+}
+
 StringMap* stringmap_init(void) {
     StringMap* head = (StringMap*) malloc(sizeof(StringMap));
     head->root = NULL;
+    head->tail = NULL;
+    head->bucketCount = INITIAL_BUCKETS;
+    head->buckets = calloc(head->bucketCount, sizeof(StringMapNode*));
+    head->count = 0;
     return head;
 }
 
@@ -35,27 +94,13 @@ void stringmap_free(StringMap* sm) {
 	free(prevFree->data.key);
 	free(prevFree);
     }
+    free(sm->buckets);
     free(sm);
 }
 
 void* stringmap_search(StringMap* sm, char* key) {
-    StringMapNode* currentNode = sm->root;
-
-    // Iterate through list
-    while (1) {
-
-	// End of list reached
-	if (currentNode == NULL) {
-	    return NULL;
-	}
-	
-	// Match found
-	if (!strcmp(key, currentNode->data.key)) {
-	    break;
-	}
-	currentNode = currentNode->next;
-    }
-    return currentNode->data.item;
+    StringMapNode* node = find_node(sm, key, hash_key(key));
+    return node == NULL ? NULL : node->data.item;
 }
 
 int stringmap_add(StringMap* sm, char* key, void* item) {
@@ -65,37 +110,37 @@ int stringmap_add(StringMap* sm, char* key, void* item) {
 	return 0;
     }
 
-    // Finding end of list
-    StringMapNode* currentNode = sm->root;
-    StringMapNode* previousNode = NULL;
-    while (currentNode != NULL) {
-
-	// Node already exists in list
-	if (!strcmp(key, currentNode->data.key)) {
-	    return 0;
-	}
-	previousNode = currentNode;
-	currentNode = currentNode->next;
+    // Node already exists in list
+    unsigned long hash = hash_key(key);
+    if (find_node(sm, key, hash) != NULL) {
+	return 0;
     }
 
-    // Allocating node to add
+    // Initialising node to add with given key and item
     StringMapNode* nextNode = (StringMapNode*) malloc(sizeof(StringMapNode));
-
-    // Keep track of next node 
-    if (previousNode != NULL) {
-	previousNode->next = nextNode;
-    }
-
-    // Initialising node to add  with given key and item
-    nextNode->next = NULL;
     nextNode->data.key = (char*) malloc(strlen(key) + 1);
     strcpy(nextNode->data.key, key);
     nextNode->data.item = item;
+    nextNode->hash = hash;
 
-    // Set root to next node
-    if (sm->root == NULL) {
+    // Add to end of list
+    nextNode->next = NULL;
+    nextNode->prev = sm->tail;
+    if (sm->tail != NULL) {
+	sm->tail->next = nextNode;
+    } else {
 	sm->root = nextNode;
     }
+    sm->tail = nextNode;
+
+    // Index by key
+    if (++sm->count > sm->bucketCount) {
+	grow_buckets(sm);
+    } else {
+	StringMapNode** bucket = &sm->buckets[hash & (sm->bucketCount - 1)];
+	nextNode->chain = *bucket;
+	*bucket = nextNode;
+    }
     return 1;
 }
 
@@ -106,45 +151,37 @@ int stringmap_remove(StringMap* sm, char* key) {
 	return 0;
     }
 
-    // Iterate through list
-    StringMapNode* currentNode = sm->root;
-    StringMapNode* previousNode = NULL;
-    while (1) {
-
-	// Node not found 
-	if (currentNode == NULL) {
-	    return 0;
-	}
-
-	// Node found
-	if (!strcmp(currentNode->data.key, key)) {
-	    break;
-	}
-
-	previousNode = currentNode;
-	currentNode = currentNode->next;
+    // Unchain from bucket
+    unsigned long hash = hash_key(key);
+    StringMapNode** link = &sm->buckets[hash & (sm->bucketCount - 1)];
+    while (*link != NULL && ((*link)->hash != hash ||
+	    strcmp((*link)->data.key, key))) {
+	link = &(*link)->chain;
     }
 
-    StringMapNode* nextNode = currentNode->next;
-    
-    // Keep track of next node
-    if (previousNode != NULL) {
-	previousNode->next = nextNode;
+    // Node not found
+    StringMapNode* currentNode = *link;
+    if (currentNode == NULL) {
+	return 0;
     }
+    *link = currentNode->chain;
 
-    // Ensure that if last node is freed, the root is null
-    if (previousNode == NULL && nextNode == NULL) {
-	sm->root = NULL;
-    } 
-    
-    // Set root to next node
-    if (previousNode == NULL && nextNode != NULL) {
-	sm->root = nextNode;
+    // Unlink from list
+    if (currentNode->prev != NULL) {
+	currentNode->prev->next = currentNode->next;
+    } else {
+	sm->root = currentNode->next;
+    }
+    if (currentNode->next != NULL) {
+	currentNode->next->prev = currentNode->prev;
+    } else {
+	sm->tail = currentNode->prev;
     }
+    sm->count--;
 
     free(currentNode->data.key);
     free(currentNode);
-    
+
     return 1;
 }
 
@@ -156,19 +193,11 @@ StringMapItem* stringmap_iterate(StringMap* sm, StringMapItem* prev) {
 
     // Return first entry
     if (prev == NULL) {
-	return &(sm->root->data);
-    }
-
-    // Iterate
-    StringMapNode* currentNode = sm->root;
-    while (&(currentNode->data) != prev) {
-	currentNode = currentNode->next;
-	if (currentNode == NULL) {
-	    return NULL;
-	}
+	return sm->root == NULL ? NULL : &(sm->root->data);
     }
 
-    StringMapNode* targetNode = currentNode->next;
+    // Items are the first member of their node
+    StringMapNode* targetNode = ((StringMapNode*) prev)->next;
 
     // End of list reached
     if (targetNode == NULL) {
@@ -0,0 +1,240 @@
+/* Connection ID table test.
+ *
+ * Usage: connection_test
+ *
+ * Registers, unregisters and restores connections in a ConnectionTable
+ * in-process and checks that:
+ *   - slots are handed out in order and reused once freed, while serial
+ *     numbers never are, so a stale connection ID finds nothing;
+ *   - the table grows past INITIAL_CONNECTION_SLOTS;
+ *   - restoring IDs out of order frees the slots passed over for later
+ *     connections, and later serials follow the largest restored;
+ *   - handle_rep() delivers a reply to the connection named by its reply
+ *     address, drops one for a closed connection, and rejects malformed
+ *     addresses (including non-ASCII bytes) as invalid.
+ * Exits with status 1 on the first failure.
+ */
+#define main psserver_main
+#include "../psserver.c"
+#undef main
+
+#define GROWN_CONNECTIONS 200
+#define RESTORED_SLOT 5
+#define RESTORED_SERIAL 10
+#define REPLY_TIMEOUT_MILLISECONDS 1000
+
+/* check()
+ * -------
+ * Exits with status 1, naming the failed check, unless the condition holds.
+ */
+static void check(int condition, const char* what) {
+    if (!condition) {
+	printf("connection_test: FAILED: %s\n", what);
+	exit(1);
+    }
+}
+
+/* read_reply()
+ * ------------
+ * Reads the next line from the given socket into the given buffer, without
+ * its newline. The buffer is left empty if nothing arrives in time.
+ *
+ * fd: the socket to read from
+ * line: the buffer, of at least 64 bytes
+ */
+static void read_reply(int fd, char* line) {
+    int length = 0;
+    struct pollfd readable = {.fd = fd, .events = POLLIN};
+    while (length < 63 && poll(&readable, 1, REPLY_TIMEOUT_MILLISECONDS) > 0 &&
+	    read(fd, line + length, 1) == 1 && line[length] != '\n') {
+	length++;
+    }
+    line[length] = '\0';
+}
+
+/* expect_reply()
+ * --------------
+ * Checks that the next line read from the given socket is the given one.
+ *
+ * fd: the socket to read from
+ * expected: the line, without its newline
+ */
+static void expect_reply(int fd, const char* expected) {
+    char line[64];
+    read_reply(fd, line);
+    if (strcmp(line, expected)) {
+	printf("connection_test: FAILED: expected \"%s\", got \"%s\"\n",
+		expected, line);
+	exit(1);
+    }
+}
+
+/* reply()
+ * -------
+ * Handles the given "rep" line from the given client as client_thread()
+ * does.
+ *
+ * client: the replying client
+ * text: the line, without its newline
+ * info: the shared client info
+ */
+static void reply(Client client, const char* text, SharedClientInfo* info) {
+    char* line = strdup(text);
+    LineScan scan = {.length = 0, .commandEnd = -1, .argumentSpace = -1,
+	    .argumentColon = -1};
+    scan_libc(line, 0, strlen(line), &scan);
+    scan.length = strlen(line);
+    line[scan.commandEnd] = '\0';
+    handle_rep(client, line + scan.commandEnd + 1, &scan, info);
+    free(line);
+}
+
+/* check_ids()
+ * -----------
+ * Checks slot reuse and serial numbering in a fresh table.
+ */
+static void check_ids(void) {
+    ConnectionTable table;
+    init_connection_table(&table);
+    Connection connections[4];
+    for (int i = 0; i < 3; i++) {
+	register_connection(&table, &connections[i]);
+	check(connections[i].slot == i, "slots handed out in order");
+	check(connections[i].serial == (unsigned int) i + 1,
+		"serials handed out in order");
+    }
+    for (int i = 0; i < 3; i++) {
+	check(lookup_connection(&table, i, i + 1) == &connections[i],
+		"lookup by ID");
+    }
+
+    unregister_connection(&table, &connections[1]);
+    check(lookup_connection(&table, 1, 2) == NULL, "closed ID not found");
+    register_connection(&table, &connections[3]);
+    check(connections[3].slot == 1, "freed slot reused");
+    check(connections[3].serial == 4, "serial not reused");
+    check(lookup_connection(&table, 1, 2) == NULL, "stale ID not found");
+    check(lookup_connection(&table, 1, 4) == &connections[3],
+	    "reused slot found by its new ID");
+    check(lookup_connection(&table, 3, 4) == NULL, "unused slot not found");
+    check(lookup_connection(&table, (unsigned long) -1, 1) == NULL,
+	    "slot out of range not found");
+    free(table.connections);
+    free(table.freeSlots);
+}
+
+/* check_growth()
+ * --------------
+ * Checks that a table grows to hold more connections than it started with.
+ */
+static void check_growth(void) {
+    ConnectionTable table;
+    init_connection_table(&table);
+    Connection* connections = calloc(GROWN_CONNECTIONS, sizeof(Connection));
+    for (int i = 0; i < GROWN_CONNECTIONS; i++) {
+	register_connection(&table, &connections[i]);
+    }
+    check(table.capacity >= GROWN_CONNECTIONS, "table grown");
+    for (int i = 0; i < GROWN_CONNECTIONS; i++) {
+	check(lookup_connection(&table, connections[i].slot,
+		connections[i].serial) == &connections[i],
+		"lookup after growth");
+    }
+    free(connections);
+    free(table.connections);
+    free(table.freeSlots);
+}
+
+/* check_restore()
+ * ---------------
+ * Checks restoring IDs from a previous server out of order, as a hot
+ * restart does, followed by new connections.
+ */
+static void check_restore(void) {
+    ConnectionTable table;
+    init_connection_table(&table);
+    Connection restored[2];
+    restore_connection(&table, &restored[0], RESTORED_SLOT, RESTORED_SERIAL);
+    restore_connection(&table, &restored[1], 2, 3);
+    check(lookup_connection(&table, RESTORED_SLOT, RESTORED_SERIAL) ==
+	    &restored[0] && lookup_connection(&table, 2, 3) == &restored[1],
+	    "restored IDs found");
+
+    // Slots 0, 1, 3 and 4 were passed over, then the table continues
+    Connection added[RESTORED_SLOT];
+    int seen = 0;
+    for (int i = 0; i < RESTORED_SLOT; i++) {
+	register_connection(&table, &added[i]);
+	check(added[i].serial == (unsigned int) RESTORED_SERIAL + 1 + i,
+		"serials follow the largest restored");
+	check(added[i].slot != 2 && added[i].slot != RESTORED_SLOT,
+		"restored slots not handed out");
+	seen |= 1 << added[i].slot;
+    }
+    check(seen == (1 << 0 | 1 << 1 | 1 << 3 | 1 << 4 | 1 << 6),
+	    "passed over slots used before new ones");
+    free(table.connections);
+    free(table.freeSlots);
+}
+
+/* check_replies()
+ * ---------------
+ * Checks that handle_rep() routes replies by connection ID.
+ */
+static void check_replies(void) {
+    sem_t lock;
+    init_mutex_lock(&lock);
+    ConnectionTable table;
+    init_connection_table(&table);
+    SharedClientInfo info;
+    memset(&info, 0, sizeof(SharedClientInfo));
+    info.table = &table;
+    info.mutexLock = &lock;
+
+    int requesterPair[2];
+    int replierPair[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, requesterPair);
+    socketpair(AF_UNIX, SOCK_STREAM, 0, replierPair);
+    Client requester = {.toClient = fdopen(requesterPair[0], "w")};
+    requester.connection = open_connection(requester.toClient);
+    Client replier = {.toClient = fdopen(replierPair[0], "w"), .name = "r"};
+    replier.connection = open_connection(replier.toClient);
+    register_connection(&table, replier.connection);
+    register_connection(&table, requester.connection);
+
+    char line[64];
+    sprintf(line, "rep %d.%u.c1 answer", requester.connection->slot,
+	    requester.connection->serial);
+    reply(replier, line, &info);
+    expect_reply(requesterPair[1], ":rep c1 r:answer");
+    check(info.totalRep == 1, "reply counted");
+
+    // Malformed addresses
+    const char* invalid[] = {"rep x.1.c v", "rep 1.x.c v", "rep 1.1 v",
+	    "rep \xe9.1.c v", "rep 1.\xe9.c v", "rep 1.1.c", "rep 1.1.c:d v"};
+    for (int i = 0; i < (int) (sizeof(invalid) / sizeof(invalid[0])); i++) {
+	reply(replier, invalid[i], &info);
+	expect_reply(replierPair[1], ":invalid");
+    }
+
+    // Requester gone: the reply is dropped, but still counted
+    sprintf(line, "rep %d.%u.c2 late", requester.connection->slot,
+	    requester.connection->serial);
+    unregister_connection(&table, requester.connection);
+    reply(replier, line, &info);
+    struct pollfd readable = {.fd = requesterPair[1], .events = POLLIN};
+    check(poll(&readable, 1, REPLY_TIMEOUT_MILLISECONDS / 10) == 0,
+	    "reply to a closed connection dropped");
+    readable.fd = replierPair[1];
+    check(poll(&readable, 1, 0) == 0, "dropped reply not invalid");
+    check(info.totalRep == 2, "dropped reply counted");
+}
+
+int main(void) {
+    check_ids();
+    check_growth();
+    check_restore();
+    check_replies();
+    printf("connection_test: passed\n");
+    return 0;
+}
@@ -0,0 +1,207 @@
+/* Publish credit accounting test.
+ *
+ * Usage: credit_test
+ *
+ * Drives one publisher through handle_pub(), account_publish() and
+ * wait_for_credit() in-process, with its connection's output read back from
+ * a socket pair, and one subscriber whose queue depth is set directly
+ * (it has no writer thread). Checks that:
+ *   - turning credit on grants CREDIT_BATCH;
+ *   - publishes that are not admitted (invalid, unnamed, over a rate limit)
+ *     are refunded as ":credit 1" without spending or recording a topic;
+ *   - admitted publishes spend credit, which is topped back up to
+ *     CREDIT_BATCH once it falls to CREDIT_LOW_WATER;
+ *   - no credit is granted while the subscriber's queue is full, the full
+ *     queue is remembered as the bottleneck and checked on its own, and
+ *     credit is granted once it drains;
+ *   - a bottleneck that unsubscribes no longer holds credit back.
+ * Exits with status 1 on the first failure.
+ */
+#define main psserver_main
+#include "../psserver.c"
+#undef main
+
+#define REPLY_TIMEOUT_MILLISECONDS 1000
+
+static SharedClientInfo info;
+static int replies;
+
+/* check()
+ * -------
+ * Exits with status 1, naming the failed check, unless the condition holds.
+ */
+static void check(int condition, const char* what) {
+    if (!condition) {
+	printf("credit_test: FAILED: %s\n", what);
+	exit(1);
+    }
+}
+
+/* expect_reply()
+ * --------------
+ * Checks that the next line written to the publisher is the given one.
+ *
+ * expected: the line, without its newline
+ */
+static void expect_reply(const char* expected) {
+    char line[64];
+    int length = 0;
+    struct pollfd readable = {.fd = replies, .events = POLLIN};
+    while (length < (int) sizeof(line) - 1 &&
+	    poll(&readable, 1, REPLY_TIMEOUT_MILLISECONDS) > 0 &&
+	    read(replies, line + length, 1) == 1 && line[length] != '\n') {
+	length++;
+    }
+    line[length] = '\0';
+    if (strcmp(line, expected)) {
+	printf("credit_test: FAILED: expected \"%s\", got \"%s\"\n", expected,
+		line);
+	exit(1);
+    }
+}
+
+/* expect_silence()
+ * ----------------
+ * Checks that nothing more has been written to the publisher.
+ */
+static void expect_silence(void) {
+    struct pollfd readable = {.fd = replies, .events = POLLIN};
+    check(poll(&readable, 1, REPLY_TIMEOUT_MILLISECONDS / 10) == 0,
+	    "no further replies");
+}
+
+/* publish()
+ * ---------
+ * Handles the given "pub" line from the given client as client_thread()
+ * does.
+ *
+ * client: the publishing client
+ * text: the line, without its newline
+ *
+ * Returns: whether the publish was admitted
+ */
+static int publish(Client* client, const char* text) {
+    char* line = strdup(text);
+    LineScan scan = {.length = 0, .commandEnd = -1, .argumentSpace = -1,
+	    .argumentColon = -1};
+    scan_libc(line, 0, strlen(line), &scan);
+    scan.length = strlen(line);
+    line[scan.commandEnd] = '\0';
+    char* argument = line + scan.commandEnd + 1;
+    int admitted = handle_pub(*client, argument, &scan, &info);
+    account_publish(client, admitted, argument, scan.length, &info);
+    free(line);
+    return admitted;
+}
+
+int main(void) {
+    sem_t lock;
+    init_mutex_lock(&lock);
+    ConnectionTable table;
+    init_connection_table(&table);
+    memset(&info, 0, sizeof(SharedClientInfo));
+    info.sm = stringmap_init();
+    info.groups = stringmap_init();
+    info.priorities = stringmap_init();
+    info.clientLimits = stringmap_init();
+    info.topicLimits = stringmap_init();
+    info.table = &table;
+    info.mutexLock = &lock;
+
+    // Publisher, whose output is read back from the other end of a pair
+    int publisherPair[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, publisherPair);
+    replies = publisherPair[1];
+    Client publisher = {.toClient = fdopen(publisherPair[0], "w"),
+	    .connection = NULL, .name = NULL};
+    publisher.connection = open_connection(publisher.toClient);
+    register_connection(&table, publisher.connection);
+
+    // Subscriber without a writer, so its queue only drains when told to
+    int subscriberPair[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, subscriberPair);
+    Connection* connection = calloc(1, sizeof(Connection));
+    connection->toClient = fdopen(subscriberPair[0], "w");
+    init_mutex_lock(&connection->queueLock);
+    sem_init(&connection->pending, 0, 0);
+    register_connection(&table, connection);
+    Client subscriber = {.name = "s", .connection = connection,
+	    .subbedTopics = malloc(sizeof(char*)), .subCount = 0};
+    int bufferSize = 1;
+    char topic[] = "t";
+    handle_sub(&subscriber, topic, &info, &bufferSize, COUNT);
+
+    handle_credit(&publisher, "on");
+    expect_reply(":credit 64");
+    check(publisher.credit.outstanding == CREDIT_BATCH, "first grant");
+
+    // Not admitted: unnamed, invalid and over a rate limit
+    check(!publish(&publisher, "pub t unnamed"), "unnamed publish refused");
+    expect_reply(":credit 1");
+    publisher.name = "p";
+    check(!publish(&publisher, "pub t"), "invalid publish refused");
+    expect_reply(":invalid");
+    expect_reply(":credit 1");
+    char limit[] = "0.001/1/drop";
+    publisher.limit = parse_rate_limit(limit);
+    check(publish(&publisher, "pub t first"), "publish within limit");
+    check(!publish(&publisher, "pub t second"), "publish over limit");
+    expect_reply(":credit 1");
+    publisher.limit = NULL;
+    check(publisher.credit.outstanding == CREDIT_BATCH - 1,
+	    "refused publishes spend nothing");
+    check(publisher.credit.topicCount == 1 &&
+	    publisher.credit.messages == 1, "refused publishes not recorded");
+
+    // Admitted publishes spend credit until topped up at the low water mark
+    while (publisher.credit.outstanding > CREDIT_LOW_WATER + 1) {
+	check(publish(&publisher, "pub t value"), "publish admitted");
+    }
+    expect_silence();
+    check(publish(&publisher, "pub t value"), "publish admitted");
+    expect_reply(":credit 32");
+    check(publisher.credit.outstanding == CREDIT_BATCH, "topped up");
+    check(publisher.credit.topicCount == 0, "topics forgotten on grant");
+
+    // Full downstream queue: no credit, and the queue is remembered
+    connection->queuedBytes = CREDIT_QUEUE_LIMIT;
+    while (publisher.credit.outstanding > 0) {
+	check(publish(&publisher, "pub t value"), "publish admitted");
+    }
+    expect_silence();
+    check(publisher.credit.bottleneckSerial == connection->serial &&
+	    publisher.credit.bottleneckSlot == connection->slot,
+	    "bottleneck remembered");
+    check(bottleneck_depth(&publisher, &info) >= CREDIT_QUEUE_LIMIT,
+	    "bottleneck depth");
+    check(refresh_credit(&publisher, &info) == 0, "no credit while full");
+
+    // Drained: waiting for credit is granted a full batch
+    connection->queuedBytes = 0;
+    int wakePipe[2];
+    pipe(wakePipe);
+    info.wakeFd = wakePipe[0];
+    LineReader reader;
+    init_line_reader(&reader, publisherPair[0], wakePipe[0]);
+    check(wait_for_credit(&publisher, &reader, &info) == 1,
+	    "wait for credit");
+    expect_reply(":credit 64");
+    check(publisher.credit.bottleneckSerial == 0,
+	    "bottleneck forgotten on grant");
+
+    // A full queue that is no longer downstream does not hold credit back
+    connection->queuedBytes = CREDIT_QUEUE_LIMIT;
+    for (int i = 0; i < CREDIT_BATCH - CREDIT_LOW_WATER; i++) {
+	check(publish(&publisher, "pub t value"), "publish admitted");
+    }
+    check(refresh_credit(&publisher, &info) == 0, "no credit while full");
+    handle_unsub(subscriber, topic, &info, COUNT);
+    check(bottleneck_depth(&publisher, &info) == -1,
+	    "unsubscribed bottleneck ignored");
+    check(refresh_credit(&publisher, &info) == CREDIT_BATCH -
+	    CREDIT_LOW_WATER, "credit once the bottleneck unsubscribes");
+    expect_reply(":credit 32");
+
+    printf("credit_test: passed\n");
+    return 0;
+}
@@ -0,0 +1,198 @@
+/* Publish rate limit test.
+ *
+ * Usage: rate_test
+ *
+ * Exercises the token buckets behind PSSERVER_RATE_LIMITS in-process, with
+ * rates slow enough that no token is earned back while the test runs.
+ * Checks that:
+ *   - parse_rate_limit() accepts "<rate>/<burst>/<action>" and rejects
+ *     anything else;
+ *   - a bucket lets a burst through at once, then refuses without taking a
+ *     token, or takes one to wait for;
+ *   - take_tokens() takes from both buckets or from neither, reports the
+ *     action of the one that refused, and waits for the later of two
+ *     limits that delay;
+ *   - admit_publish() answers a rejected publish with ":ratelimited" and
+ *     counts each outcome.
+ * Exits with status 1 on the first failure.
+ */
+#define main psserver_main
+#include "../psserver.c"
+#undef main
+
+#define SLOW_RATE "0.001"
+#define REPLY_TIMEOUT_MILLISECONDS 1000
+
+/* check()
+ * -------
+ * Exits with status 1, naming the failed check, unless the condition holds.
+ */
+static void check(int condition, const char* what) {
+    if (!condition) {
+	printf("rate_test: FAILED: %s\n", what);
+	exit(1);
+    }
+}
+
+/* limit()
+ * -------
+ * Returns: the given rate limit, which must be valid, newly parsed
+ */
+static RateLimit* limit(const char* spec) {
+    char* copy = strdup(spec);
+    RateLimit* parsed = parse_rate_limit(copy);
+    free(copy);
+    check(parsed != NULL, spec);
+    return parsed;
+}
+
+/* check_parse()
+ * -------------
+ * Checks parsing of valid and invalid rate limits.
+ */
+static void check_parse(void) {
+    RateLimit* parsed = limit("10/5/reject");
+    check(parsed->interval == NANOSECONDS_PER_SECOND / 10, "interval");
+    check(parsed->tolerance == 4 * parsed->interval, "tolerance");
+    check(parsed->action == LIMIT_REJECT, "reject action");
+    free(parsed);
+    parsed = limit("2.5/1/delay");
+    check(parsed->interval == NANOSECONDS_PER_SECOND * 2 / 5 &&
+	    parsed->tolerance == 0 && parsed->action == LIMIT_DELAY,
+	    "fractional rate");
+    free(parsed);
+    parsed = limit("1e12/1/drop");
+    check(parsed->interval == 1 && parsed->action == LIMIT_DROP,
+	    "interval at least 1 ns");
+    free(parsed);
+
+    const char* invalid[] = {"0/1/drop", "-1/1/drop", "10/0/drop", "10/5",
+	    "10/5/", "10/5/dropped", "10", "fast/1/drop", ""};
+    for (int i = 0; i < (int) (sizeof(invalid) / sizeof(invalid[0])); i++) {
+	char* copy = strdup(invalid[i]);
+	check(parse_rate_limit(copy) == NULL, "invalid limit refused");
+	free(copy);
+    }
+}
+
+/* check_bucket()
+ * --------------
+ * Checks a single bucket's burst, refusals and waits.
+ */
+static void check_bucket(void) {
+    RateLimit* bucket = limit(SLOW_RATE "/3/reject");
+    check(time_until_token(bucket, 0, 100) == 0, "empty bucket conforms");
+    check(time_until_token(bucket, 100 + bucket->tolerance, 100) == 0,
+	    "arrival within tolerance conforms");
+    check(time_until_token(bucket, 101 + bucket->tolerance, 100) == 1,
+	    "arrival beyond tolerance waits");
+
+    for (int i = 0; i < 3; i++) {
+	check(take_token(bucket, 0) == 0, "burst conforms");
+    }
+    unsigned long arrival = bucket->arrival;
+    unsigned long early = take_token(bucket, 0);
+    check(early > 0 && early <= bucket->interval, "over the burst refused");
+    check(bucket->arrival == arrival, "refusal takes no token");
+    check(peek_token(bucket) > 0, "peek agrees");
+    check(take_token(bucket, 1) > 0, "wait takes a token");
+    check(bucket->arrival == arrival + bucket->interval, "token taken");
+    return_token(bucket);
+    check(bucket->arrival == arrival, "token given back");
+    check(peek_token(NULL) == 0, "no limit conforms");
+    free(bucket);
+}
+
+/* check_pairs()
+ * -------------
+ * Checks take_tokens() with a client limit and a topic limit.
+ */
+static void check_pairs(void) {
+    unsigned long delay;
+    RateLimit* none[] = {NULL, NULL};
+    check(take_tokens(none, 2, &delay) == LIMIT_DELAY && delay == 0,
+	    "no limits admit");
+
+    // Topic refuses first: the client's token is not taken
+    RateLimit* client = limit(SLOW_RATE "/2/reject");
+    RateLimit* topic = limit(SLOW_RATE "/1/drop");
+    RateLimit* both[] = {client, topic};
+    check(take_tokens(both, 2, &delay) == LIMIT_DELAY && delay == 0,
+	    "first publish admitted");
+    unsigned long clientArrival = client->arrival;
+    check(take_tokens(both, 2, &delay) == LIMIT_DROP, "topic drops");
+    check(client->arrival == clientArrival, "client token not taken");
+
+    // Client refuses: the topic's token is not taken either
+    RateLimit* other = limit(SLOW_RATE "/5/drop");
+    both[1] = other;
+    check(take_tokens(both, 2, &delay) == LIMIT_DELAY, "second admitted");
+    unsigned long otherArrival = other->arrival;
+    check(take_tokens(both, 2, &delay) == LIMIT_REJECT, "client rejects");
+    check(other->arrival == otherArrival, "topic token not taken");
+
+    // Two limits that delay: wait for the later one, taking both tokens
+    RateLimit* shorter = limit("1/1/delay");
+    RateLimit* longer = limit("0.5/1/delay");
+    RateLimit* delays[] = {shorter, longer};
+    check(take_tokens(delays, 2, &delay) == LIMIT_DELAY && delay == 0,
+	    "first delayed publish immediate");
+    check(take_tokens(delays, 2, &delay) == LIMIT_DELAY, "delay admits");
+    check(delay > shorter->interval && delay <= longer->interval,
+	    "delay is the longer wait");
+    check(shorter->arrival > 0 && longer->arrival > longer->interval,
+	    "both delay tokens taken");
+    free(client);
+    free(topic);
+    free(other);
+    free(shorter);
+    free(longer);
+}
+
+/* check_admit()
+ * -------------
+ * Checks admit_publish() replies and statistics.
+ */
+static void check_admit(void) {
+    SharedClientInfo info;
+    memset(&info, 0, sizeof(SharedClientInfo));
+    info.topicLimits = stringmap_init();
+    stringmap_add(info.topicLimits, "dropped", limit(SLOW_RATE "/1/drop"));
+
+    int pair[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    Client client = {.toClient = fdopen(pair[0], "w"), .name = "p",
+	    .limit = limit(SLOW_RATE "/1/reject")};
+    client.connection = open_connection(client.toClient);
+
+    check(admit_publish(client, "t", &info), "first publish admitted");
+    check(!admit_publish(client, "t", &info), "second publish rejected");
+    check(info.totalLimitRejects == 1, "rejection counted");
+    char line[64];
+    int length = 0;
+    struct pollfd readable = {.fd = pair[1], .events = POLLIN};
+    while (length < (int) sizeof(line) - 1 &&
+	    poll(&readable, 1, REPLY_TIMEOUT_MILLISECONDS) > 0 &&
+	    read(pair[1], line + length, 1) == 1 && line[length] != '\n') {
+	length++;
+    }
+    line[length] = '\0';
+    check(!strcmp(line, ":ratelimited t"), "rejection answered");
+
+    client.limit = NULL;
+    check(admit_publish(client, "dropped", &info), "first drop admitted");
+    check(!admit_publish(client, "dropped", &info), "second dropped");
+    check(info.totalLimitDrops == 1 && info.totalLimitRejects == 1,
+	    "drop counted");
+    check(poll(&readable, 1, REPLY_TIMEOUT_MILLISECONDS / 10) == 0,
+	    "drop not answered");
+}
+
+int main(void) {
+    check_parse();
+    check_bucket();
+    check_pairs();
+    check_admit();
+    printf("rate_test: passed\n");
+    return 0;
+}
@@ -0,0 +1,209 @@
+/* Line scanner equivalence test.
+ *
+ * Usage: scan_test
+ *
+ * Checks scan_scalar() against a naive definition of a line scan, then checks
+ * scan_libc(), and scan_sse2() and scan_avx2() where the processor supports
+ * them, against scan_scalar() for:
+ *   - every line of up to 8 bytes made of 'a', ' ', ':' and '\n';
+ *   - every position of one separator in lines of every length up to
+ *     MAX_LENGTH;
+ *   - every pair of separator positions in a line of MAX_LENGTH bytes;
+ * each starting at every alignment up to MAX_ALIGNMENT. Short lines are also
+ * scanned in two parts split at every position, as the line reader does when
+ * a line arrives in pieces. Exits with status 1 on the first mismatch.
+ */
+#define main psserver_main
+#include "../psserver.c"
+#undef main
+
+#define MAX_ALIGNMENT 64
+#define MAX_LENGTH 160
+#define EXHAUSTIVE_LENGTH 8
+#define SPLIT_LENGTH 64
+
+typedef int (*Scanner)(char*, int, int, LineScan*);
+
+/* Scanners to compare with scan_scalar(), and their names */
+static Scanner scanners[3] = {scan_libc};
+static const char* scannerNames[3] = {"libc"};
+static int scannerCount = 1;
+static long cases = 0;
+
+/* naive_scan()
+ * ------------
+ * Scans the given line by definition: the first newline ends it, the first
+ * space ends the command, and the argument's first space and first colon
+ * are relative to the start of the argument.
+ *
+ * line: the line
+ * length: the number of bytes to scan
+ * scan: set to the separators found
+ *
+ * Returns: the position of the newline, or -1 if there is none
+ */
+static int naive_scan(char* line, int length, LineScan* scan) {
+    char* newline = memchr(line, '\n', length);
+    int end = newline == NULL ? length : newline - line;
+    char* space = memchr(line, ' ', end);
+    scan->commandEnd = space == NULL ? -1 : space - line;
+    scan->argumentSpace = -1;
+    scan->argumentColon = -1;
+    if (space != NULL) {
+	char* argument = space + 1;
+	int argumentLength = end - (argument - line);
+	char* second = memchr(argument, ' ', argumentLength);
+	char* colon = memchr(argument, ':', argumentLength);
+	scan->argumentSpace = second == NULL ? -1 : second - argument;
+	scan->argumentColon = colon == NULL ? -1 : colon - argument;
+    }
+    return newline == NULL ? -1 : end;
+}
+
+/* run_scan()
+ * ----------
+ * Scans the given line with the given scanner in two parts, split at the
+ * given position.
+ *
+ * scanner: the scanner
+ * line: the line
+ * length: the number of bytes to scan
+ * split: the position the first part ends at
+ * scan: set to the separators found
+ *
+ * Returns: the position of the newline, or -1 if there is none
+ */
+static int run_scan(Scanner scanner, char* line, int length, int split,
+	LineScan* scan) {
+    LineScan empty = {0, -1, -1, -1};
+    *scan = empty;
+    int newline = scanner(line, 0, split, scan);
+    return newline >= 0 ? newline : scanner(line, split, length, scan);
+}
+
+/* same_scan()
+ * -----------
+ * Returns: 1 if the two scans found the same newline and separators, else 0
+ */
+static int same_scan(int newline, LineScan* scan, int expectedNewline,
+	LineScan* expected) {
+    return newline == expectedNewline &&
+	    scan->commandEnd == expected->commandEnd &&
+	    scan->argumentSpace == expected->argumentSpace &&
+	    scan->argumentColon == expected->argumentColon;
+}
+
+/* fail()
+ * ------
+ * Reports a mismatch with the line it was found on and exits.
+ */
+static void fail(const char* name, char* line, int length, int split,
+	int newline, LineScan* scan, int expectedNewline,
+	LineScan* expected) {
+    printf("%s mismatch: length %d split %d alignment %d\nline \"", name,
+	    length, split, (int) ((unsigned long) line % MAX_ALIGNMENT));
+    for (int i = 0; i < length; i++) {
+	printf(line[i] == '\n' ? "\\n" : "%c", line[i]);
+    }
+    printf("\"\ngot %d %d %d %d, expected %d %d %d %d\n", newline,
+	    scan->commandEnd, scan->argumentSpace, scan->argumentColon,
+	    expectedNewline, expected->commandEnd, expected->argumentSpace,
+	    expected->argumentColon);
+    exit(1);
+}
+
+/* check_line()
+ * ------------
+ * Checks every scanner against the naive scan of the given line, scanning
+ * it whole and, if it is short, split at every position.
+ *
+ * line: the line
+ * length: the number of bytes in the line
+ */
+static void check_line(char* line, int length) {
+    LineScan expected;
+    int expectedNewline = naive_scan(line, length, &expected);
+    int lastSplit = length <= SPLIT_LENGTH ? length : 0;
+    for (int split = 0; split <= lastSplit; split++) {
+	LineScan scan;
+	int newline = run_scan(scan_scalar, line, length, split, &scan);
+	if (!same_scan(newline, &scan, expectedNewline, &expected)) {
+	    fail("scalar", line, length, split, newline, &scan,
+		    expectedNewline, &expected);
+	}
+	for (int i = 0; i < scannerCount; i++) {
+	    newline = run_scan(scanners[i], line, length, split, &scan);
+	    if (!same_scan(newline, &scan, expectedNewline, &expected)) {
+		fail(scannerNames[i], line, length, split, newline, &scan,
+			expectedNewline, &expected);
+	    }
+	}
+	cases++;
+    }
+}
+
+int main(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+	scannerNames[scannerCount] = "sse2";
+	scanners[scannerCount++] = scan_sse2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+	scannerNames[scannerCount] = "avx2";
+	scanners[scannerCount++] = scan_avx2;
+    }
+#endif
+    static const char alphabet[] = {'a', ' ', ':', '\n'};
+    static const char separators[] = {' ', ':', '\n'};
+    char* memory = aligned_alloc(MAX_ALIGNMENT, 2 * MAX_ALIGNMENT +
+	    MAX_LENGTH);
+
+    for (int alignment = 0; alignment < MAX_ALIGNMENT; alignment++) {
+	char* line = memory + alignment;
+
+	// Every short line over the alphabet
+	for (int length = 0; length <= EXHAUSTIVE_LENGTH; length++) {
+	    long total = 1L << (2 * length);
+	    for (long value = 0; value < total; value++) {
+		for (int i = 0; i < length; i++) {
+		    line[i] = alphabet[(value >> (2 * i)) & 3];
+		}
+		check_line(line, length);
+	    }
+	}
+
+	// Every position of one separator at every length
+	for (int length = 0; length <= MAX_LENGTH; length++) {
+	    for (int first = 0; first < length; first++) {
+		for (int a = 0; a < (int) sizeof(separators); a++) {
+		    memset(line, 'x', length);
+		    line[first] = separators[a];
+		    check_line(line, length);
+		}
+	    }
+	}
+
+	// Every pair of separator positions
+	for (int first = 0; first < MAX_LENGTH; first++) {
+	    for (int second = first + 1; second < MAX_LENGTH; second++) {
+		for (int a = 0; a < (int) sizeof(separators); a++) {
+		    for (int b = 0; b < (int) sizeof(separators); b++) {
+			memset(line, 'x', MAX_LENGTH);
+			line[first] = separators[a];
+			line[second] = separators[b];
+			check_line(line, MAX_LENGTH);
+		    }
+		}
+	    }
+	}
+    }
+    free(memory);
+
+    printf("scan_test: %ld scans agree (scalar", cases);
+    for (int i = 0; i < scannerCount; i++) {
+	printf(", %s", scannerNames[i]);
+    }
+    printf(")\n");
+    return 0;
+}
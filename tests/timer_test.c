@@ -0,0 +1,248 @@
+/* Idle timer wheel test.
+ *
+ * Usage: timer_test
+ *
+ * Drives a TimerWheel in-process by calling advance_wheel() directly, with
+ * an idle timeout and no keepalive, so every timer that fires for a silent
+ * connection reaps it by shutting down its end of a socket pair. Checks
+ * that:
+ *   - wheel_insert() places a timer in the level its expiry calls for and
+ *     clamps expiries beyond the wheel's span;
+ *   - timers fire on exactly their expiry tick, in expiry order, whether
+ *     due within the lowest level or cascaded down from every level above,
+ *     including expiries that fall on a level boundary;
+ *   - a removed timer never fires, and removing it again is harmless;
+ *   - a connection that sent a line, or acknowledged bytes flushed to it,
+ *     since its timer was scheduled is rescheduled instead of reaped.
+ * Exits with status 1 on the first failure.
+ */
+#define main psserver_main
+#include "../psserver.c"
+#undef main
+
+#define TIMEOUT_TICKS 10
+#define START_TICK 100
+#define NUM_TIMERS 12
+
+/* Struct containing a timer under test and both ends of its socket pair */
+typedef struct TestTimer {
+    IdleTimer timer;
+    Connection connection;
+    int peer;
+    unsigned long expected;
+    unsigned long fired;
+} TestTimer;
+
+static SharedClientInfo info;
+static sem_t lock;
+
+/* check()
+ * -------
+ * Exits with status 1, naming the failed check, unless the condition holds.
+ */
+static void check(int condition, const char* what) {
+    if (!condition) {
+	printf("timer_test: FAILED: %s\n", what);
+	exit(1);
+    }
+}
+
+/* new_wheel()
+ * -----------
+ * Returns: a newly allocated wheel with the test's idle timeout, whose
+ * clock reads the given tick
+ */
+static TimerWheel* new_wheel(unsigned long now) {
+    TimerWheel* wheel = calloc(1, sizeof(struct TimerWheel));
+    wheel->timeout = TIMEOUT_TICKS;
+    wheel->now = now;
+    init_mutex_lock(&wheel->lock);
+    return wheel;
+}
+
+/* init_test_timer()
+ * -----------------
+ * Sets up a timer for a silent connection on a new socket pair, expecting
+ * it to fire at the given tick.
+ *
+ * test: the timer to set up
+ * expected: the tick it is expected to fire at
+ */
+static void init_test_timer(TestTimer* test, unsigned long expected) {
+    int pair[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    memset(test, 0, sizeof(TestTimer));
+    test->timer.fd = pair[0];
+    test->timer.connection = &test->connection;
+    test->peer = pair[1];
+    test->expected = expected;
+}
+
+/* reaped()
+ * --------
+ * Returns: whether the given timer's connection has been shut down
+ */
+static int reaped(TestTimer* test) {
+    struct pollfd readable = {.fd = test->peer, .events = POLLIN};
+    return poll(&readable, 1, 0) > 0;
+}
+
+/* run_until()
+ * -----------
+ * Advances the wheel to the given tick, noting the tick at which each of
+ * the given timers is reaped.
+ *
+ * wheel: the wheel to advance
+ * tests: the timers to watch
+ * count: the number of timers
+ * end: the tick to stop at
+ */
+static void run_until(TimerWheel* wheel, TestTimer* tests, int count,
+	unsigned long end) {
+    while (wheel->now < end) {
+	int before = info.totalReaped;
+	advance_wheel(wheel, &info);
+	if (info.totalReaped == before) {
+	    continue;
+	}
+	for (int i = 0; i < count; i++) {
+	    if (tests[i].fired == 0 && reaped(&tests[i])) {
+		tests[i].fired = wheel->now;
+	    }
+	}
+    }
+}
+
+/* check_levels()
+ * --------------
+ * Checks the level and slot each expiry is placed in.
+ */
+static void check_levels(void) {
+    TimerWheel* wheel = new_wheel(START_TICK);
+    unsigned long span = 1UL << (WHEEL_BITS * WHEEL_LEVELS);
+    struct {
+	unsigned long expiry;
+	int level;
+    } cases[] = {{START_TICK, 0}, {START_TICK + WHEEL_SLOTS - 1, 0},
+	    {START_TICK + WHEEL_SLOTS, 1},
+	    {START_TICK + WHEEL_SLOTS * WHEEL_SLOTS - 1, 1},
+	    {START_TICK + WHEEL_SLOTS * WHEEL_SLOTS, 2},
+	    {START_TICK + span - 1, WHEEL_LEVELS - 1}};
+    for (int i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++) {
+	IdleTimer timer;
+	wheel_insert(wheel, &timer, cases[i].expiry);
+	int level = cases[i].level;
+	check(timer.slot == &wheel->slots[level][(cases[i].expiry >>
+		(WHEEL_BITS * level)) & WHEEL_MASK], "timer in its level");
+	check(timer.expiry == cases[i].expiry, "expiry kept");
+	wheel_remove(&timer);
+    }
+
+    IdleTimer timer;
+    wheel_insert(wheel, &timer, START_TICK + span * 2);
+    check(timer.expiry == START_TICK + span - 1, "long expiry clamped");
+    wheel_remove(&timer);
+    wheel_insert(wheel, &timer, START_TICK - 1);
+    check(timer.expiry == START_TICK, "past expiry due now");
+    wheel_remove(&timer);
+    free(wheel);
+}
+
+/* check_order()
+ * -------------
+ * Checks that timers due across every level fire on their expiry tick,
+ * and that a removed timer does not fire.
+ */
+static void check_order(void) {
+    TimerWheel* wheel = new_wheel(START_TICK);
+    unsigned long level2 = WHEEL_SLOTS * WHEEL_SLOTS;
+    unsigned long level3 = level2 * WHEEL_SLOTS;
+    unsigned long expiries[NUM_TIMERS] = {START_TICK + 1,
+	    START_TICK + TIMEOUT_TICKS, WHEEL_SLOTS * 2,
+	    WHEEL_SLOTS * 2 + 1, START_TICK + WHEEL_SLOTS * 5 + 3, level2,
+	    level2 + 1, level2 * 3 - 1, level2 * 7 + WHEEL_SLOTS + 7, level3,
+	    level3 + level2 + WHEEL_SLOTS + 1, level3 * 3 + 5};
+    TestTimer tests[NUM_TIMERS];
+
+    // Inserted in reverse, so that firing in order is not insertion order
+    for (int i = NUM_TIMERS - 1; i >= 0; i--) {
+	init_test_timer(&tests[i], expiries[i]);
+	tests[i].timer.lastActivity = expiries[i] - TIMEOUT_TICKS;
+	take_lock(&wheel->lock);
+	schedule_idle_timer(wheel, &tests[i].timer);
+	release_lock(&wheel->lock);
+	check(tests[i].timer.expiry == expiries[i], "scheduled at timeout");
+    }
+    TestTimer removed;
+    init_test_timer(&removed, 0);
+    removed.timer.lastActivity = level2 * 2;
+    schedule_idle_timer(wheel, &removed.timer);
+    wheel_remove(&removed.timer);
+    wheel_remove(&removed.timer);
+    check(removed.timer.slot == NULL, "removed timer has no slot");
+
+    run_until(wheel, tests, NUM_TIMERS, expiries[NUM_TIMERS - 1] + 1);
+    for (int i = 0; i < NUM_TIMERS; i++) {
+	if (tests[i].fired != tests[i].expected) {
+	    printf("timer_test: FAILED: timer due at %lu fired at %lu\n",
+		    tests[i].expected, tests[i].fired);
+	    exit(1);
+	}
+    }
+    check(info.totalReaped == NUM_TIMERS, "each timer fired once");
+    check(!reaped(&removed), "removed timer did not fire");
+    free(wheel);
+}
+
+/* check_activity()
+ * ----------------
+ * Checks that activity since a timer was scheduled defers reaping.
+ */
+static void check_activity(void) {
+    TimerWheel* wheel = new_wheel(START_TICK);
+    TestTimer tests[3];
+    for (int i = 0; i < 3; i++) {
+	init_test_timer(&tests[i], START_TICK + TIMEOUT_TICKS);
+	tests[i].timer.lastActivity = START_TICK;
+	schedule_idle_timer(wheel, &tests[i].timer);
+    }
+    int before = info.totalReaped;
+
+    // A line received, and bytes flushed to the client and acknowledged
+    // (nothing is really written, so none are left unsent)
+    tests[1].timer.lastActivity = START_TICK + 4;
+    tests[1].expected = START_TICK + 4 + TIMEOUT_TICKS;
+    tests[2].connection.flushedBytes = 100;
+    tests[2].expected = START_TICK + TIMEOUT_TICKS * 2;
+    run_until(wheel, tests, 3, START_TICK + TIMEOUT_TICKS * 3);
+    for (int i = 0; i < 3; i++) {
+	if (tests[i].fired != tests[i].expected) {
+	    printf("timer_test: FAILED: active timer %d due at %lu fired at "
+		    "%lu\n", i, tests[i].expected, tests[i].fired);
+	    exit(1);
+	}
+    }
+    check(info.totalReaped == before + 3, "active timers reaped later");
+
+    // Acknowledged pings alone are not activity
+    TestTimer pinged;
+    init_test_timer(&pinged, wheel->now + TIMEOUT_TICKS);
+    pinged.timer.lastActivity = wheel->now;
+    schedule_idle_timer(wheel, &pinged.timer);
+    pinged.connection.flushedBytes = 20;
+    pinged.timer.pingBytes = 20;
+    run_until(wheel, &pinged, 1, wheel->now + TIMEOUT_TICKS * 2);
+    check(pinged.fired == pinged.expected, "pings are not activity");
+    free(wheel);
+}
+
+int main(void) {
+    init_mutex_lock(&lock);
+    memset(&info, 0, sizeof(SharedClientInfo));
+    info.mutexLock = &lock;
+    check_levels();
+    check_order();
+    check_activity();
+    printf("timer_test: passed\n");
+    return 0;
+}